@@ -0,0 +1,109 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace orthorectify {
+namespace bench {
+
+	// Timing state of a benchmark run. The body runs the measured code in a
+	// while (state.keep_running()) loop, setup before the loop is not timed
+	class State
+	{
+		std::vector<int64_t> _args;
+		int64_t _iterations;
+		int64_t _remaining;
+
+		int64_t _items;
+		int64_t _bytes;
+
+		std::chrono::steady_clock::time_point _start;
+		std::chrono::steady_clock::duration _elapsed;
+
+	public:
+
+		State(const std::vector<int64_t>& args, const int64_t iterations) {
+			this->_args = args;
+			this->_iterations = iterations;
+			this->_remaining = iterations;
+			this->_items = 0;
+			this->_bytes = 0;
+			this->_elapsed = std::chrono::steady_clock::duration::zero();
+		}
+
+		bool keep_running()
+		{
+			if (_remaining == _iterations)
+				_start = std::chrono::steady_clock::now();
+
+			if (_remaining-- > 0)
+				return true;
+
+			_elapsed = std::chrono::steady_clock::now() - _start;
+
+			return false;
+		}
+
+		// i-th argument of the run (i.e. a size)
+		int64_t arg(const size_t i) const { return _args[i]; }
+
+		int64_t iterations() const { return _iterations; }
+
+		// Totals over all the iterations, reported as rates
+		void set_items_processed(const int64_t items) { _items = items; }
+		void set_bytes_processed(const int64_t bytes) { _bytes = bytes; }
+
+		int64_t items() const { return _items; }
+		int64_t bytes() const { return _bytes; }
+		double seconds() const { return std::chrono::duration<double>(_elapsed).count(); }
+	};
+
+	typedef std::function<void(State&)> BenchmarkFunc;
+
+	struct Benchmark
+	{
+		std::string name;
+		BenchmarkFunc func;
+
+		// One run per argument list
+		std::vector<std::vector<int64_t>> args;
+	};
+
+	inline std::vector<Benchmark>& registry()
+	{
+		static std::vector<Benchmark> benchmarks;
+		return benchmarks;
+	}
+
+	struct Registration
+	{
+		// Without arguments the benchmark runs once
+		Registration(const std::string& name, const BenchmarkFunc& func, const std::vector<std::vector<int64_t>>& args) {
+			registry().push_back(Benchmark{ name, func, args.empty() ? std::vector<std::vector<int64_t>>{ {} } : args });
+		}
+	};
+
+	// Keeps the compiler from optimizing away a result
+	template <typename T>
+	inline void do_not_optimize(const T& value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		asm volatile("" : : "r,m"(value) : "memory");
+#else
+		static const volatile void* sink;
+		sink = &value;
+#endif
+	}
+
+}
+}
+
+#define ORTHO_BENCH_CONCAT_(a, b) a##b
+#define ORTHO_BENCH_CONCAT(a, b) ORTHO_BENCH_CONCAT_(a, b)
+
+// Registers func (void func(State&)) to run once per argument list, i.e. ORTHO_BENCHMARK(bm_x, { 256 }, { 1024 })
+#define ORTHO_BENCHMARK(func, ...) \
+	static const orthorectify::bench::Registration ORTHO_BENCH_CONCAT(func##_registration_, __LINE__)(#func, func, { __VA_ARGS__ })
@@ -0,0 +1,57 @@
+#include "bench.hpp"
+#include "synthetic.hpp"
+
+using namespace orthorectify;
+using namespace orthorectify::bench;
+
+// Whole shot on a single thread: footprint, visibility setup, projection and the per-cell
+// sampling loop (the kernel specialized on interpolation, visibility test and pixel format).
+// Arguments are the DEM size and the image width
+template <VisibilityTest Visibility, InterpolationType Interpolation>
+static void process_shot(State& state)
+{
+	Scene scene(static_cast<int>(state.arg(0)), static_cast<int>(state.arg(1)));
+	const auto image = make_image(static_cast<int>(state.arg(1)), 3, false);
+	const auto params = scene.parameters(Visibility, Interpolation);
+
+	int64_t cells = 0;
+
+	while (state.keep_running())
+	{
+		const auto ortho = process_image<float>(*image, "", params);
+		do_not_optimize(ortho);
+
+		if (ortho != nullptr && !ortho->empty())
+			cells += static_cast<int64_t>(ortho->image->width()) * ortho->image->height();
+	}
+
+	state.set_items_processed(cells);
+}
+
+static void bm_process_image_nearest(State& state) { process_shot<NoVisibilityTest, Nearest>(state); }
+static void bm_process_image_bilinear(State& state) { process_shot<NoVisibilityTest, Bilinear>(state); }
+static void bm_process_image_ray(State& state) { process_shot<RayCast, Bilinear>(state); }
+static void bm_process_image_sweep(State& state) { process_shot<RadialSweep, Bilinear>(state); }
+static void bm_process_image_zbuffer(State& state) { process_shot<DepthTest, Bilinear>(state); }
+
+ORTHO_BENCHMARK(bm_process_image_nearest, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_process_image_bilinear, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_process_image_ray, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_process_image_sweep, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_process_image_zbuffer, { 1024, 1000 }, { 2048, 2000 });
+
+// Same shot with a 16-bit image, sampled band by band instead of as 32-bit words
+static void bm_process_image_uint16(State& state)
+{
+	Scene scene(static_cast<int>(state.arg(0)), static_cast<int>(state.arg(1)));
+	const auto image = make_image(static_cast<int>(state.arg(1)), 3, false, GDT_UInt16);
+	const auto params = scene.parameters(RayCast, Bilinear);
+
+	while (state.keep_running())
+	{
+		const auto ortho = process_image<float>(*image, "", params);
+		do_not_optimize(ortho);
+	}
+}
+
+ORTHO_BENCHMARK(bm_process_image_uint16, { 1024, 1000 });
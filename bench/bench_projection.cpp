@@ -0,0 +1,55 @@
+#include "bench.hpp"
+#include "synthetic.hpp"
+
+using namespace orthorectify;
+using namespace orthorectify::bench;
+
+// Collinearity projection of DEM rows through the scalar kernel and the one picked for
+// this CPU. The argument is the row length
+static void project_rows(State& state, const ProjectRowFunc project_row)
+{
+	const auto size = static_cast<int>(state.arg(0));
+
+	Scene scene(size, 4000);
+
+	const auto f = scene.shot.camera_focal * MAX(scene.shot.camera_width, scene.shot.camera_height);
+	const auto info = get_dem_info(scene.shot, f, scene.dem_min_value, 0, 0, scene.transform);
+
+	const ShotGeometry geometry{
+		info.a1, info.b1, info.c1,
+		info.a2, info.b2, info.c2,
+		info.a3, info.b3, info.c3,
+		info.Xs, info.Ys, info.Zs,
+		f,
+		scene.shot.camera_width, scene.shot.camera_height,
+		(scene.shot.camera_width - 1) / 2.0, (scene.shot.camera_height - 1) / 2.0,
+		(scene.shot.camera_width - 1) / 2.0, (scene.shot.camera_height - 1) / 2.0,
+		scene.transform,
+		0,
+		0,
+		std::numeric_limits<float>::quiet_NaN()
+	};
+
+	std::vector<float> x(size), y(size), depth(size);
+	std::vector<uint8_t> valid(size);
+
+	auto j = 0;
+
+	while (state.keep_running())
+	{
+		project_row(geometry.row_projection(0, j, true), scene.heights.data() + static_cast<size_t>(j) * size, size,
+			x.data(), y.data(), depth.data(), valid.data());
+
+		do_not_optimize(valid.data());
+
+		j = (j + 1) % size;
+	}
+
+	state.set_items_processed(state.iterations() * size);
+}
+
+static void bm_project_row_scalar(State& state) { project_rows(state, project_row_scalar); }
+static void bm_project_row_dispatched(State& state) { project_rows(state, get_project_row_kernel()); }
+
+ORTHO_BENCHMARK(bm_project_row_scalar, { 256 }, { 1024 }, { 4096 });
+ORTHO_BENCHMARK(bm_project_row_dispatched, { 256 }, { 1024 }, { 4096 });
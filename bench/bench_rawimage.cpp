@@ -0,0 +1,169 @@
+#include <filesystem>
+
+#include "bench.hpp"
+#include "synthetic.hpp"
+
+using namespace orthorectify;
+using namespace orthorectify::bench;
+
+namespace fs = std::filesystem;
+
+// Sample positions spread over an image, with fractional parts
+static std::vector<std::pair<double, double>> sample_points(const RawImage& image, const int count)
+{
+	std::vector<std::pair<double, double>> points(count);
+
+	for (auto i = 0; i < count; i++)
+	{
+		const auto t = static_cast<double>(i) / count;
+
+		points[i] = {
+			(image.width() - 1) * t,
+			(image.height() - 1) * std::fmod(t * 37.0, 1.0)
+		};
+	}
+
+	return points;
+}
+
+// Whole pixel copy between two 8-bit RGB images (what the nearest sampler does),
+// the argument is the image width
+static void bm_word_copy(State& state)
+{
+	const auto source = make_image(static_cast<int>(state.arg(0)), 3, false);
+	RawImage target(source->width(), source->height(), false, "GTiff");
+
+	const auto pixels = static_cast<int64_t>(source->width()) * source->height();
+
+	while (state.keep_running())
+	{
+		for (auto y = 0; y < source->height(); y++)
+			for (auto x = 0; x < source->width(); x++)
+				target.set_word(x, y, source->get_word(x, y));
+
+		do_not_optimize(target.get_word(0, 0));
+	}
+
+	state.set_items_processed(state.iterations() * pixels);
+	state.set_bytes_processed(state.iterations() * pixels * 4);
+}
+
+ORTHO_BENCHMARK(bm_word_copy, { 1000 }, { 4000 });
+
+template <int Bands>
+static void bilinear_words(State& state)
+{
+	const auto image = make_image(static_cast<int>(state.arg(0)), Bands, Bands == 4);
+	const auto points = sample_points(*image, 1 << 16);
+
+	while (state.keep_running())
+	{
+		uint32_t sum = 0;
+
+		for (const auto& point : points)
+			sum += image->bilinear_interpolate<Bands>(point.first, point.second);
+
+		do_not_optimize(sum);
+	}
+
+	state.set_items_processed(state.iterations() * static_cast<int64_t>(points.size()));
+}
+
+static void bm_bilinear_rgb(State& state) { bilinear_words<3>(state); }
+static void bm_bilinear_rgba(State& state) { bilinear_words<4>(state); }
+
+ORTHO_BENCHMARK(bm_bilinear_rgb, { 1000 }, { 4000 });
+ORTHO_BENCHMARK(bm_bilinear_rgba, { 1000 }, { 4000 });
+
+// Baseline for the above: the band count is only known at run time and every band
+// goes through the generic sample path, as before the sampling loop was specialized
+static void bm_bilinear_generic(State& state)
+{
+	const auto image = make_image(static_cast<int>(state.arg(0)), 3, false);
+	const auto points = sample_points(*image, 1 << 16);
+	const auto bands = image->color_bands();
+
+	while (state.keep_running())
+	{
+		uint32_t sum = 0;
+
+		for (const auto& point : points)
+		{
+			const auto taps = image->bilinear_taps(point.first, point.second);
+
+			for (auto band = 0; band < bands; band++)
+			{
+				auto value = 0.0;
+
+				for (auto t = 0; t < 4; t++)
+					value += taps.w[t] * image->pixel<uint8_t>(taps.idx[t])[band];
+
+				sum += static_cast<uint8_t>(std::round(value));
+			}
+		}
+
+		do_not_optimize(sum);
+	}
+
+	state.set_items_processed(state.iterations() * static_cast<int64_t>(points.size()));
+}
+
+ORTHO_BENCHMARK(bm_bilinear_generic, { 1000 }, { 4000 });
+
+// Tiled, deflate compressed GeoTIFF written from the buffer, the argument is the image width
+static void bm_write(State& state)
+{
+	const auto image = make_image(static_cast<int>(state.arg(0)), 4, true);
+	const auto path = (fs::temp_directory_path() / "orthorectify_bench_write.tif").generic_string();
+
+	while (state.keep_running())
+	{
+		image->write(path, "GTiff", [](GDALDataset* ds) {
+			const double geotransform[6] = { 0, 1, 0, 0, 0, -1 };
+			ds->SetGeoTransform(const_cast<double*>(geotransform));
+		}, { "TILED=YES", "COMPRESS=DEFLATE" });
+	}
+
+	fs::remove(path);
+
+	state.set_bytes_processed(state.iterations() * static_cast<int64_t>(image->width()) * image->height() * 4);
+}
+
+ORTHO_BENCHMARK(bm_write, { 1000 }, { 4000 });
+
+// Cropped window of a 16-bit image, the output starts away from the first pixel. Read back
+// and compared with the source, the run fails when they differ. The argument is the image width
+static void bm_write_window_uint16(State& state)
+{
+	const auto image = make_image(static_cast<int>(state.arg(0)), 3, false, GDT_UInt16);
+	const auto path = (fs::temp_directory_path() / "orthorectify_bench_window.tif").generic_string();
+
+	const auto x = 17;
+	const auto y = 11;
+	const auto width = image->width() - 40;
+	const auto height = image->height() - 30;
+
+	while (state.keep_running())
+	{
+		image->write_window(path, "GTiff", x, y, width, height, [](GDALDataset* ds) {
+			const double geotransform[6] = { 0, 1, 0, 0, 0, -1 };
+			ds->SetGeoTransform(const_cast<double*>(geotransform));
+		}, { "TILED=YES", "COMPRESS=DEFLATE" });
+	}
+
+	const RawImage written(path);
+	fs::remove(path);
+
+	if (written.width() != width || written.height() != height || written.type() != GDT_UInt16)
+		throw std::runtime_error("Written window has the wrong size or type");
+
+	for (auto j = 0; j < height; j++)
+		for (auto i = 0; i < width; i++)
+			for (auto b = 0; b < image->bands(); b++)
+				if (written.pixel<uint16_t>(i, j)[b] != image->pixel<uint16_t>(x + i, y + j)[b])
+					throw std::runtime_error("Written window does not match the source at (" + std::to_string(i) + ", " + std::to_string(j) + ")");
+
+	state.set_bytes_processed(state.iterations() * static_cast<int64_t>(width) * height * image->bands() * 2);
+}
+
+ORTHO_BENCHMARK(bm_write_window_uint16, { 1000 });
@@ -0,0 +1,157 @@
+#include "bench.hpp"
+#include "synthetic.hpp"
+
+using namespace orthorectify;
+using namespace orthorectify::bench;
+
+// Per-cell sampling loop with the choices made at run time, as before it was specialized:
+// every cell branches on the nodata value, the visibility test, the interpolation and the
+// pixel format (the samplers still branch on the alpha band). Same results as sample_tile
+template <typename T>
+static void sample_tile_generic(const ShotContext<T>& ctx, const int row_begin, const int row_end, TileBounds& bounds)
+{
+	const auto& params = ctx.params;
+	const auto& geometry = ctx.geometry;
+	const auto& grid = ctx.grid;
+	const auto native = grid.native();
+	const auto bbox_w = ctx.bbox_w;
+	const auto img_w = geometry.img_w;
+	const auto img_h = geometry.img_h;
+
+	std::vector<float> heights_buffer(bbox_w);
+	std::vector<float> xs(bbox_w);
+	std::vector<float> ys(bbox_w);
+	std::vector<float> depths(bbox_w);
+	std::vector<uint8_t> valid(bbox_w);
+
+	const auto& image = ctx.image;
+
+	for (auto j = row_begin; j < row_end; ++j) {
+
+		const auto im_j = j - ctx.bbox_miny;
+		const auto cell_j = grid.cell_y(j);
+
+		const auto span_start = ctx.footprint.start(j);
+		const auto span_count = ctx.footprint.end(j) - span_start;
+
+		if (span_count <= 0)
+			continue;
+
+		const auto* heights = native ?
+			get_row_heights(ctx.dem, span_start, j, span_count, heights_buffer.data()) :
+			interpolate_row_heights(ctx.dem, grid, span_start, j, span_count, geometry.nodata, heights_buffer.data());
+
+		ctx.project_row(geometry.row_projection(span_start, j, true), heights, span_count, xs.data(), ys.data(), depths.data(), valid.data());
+
+		if (ctx.distortion != nullptr)
+			ctx.distortion->apply_row(xs.data(), ys.data(), valid.data(), span_count);
+
+		for (auto k = 0; k < span_count; ++k) {
+
+			if (!valid[k])
+				continue;
+
+			if (params.has_nodata && heights[k] == geometry.nodata)
+				continue;
+
+			const auto i = span_start + k;
+			const auto im_i = i - ctx.bbox_minx;
+
+			const auto x = static_cast<double>(xs[k]);
+			const auto y = static_cast<double>(ys[k]);
+
+			if (!params.skip_visibility_test)
+			{
+				bool visible;
+
+				if (params.visibility == RadialSweep)
+					visible = ctx.sweep->visible(grid.cell_x(i), cell_j);
+				else if (params.visibility == DepthTest)
+					visible = ctx.depth_buffer->visible(x, y, static_cast<double>(depths[k]));
+				else
+					visible = ctx.ray_walker->visible(grid.cell_x(i), cell_j, static_cast<double>(heights[k]));
+
+				if (!visible)
+					continue;
+			}
+
+			bool written;
+
+			if (params.interpolation == Bilinear)
+			{
+				const auto xi = img_w - 1 - x;
+				const auto yi = img_h - 1 - y;
+
+				if (image.words())
+					written = image.has_alpha() ? WordSampler<4>::bilinear(ctx, xi, yi, im_i, im_j) : WordSampler<3>::bilinear(ctx, xi, yi, im_i, im_j);
+				else if (image.type() == GDT_Byte)
+					written = BandSampler<uint8_t>::bilinear(ctx, xi, yi, im_i, im_j);
+				else if (image.type() == GDT_UInt16)
+					written = BandSampler<uint16_t>::bilinear(ctx, xi, yi, im_i, im_j);
+				else
+					written = BandSampler<float>::bilinear(ctx, xi, yi, im_i, im_j);
+			}
+			else
+			{
+				const auto xi = img_w - 1 - static_cast<int>(std::round(x));
+				const auto yi = img_h - 1 - static_cast<int>(std::round(y));
+
+				if (image.words())
+					written = image.has_alpha() ? WordSampler<4>::nearest(ctx, xi, yi, im_i, im_j) : WordSampler<3>::nearest(ctx, xi, yi, im_i, im_j);
+				else if (image.type() == GDT_Byte)
+					written = BandSampler<uint8_t>::nearest(ctx, xi, yi, im_i, im_j);
+				else if (image.type() == GDT_UInt16)
+					written = BandSampler<uint16_t>::nearest(ctx, xi, yi, im_i, im_j);
+				else
+					written = BandSampler<float>::nearest(ctx, xi, yi, im_i, im_j);
+			}
+
+			if (written)
+			{
+				bounds.minx = MIN(bounds.minx, im_i);
+				bounds.miny = MIN(bounds.miny, im_j);
+				bounds.maxx = MAX(bounds.maxx, im_i);
+				bounds.maxy = MAX(bounds.maxy, im_j);
+			}
+		}
+	}
+}
+
+// Whole shot with the generic sampling loop or the kernel dispatched for the shot. The rest
+// of the shot is the same for both, the difference in time is the one of the sampling loops.
+// Arguments are the DEM size and the image width
+template <VisibilityTest Visibility, InterpolationType Interpolation, bool Generic>
+static void sample_shot(State& state)
+{
+	Scene scene(static_cast<int>(state.arg(0)), static_cast<int>(state.arg(1)));
+	const auto image = make_image(static_cast<int>(state.arg(1)), 3, false);
+	const auto params = scene.parameters(Visibility, Interpolation);
+	const auto kernel = Generic ? &sample_tile_generic<float> : nullptr;
+
+	int64_t cells = 0;
+
+	while (state.keep_running())
+	{
+		const auto ortho = process_image<float>(*image, "", params, kernel);
+		do_not_optimize(ortho);
+
+		if (ortho != nullptr && !ortho->empty())
+			cells += static_cast<int64_t>(ortho->image->width()) * ortho->image->height();
+	}
+
+	state.set_items_processed(cells);
+}
+
+static void bm_sample_generic_nearest(State& state) { sample_shot<NoVisibilityTest, Nearest, true>(state); }
+static void bm_sample_kernel_nearest(State& state) { sample_shot<NoVisibilityTest, Nearest, false>(state); }
+static void bm_sample_generic_bilinear(State& state) { sample_shot<NoVisibilityTest, Bilinear, true>(state); }
+static void bm_sample_kernel_bilinear(State& state) { sample_shot<NoVisibilityTest, Bilinear, false>(state); }
+static void bm_sample_generic_sweep(State& state) { sample_shot<RadialSweep, Bilinear, true>(state); }
+static void bm_sample_kernel_sweep(State& state) { sample_shot<RadialSweep, Bilinear, false>(state); }
+
+ORTHO_BENCHMARK(bm_sample_generic_nearest, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_sample_kernel_nearest, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_sample_generic_bilinear, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_sample_kernel_bilinear, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_sample_generic_sweep, { 1024, 1000 }, { 2048, 2000 });
+ORTHO_BENCHMARK(bm_sample_kernel_sweep, { 1024, 1000 }, { 2048, 2000 });
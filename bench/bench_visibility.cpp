@@ -0,0 +1,95 @@
+#include "bench.hpp"
+#include "synthetic.hpp"
+
+using namespace orthorectify;
+using namespace orthorectify::bench;
+
+// Ray from every DEM cell back to the camera, the argument is the DEM size
+static void walk_rays(State& state, const bool with_pyramid)
+{
+	const auto size = static_cast<int>(state.arg(0));
+
+	Scene scene(size, 1000);
+
+	const auto window = scene.dem.window(0, 0, size - 1, size - 1);
+	const auto& origin = scene.shot.origin;
+
+	double cam_x, cam_y;
+	scene.transform.index(origin(0), origin(1), cam_x, cam_y);
+
+	const RayWalker<float> walker(window, with_pyramid ? scene.pyramid.get() : nullptr, cam_x, cam_y, origin(2), scene.dem_max_value);
+
+	int64_t visible = 0;
+
+	while (state.keep_running())
+	{
+		for (auto y = 0; y < size; y++)
+			for (auto x = 0; x < size; x++)
+				visible += walker.visible(x, y, window.at(x, y));
+	}
+
+	do_not_optimize(visible);
+
+	state.set_items_processed(state.iterations() * size * size);
+}
+
+static void bm_ray_walker(State& state) { walk_rays(state, false); }
+static void bm_ray_walker_pyramid(State& state) { walk_rays(state, true); }
+
+ORTHO_BENCHMARK(bm_ray_walker, { 256 }, { 1024 });
+ORTHO_BENCHMARK(bm_ray_walker_pyramid, { 256 }, { 1024 });
+
+// Viewshed of the whole DEM in one sweep
+static void bm_horizon_sweep(State& state)
+{
+	const auto size = static_cast<int>(state.arg(0));
+
+	Scene scene(size, 1000);
+
+	const auto window = scene.dem.window(0, 0, size - 1, size - 1);
+	const auto& origin = scene.shot.origin;
+
+	double cam_x, cam_y;
+	scene.transform.index(origin(0), origin(1), cam_x, cam_y);
+
+	while (state.keep_running())
+	{
+		const HorizonSweep<float> sweep(window, false, 0, cam_x, cam_y, origin(2), 0, 0, size - 1, size - 1);
+		do_not_optimize(sweep);
+	}
+
+	state.set_items_processed(state.iterations() * size * size);
+}
+
+ORTHO_BENCHMARK(bm_horizon_sweep, { 256 }, { 1024 }, { 4096 });
+
+// Splats of DEM-cell sized quads then depth tests of the same points, on a
+// buffer of the given size
+static void bm_depth_buffer(State& state)
+{
+	const auto size = static_cast<int>(state.arg(0));
+	const auto quads = size * size;
+
+	DepthBuffer buffer(size, size, 1, 1.0);
+
+	while (state.keep_running())
+	{
+		auto visible = 0;
+
+		for (auto q = 0; q < quads; q++)
+		{
+			const auto x = static_cast<double>(q % size);
+			const auto y = static_cast<double>(q / size);
+			const auto depth = 100.0 + (q * 2654435761u % 97);
+
+			buffer.splat(x - 0.7, y - 0.7, x + 0.7, y + 0.7, depth);
+			visible += buffer.visible(x, y, depth);
+		}
+
+		do_not_optimize(visible);
+	}
+
+	state.set_items_processed(state.iterations() * quads);
+}
+
+ORTHO_BENCHMARK(bm_depth_buffer, { 256 }, { 1024 });
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+
+#include "../vendor/cxxopts.hpp"
+
+#include "bench.hpp"
+
+#include "gdal_priv.h"
+
+using namespace orthorectify::bench;
+
+// Name of a run, with its arguments (i.e. bm_project_row/4096)
+static std::string run_name(const Benchmark& benchmark, const std::vector<int64_t>& args)
+{
+	std::ostringstream name;
+	name << benchmark.name;
+
+	for (const auto arg : args)
+		name << "/" << arg;
+
+	return name.str();
+}
+
+static std::string human_rate(const double rate, const char* unit)
+{
+	const char* prefixes[] = { "", "k", "M", "G", "T" };
+
+	auto value = rate;
+	auto prefix = 0;
+
+	while (value >= 1000 && prefix < 4)
+	{
+		value /= 1000;
+		prefix++;
+	}
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%.2f %s%s/s", value, prefixes[prefix], unit);
+
+	return buffer;
+}
+
+int main(int argc, char** argv)
+{
+	GDALAllRegister();
+
+	cxxopts::Options options("OrthorectifyBench", "Microbenchmarks of the orthorectification hot paths, on synthetic DEMs and images");
+
+	options.add_options()
+		("f,filter", "Only run the benchmarks whose name contains this string", cxxopts::value<std::string>()->default_value(""))
+		("min-time", "Minimum time in seconds each run is measured for", cxxopts::value<double>()->default_value("0.5"))
+		("l,list", "List the benchmarks and exit")
+		("h,help", "Print usage")
+		;
+
+	const auto result = options.parse(argc, argv);
+
+	if (result.count("help"))
+	{
+		std::cout << options.help();
+		return 0;
+	}
+
+	const auto filter = result["filter"].as<std::string>();
+	const auto min_time = result["min-time"].as<double>();
+
+	if (result.count("list"))
+	{
+		for (const auto& benchmark : registry())
+			for (const auto& args : benchmark.args)
+				std::cout << run_name(benchmark, args) << std::endl;
+
+		return 0;
+	}
+
+	printf("%-48s %14s %12s %20s %20s\n", "Benchmark", "Time/iter", "Iterations", "Items", "Bytes");
+
+	for (const auto& benchmark : registry())
+	{
+		for (const auto& args : benchmark.args)
+		{
+			const auto name = run_name(benchmark, args);
+
+			if (!filter.empty() && name.find(filter) == std::string::npos)
+				continue;
+
+			// Grow the iteration count until a run is long enough to be measured, then
+			// size the final run to last about min_time
+			int64_t iterations = 1;
+			State state(args, iterations);
+			auto failed = false;
+			std::string error;
+
+			while (true)
+			{
+				state = State(args, iterations);
+
+				try
+				{
+					benchmark.func(state);
+				}
+				catch (const std::exception& e) {
+					failed = true;
+					error = e.what();
+					break;
+				}
+
+				if (state.seconds() >= min_time || iterations >= (int64_t(1) << 40))
+					break;
+
+				const auto target = state.seconds() > 0 ?
+					static_cast<int64_t>(1.4 * min_time / state.seconds() * iterations) :
+					iterations * 10;
+
+				iterations = std::max(iterations + 1, std::min(target, iterations * 100));
+			}
+
+			if (failed)
+			{
+				printf("%-48s failed: %s\n", name.c_str(), error.c_str());
+				continue;
+			}
+
+			const auto seconds = state.seconds();
+			const auto per_iteration = seconds / static_cast<double>(state.iterations());
+
+			char time[32];
+
+			if (per_iteration >= 1e-3)
+				snprintf(time, sizeof(time), "%.3f ms", per_iteration * 1e3);
+			else if (per_iteration >= 1e-6)
+				snprintf(time, sizeof(time), "%.3f us", per_iteration * 1e6);
+			else
+				snprintf(time, sizeof(time), "%.2f ns", per_iteration * 1e9);
+
+			printf("%-48s %14s %12lld %20s %20s\n", name.c_str(), time, static_cast<long long>(state.iterations()),
+				state.items() > 0 ? human_rate(state.items() / seconds, "items").c_str() : "",
+				state.bytes() > 0 ? human_rate(state.bytes() / seconds, "B").c_str() : "");
+
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "processing.hpp"
+
+namespace orthorectify {
+namespace bench {
+
+	// Rolling hills with a few steep ridges, so that the visibility tests find occlusions
+	inline std::vector<float> make_dem(const int size)
+	{
+		std::vector<float> dem(static_cast<size_t>(size) * size);
+
+		for (auto y = 0; y < size; y++)
+		{
+			for (auto x = 0; x < size; x++)
+			{
+				auto z = 50.0 + 20.0 * std::sin(x / 37.0) * std::cos(y / 53.0) + 8.0 * std::sin((x + 2 * y) / 11.0);
+
+				// Ridges every 96 cells, 30 m high and 4 cells wide
+				if ((x + y / 3) % 96 < 4)
+					z += 30.0;
+
+				dem[static_cast<size_t>(y) * size + x] = static_cast<float>(z);
+			}
+		}
+
+		return dem;
+	}
+
+	template <typename S>
+	void fill_image(RawImage& image)
+	{
+		const auto bands = image.bands();
+
+		for (auto y = 0; y < image.height(); y++)
+		{
+			for (auto x = 0; x < image.width(); x++)
+			{
+				auto* pixel = image.pixel<S>(x, y);
+
+				for (auto b = 0; b < bands; b++)
+					pixel[b] = static_cast<S>((x * 7 + y * 13 + b * 61) & 0xff);
+			}
+		}
+	}
+
+	// Image with a gradient pattern, height is 3/4 of the width
+	inline std::unique_ptr<RawImage> make_image(const int width, const int bands, const bool has_alpha, const GDALDataType type = GDT_Byte)
+	{
+		auto image = std::make_unique<RawImage>(width, width * 3 / 4, bands, has_alpha, type, "GTiff");
+
+		switch (type)
+		{
+		case GDT_UInt16:
+			fill_image<uint16_t>(*image);
+			break;
+		case GDT_Float32:
+			fill_image<float>(*image);
+			break;
+		default:
+			fill_image<uint8_t>(*image);
+			break;
+		}
+
+		return image;
+	}
+
+	// Square DEM of 1 m cells with a nadir shot over its center, high enough for the
+	// footprint to cover most of the DEM. Everything a shot is processed with is owned here
+	struct Scene
+	{
+		int size;
+		std::vector<float> heights;
+		double dem_min_value;
+		double dem_max_value;
+
+		double geotransform[6];
+		Transform transform;
+		OutputGrid grid;
+
+		DemSource<float> dem;
+		std::unique_ptr<HeightPyramid> pyramid;
+
+		Shot shot;
+		std::string wkt;
+		Scheduler scheduler;
+
+		Scene(const int size, const int image_width) :
+			size(size),
+			heights(make_dem(size)),
+			geotransform{ 0, 1, 0, static_cast<double>(size), 0, -1 },
+			transform(geotransform),
+			grid(geotransform, size, size, 0),
+			dem(heights.data(), size, size),
+			shot("synthetic.jpg", nadir_rotation(), Vec3d(size / 2.0, size / 2.0, MAX(0.68 * size, 300.0)), 0.85,
+				image_width, image_width * 3 / 4, perspective_camera(0.85)),
+			scheduler(1, 1) {
+
+			dem_min_value = *std::min_element(heights.begin(), heights.end());
+			dem_max_value = *std::max_element(heights.begin(), heights.end());
+
+			pyramid = std::make_unique<HeightPyramid>(dem);
+		}
+
+		Scene(const Scene&) = delete;
+		Scene& operator=(const Scene&) = delete;
+
+		// Pinhole camera without distortion
+		static CameraIntrinsics perspective_camera(const double focal)
+		{
+			CameraIntrinsics camera{};
+			camera.type = PerspectiveProjection;
+			camera.focal_x = focal;
+			camera.focal_y = focal;
+
+			return camera;
+		}
+
+		// Camera looking straight down, image x along east and y along south
+		static Mat3d nadir_rotation()
+		{
+			Mat3d rotation;
+			rotation << 1, 0, 0, 0, -1, 0, 0, 0, -1;
+
+			return rotation;
+		}
+
+		ProcessingParameters<float> parameters(const VisibilityTest visibility, const InterpolationType interpolation)
+		{
+			return ProcessingParameters<float>{
+				visibility == NoVisibilityTest,
+				visibility == NoVisibilityTest ? RayCast : visibility,
+				shot,
+				false,
+				false,
+				0,
+				transform,
+				grid,
+				0,
+				0,
+				size,
+				size,
+				dem_min_value,
+				dem_max_value,
+				dem,
+				pyramid.get(),
+				interpolation,
+				true,
+				wkt,
+				scheduler,
+				nullptr
+			};
+		}
+	};
+
+}
+}
@@ -1,6 +1,9 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
@@ -9,6 +12,7 @@
 #include "utils.hpp"
 
 #include "types.hpp"
+#include "distortion.hpp"
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
@@ -24,6 +28,9 @@ namespace orthorectify {
 
 		std::string projection_type;
 
+		// Full model, for sampling the original (distorted) images
+		CameraIntrinsics intrinsics{};
+
 		CameraModel(const std::string& id, json& camera_model) {
 			this->id = id;
 
@@ -31,39 +38,74 @@ namespace orthorectify {
 
 			if (projection_type == "perspective") {
 				this->focal = camera_model["focal"];
+				intrinsics.type = PerspectiveProjection;
 			}
 			else if (projection_type == "brown") {
 				this->focal = camera_model["focal_x"];
+				intrinsics.type = BrownProjection;
 			}
 			else if (projection_type == "fisheye") {
 				this->focal = camera_model["focal"];
+				intrinsics.type = FisheyeProjection;
 			}
 			else if (projection_type == "fisheye_opencv") {
 				this->focal = camera_model["focal"];
+				intrinsics.type = FisheyeOpenCVProjection;
 			}
 			else if (projection_type == "fisheye62") {
 				this->focal = camera_model["focal_x"];
+				intrinsics.type = Fisheye62Projection;
 			}
 			else if (projection_type == "fisheye624") {
 				this->focal = camera_model["focal_x"];
+				intrinsics.type = Fisheye624Projection;
 			}
 			else if (projection_type == "radial") {
 				this->focal = camera_model["focal_x"];
+				intrinsics.type = RadialProjection;
 			}
 			else if (projection_type == "simple_radial") {
 				this->focal = camera_model["focal_x"];
+				intrinsics.type = SimpleRadialProjection;
 			}
 			else if (projection_type == "dual") {
 				this->focal = camera_model["focal"];
+				intrinsics.type = DualProjection;
 			}
 			else if (projection_type == "spherical") {
 				this->focal = 0;
+				intrinsics.type = SphericalProjection;
 			}
 			else {
 				ERR << "Unrecognised projection type: " << projection_type;
 				exit(1);
 			}
 
+			// Coefficients the model does not have are 0
+			const auto get = [&camera_model](const char* key) {
+				return camera_model.contains(key) ? camera_model[key].get<double>() : 0.0;
+			};
+
+			intrinsics.focal_x = camera_model.contains("focal_x") ? get("focal_x") : this->focal;
+			intrinsics.focal_y = camera_model.contains("focal_y") ? get("focal_y") : intrinsics.focal_x;
+			intrinsics.c_x = get("c_x");
+			intrinsics.c_y = get("c_y");
+
+			const char* k_keys[] = { "k1", "k2", "k3", "k4", "k5", "k6" };
+			const char* p_keys[] = { "p1", "p2" };
+			const char* s_keys[] = { "s0", "s1", "s2", "s3" };
+
+			for (auto i = 0; i < 6; i++)
+				intrinsics.k[i] = get(k_keys[i]);
+
+			for (auto i = 0; i < 2; i++)
+				intrinsics.p[i] = get(p_keys[i]);
+
+			for (auto i = 0; i < 4; i++)
+				intrinsics.s[i] = get(s_keys[i]);
+
+			intrinsics.transition = camera_model.contains("transition") ? get("transition") : 1.0;
+
 			this->width = camera_model["width"];
 			this->height = camera_model["height"];
 
@@ -78,6 +120,12 @@ namespace orthorectify {
 		Vec3d origin;
 		double camera_focal;
 
+		// Size of the camera images (the undistorted images might be scaled, with the same aspect ratio)
+		int camera_width;
+		int camera_height;
+
+		CameraIntrinsics camera;
+
 		Shot(const std::string& id, json& shot, std::vector<CameraModel>& camera_models) {
 
 			this->id = id;
@@ -96,6 +144,9 @@ namespace orthorectify {
 			}
 
 			this->camera_focal = camera->focal;
+			this->camera_width = camera->width;
+			this->camera_height = camera->height;
+			this->camera = camera->intrinsics;
 
 			const auto& rotation = shot["rotation"];
 			const auto& translation = shot["translation"];
@@ -124,6 +175,19 @@ namespace orthorectify {
 
 		}
 
+		// Shot read back from the shot cache
+		Shot(const std::string& id, const Mat3d& rotation_matrix, const Vec3d& origin, const double camera_focal,
+			const int camera_width, const int camera_height, const CameraIntrinsics& camera) {
+
+			this->id = id;
+			this->rotation_matrix = rotation_matrix;
+			this->origin = origin;
+			this->camera_focal = camera_focal;
+			this->camera_width = camera_width;
+			this->camera_height = camera_height;
+			this->camera = camera;
+		}
+
 	private:
 
 		static Mat3d VectorToRotationMatrix(const Vec3d& r) {
@@ -135,12 +199,43 @@ namespace orthorectify {
 
 	};
 
+	// Fixed-size header of the shot cache, followed by a record and the id of each shot
+	struct ShotCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t count;
+
+		// Reconstruction the cache was made from
+		uint64_t source_size;
+		int64_t source_mtime;
+	};
+
+	struct ShotCacheRecord
+	{
+		// Row major
+		double rotation[9];
+		double origin[3];
+
+		double camera_focal;
+		int32_t camera_width;
+		int32_t camera_height;
+
+		CameraIntrinsics camera;
+
+		uint32_t id_length;
+		uint32_t reserved;
+	};
+
 	class UndistortedDataset {
 
+		static constexpr char shot_cache_magic[8] = { 'O', 'R', 'T', 'H', 'O', 'S', 'H', 'T' };
+		static constexpr uint32_t shot_cache_version = 2;
+
 		fs::path folder;
 		fs::path path;
 
-		static std::vector<CameraModel> get_camera_models(json cameras)
+		static std::vector<CameraModel> get_camera_models(json& cameras)
 		{
 
 			std::vector<CameraModel> camera_models_vector;
@@ -152,18 +247,8 @@ namespace orthorectify {
 
 		}
 
-	public:
-
-		std::vector<Shot> shots;
-
-		UndistortedDataset(const fs::path& folder, const fs::path& path) {
-			this->folder = folder;
-			this->path = path;
-
-			const auto filename = folder / "reconstruction.json";
-
-			DBG << "Loading reconstruction from " << filename;
-
+		void _parse(const fs::path& filename)
+		{
 			// Load json
 			std::ifstream json_file(filename.string());
 			if (!json_file.is_open()) {
@@ -171,8 +256,22 @@ namespace orthorectify {
 				exit(1);
 			}
 
-			json reconstructions;
-			json_file >> reconstructions;
+			// Only the shots and cameras of the first reconstruction are kept. The points, by far
+			// the largest part of the file, are skipped while parsing and never stored
+			auto reconstructions_count = 0;
+
+			const json::parser_callback_t filter = [&reconstructions_count](const int depth, const json::parse_event_t event, json& parsed) {
+
+				if (depth == 1 && event == json::parse_event_t::object_start)
+					return ++reconstructions_count == 1;
+
+				if (depth == 2 && event == json::parse_event_t::key)
+					return parsed == "shots" || parsed == "cameras";
+
+				return true;
+			};
+
+			auto reconstructions = json::parse(json_file, filter);
 			json_file.close();
 
 			if (reconstructions.empty()) {
@@ -197,5 +296,151 @@ namespace orthorectify {
 				this->shots.emplace_back(key, val, camera_models);
 			}
 		}
+
+		// Returns false when the cache does not exist, is invalid or older than the reconstruction
+		bool _read_cache(const std::string& cache_path, const std::string& source_path)
+		{
+			if (!fs::exists(cache_path) || !fs::exists(source_path))
+				return false;
+
+			std::ifstream in(cache_path, std::ios::binary);
+
+			if (!in.is_open())
+				return false;
+
+			const auto size = fs::file_size(cache_path);
+			std::vector<char> data(size);
+
+			if (!in.read(data.data(), static_cast<std::streamsize>(size)))
+				return false;
+
+			ShotCacheHeader header;
+
+			if (size < sizeof(header))
+				return false;
+
+			memcpy(&header, data.data(), sizeof(header));
+
+			if (memcmp(header.magic, shot_cache_magic, sizeof(shot_cache_magic)) != 0 || header.version != shot_cache_version)
+			{
+				INF << "Ignoring shot cache " << cache_path << " (unknown format)";
+				return false;
+			}
+
+			if (header.source_size != fs::file_size(source_path) || header.source_mtime != get_mtime(source_path))
+			{
+				DBG << "Shot cache " << cache_path << " is out of date";
+				return false;
+			}
+
+			std::vector<Shot> cached;
+			cached.reserve(header.count);
+
+			auto offset = sizeof(header);
+
+			for (uint32_t i = 0; i < header.count; i++)
+			{
+				ShotCacheRecord record;
+
+				if (offset + sizeof(record) > size)
+					break;
+
+				memcpy(&record, data.data() + offset, sizeof(record));
+				offset += sizeof(record);
+
+				if (offset + record.id_length > size)
+					break;
+
+				Mat3d rotation_matrix;
+
+				for (auto r = 0; r < 3; r++)
+					for (auto c = 0; c < 3; c++)
+						rotation_matrix(r, c) = record.rotation[r * 3 + c];
+
+				cached.emplace_back(std::string(data.data() + offset, record.id_length), rotation_matrix,
+					Vec3d(record.origin[0], record.origin[1], record.origin[2]), record.camera_focal, record.camera_width, record.camera_height, record.camera);
+
+				offset += record.id_length;
+			}
+
+			if (cached.size() != header.count)
+			{
+				INF << "Ignoring shot cache " << cache_path << " (truncated)";
+				return false;
+			}
+
+			this->shots = std::move(cached);
+
+			return true;
+		}
+
+		void _write_cache(const std::string& cache_path, const std::string& source_path) const
+		{
+			ShotCacheHeader header{};
+
+			memcpy(header.magic, shot_cache_magic, sizeof(shot_cache_magic));
+			header.version = shot_cache_version;
+			header.count = static_cast<uint32_t>(shots.size());
+			header.source_size = fs::file_size(source_path);
+			header.source_mtime = get_mtime(source_path);
+
+			write_stream_atomically(cache_path, [this, &header](std::ostream& out) {
+
+				out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+				for (const auto& shot : shots)
+				{
+					ShotCacheRecord record{};
+
+					for (auto r = 0; r < 3; r++)
+						for (auto c = 0; c < 3; c++)
+							record.rotation[r * 3 + c] = shot.rotation_matrix(r, c);
+
+					for (auto k = 0; k < 3; k++)
+						record.origin[k] = shot.origin(k);
+
+					record.camera_focal = shot.camera_focal;
+					record.camera_width = shot.camera_width;
+					record.camera_height = shot.camera_height;
+					record.camera = shot.camera;
+					record.id_length = static_cast<uint32_t>(shot.id.size());
+
+					out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+					out.write(shot.id.data(), static_cast<std::streamsize>(shot.id.size()));
+				}
+			}, true);
+		}
+
+	public:
+
+		std::vector<Shot> shots;
+
+		UndistortedDataset(const fs::path& folder, const fs::path& path) {
+			this->folder = folder;
+			this->path = path;
+
+			const auto filename = folder / "reconstruction.json";
+
+			// Shot table of the reconstruction, rebuilt whenever the file changes
+			const auto cache_path = filename.string() + ".shots";
+
+			if (_read_cache(cache_path, filename.string()))
+			{
+				DBG << "Loaded " << shots.size() << " shots from " << cache_path;
+				return;
+			}
+
+			DBG << "Loading reconstruction from " << filename;
+
+			_parse(filename);
+
+			try
+			{
+				_write_cache(cache_path, filename.string());
+			}
+			catch (const std::exception& e) {
+				DBG << "Could not write shot cache " << cache_path << ": " << e.what();
+			}
+		}
 	};
-}
\ No newline at end of file
+}
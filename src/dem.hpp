@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.hpp"
+
+#include "gdal_priv.h"
+
+namespace orthorectify {
+
+	template <typename T>
+	constexpr GDALDataType gdal_data_type()
+	{
+		if constexpr (std::is_same_v<T, float>)
+			return GDT_Float32;
+		else if constexpr (std::is_same_v<T, uint16_t>)
+			return GDT_UInt16;
+		else
+			return GDT_Byte;
+	}
+
+	// Rectangle of DEM cells [x0, x0 + width) x [y0, y0 + height), indexed with
+	// DEM coordinates. Either points into the resident DEM or owns a copy of the cells
+	template <typename T>
+	class DemWindow
+	{
+		std::vector<T> _buffer;
+		const T* _data;
+
+		// Held as long as the copy, gives its memory back to the budget of the source when released
+		std::shared_ptr<void> _lease;
+		size_t _stride;
+
+		int _x0;
+		int _y0;
+		int _width;
+		int _height;
+
+	public:
+
+		DemWindow(const T* data, const size_t stride, const int x0, const int y0, const int width, const int height) {
+			this->_data = data;
+			this->_stride = stride;
+			this->_x0 = x0;
+			this->_y0 = y0;
+			this->_width = width;
+			this->_height = height;
+		}
+
+		DemWindow(std::vector<T>&& buffer, std::shared_ptr<void> lease, const int x0, const int y0, const int width, const int height) {
+			this->_buffer = std::move(buffer);
+			this->_data = _buffer.data();
+			this->_lease = std::move(lease);
+			this->_stride = width;
+			this->_x0 = x0;
+			this->_y0 = y0;
+			this->_width = width;
+			this->_height = height;
+		}
+
+		// Moving a vector keeps its storage, so _data stays valid
+		DemWindow(DemWindow&&) = default;
+		DemWindow(const DemWindow&) = delete;
+		DemWindow& operator=(const DemWindow&) = delete;
+
+		int x0() const { return _x0; }
+		int y0() const { return _y0; }
+		int x1() const { return _x0 + _width - 1; }
+		int y1() const { return _y0 + _height - 1; }
+		int width() const { return _width; }
+		int height() const { return _height; }
+
+		T at(const int x, const int y) const
+		{
+			return _data[static_cast<size_t>(y - _y0) * _stride + (x - _x0)];
+		}
+
+		// Pointer to cell (x, y), the following cells of the row come after it
+		const T* row(const int x, const int y) const
+		{
+			return _data + static_cast<size_t>(y - _y0) * _stride + (x - _x0);
+		}
+	};
+
+	// DEM band access. When the DEM fits in the cache budget it is read once and kept in
+	// memory, otherwise blocks are read on demand and kept in a LRU cache shared by all
+	// the shots, so that overlapping shots don't read the same cells twice. The windows
+	// copied for the shots in flight count against the same budget, blocks are evicted to
+	// make room for them. It can also wrap cells that are already in memory (i.e. a mapped
+	// raw sidecar)
+	template <typename T>
+	class DemSource
+	{
+		typedef std::shared_ptr<const std::vector<T>> BlockData;
+
+		struct Block
+		{
+			BlockData data;
+			std::list<int64_t>::iterator lru;
+		};
+
+		GDALRasterBand* _band;
+
+		int _width;
+		int _height;
+
+		int _block_width;
+		int _block_height;
+		int _blocks_x;
+		int _blocks_y;
+
+		size_t _cache_size;
+		size_t _cached;
+
+		// Bytes of the window copies alive
+		size_t _windows;
+
+		// Whole DEM, when in memory
+		const T* _data;
+		std::vector<T> _resident;
+
+		// GDAL datasets cannot be read from several threads at once
+		std::mutex _io_mutex;
+
+		std::mutex _cache_mutex;
+		std::list<int64_t> _lru;
+		std::unordered_map<int64_t, Block> _blocks;
+
+		void _read(const int x, const int y, const int width, const int height, T* out)
+		{
+			std::lock_guard<std::mutex> lock(_io_mutex);
+
+			if (_band->RasterIO(GF_Read, x, y, width, height, out, width, height, gdal_data_type<T>(), 0, 0) != CE_None) {
+				ERR << "Could not read DEM block at (" << x << ", " << y << ")";
+				throw std::runtime_error(CPLGetLastErrorMsg());
+			}
+		}
+
+		BlockData _get_block(const int bx, const int by)
+		{
+			const auto key = static_cast<int64_t>(by) * _blocks_x + bx;
+
+			{
+				std::lock_guard<std::mutex> lock(_cache_mutex);
+
+				const auto it = _blocks.find(key);
+				if (it != _blocks.end())
+				{
+					_lru.splice(_lru.begin(), _lru, it->second.lru);
+					return it->second.data;
+				}
+			}
+
+			const auto x = bx * _block_width;
+			const auto y = by * _block_height;
+			const auto width = MIN(_block_width, _width - x);
+			const auto height = MIN(_block_height, _height - y);
+
+			auto data = std::make_shared<std::vector<T>>(static_cast<size_t>(width) * height);
+			_read(x, y, width, height, data->data());
+
+			std::lock_guard<std::mutex> lock(_cache_mutex);
+
+			// Another thread might have read it in the meantime
+			const auto it = _blocks.find(key);
+			if (it != _blocks.end())
+				return it->second.data;
+
+			_lru.push_front(key);
+			_blocks.emplace(key, Block{ data, _lru.begin() });
+			_cached += data->size() * sizeof(T);
+
+			_evict();
+
+			return data;
+		}
+
+		// Called with the cache mutex held. Blocks still being copied stay alive through
+		// their shared pointer, the most recent one is kept
+		void _evict()
+		{
+			while (_cached + _windows > _cache_size && _lru.size() > 1)
+			{
+				const auto evicted = _blocks.find(_lru.back());
+				_cached -= evicted->second.data->size() * sizeof(T);
+				_blocks.erase(evicted);
+				_lru.pop_back();
+			}
+		}
+
+	public:
+
+		// cache_size is the memory budget in bytes
+		DemSource(GDALRasterBand* band, const size_t cache_size) {
+			this->_band = band;
+			this->_width = band->GetXSize();
+			this->_height = band->GetYSize();
+			this->_cache_size = cache_size;
+			this->_cached = 0;
+			this->_windows = 0;
+			this->_data = nullptr;
+
+			band->GetBlockSize(&_block_width, &_block_height);
+
+			// Strips (or huge blocks) make poor cache units, use square tiles instead
+			if (_block_width < 64 || _block_height < 64 || _block_width > 2048 || _block_height > 2048)
+			{
+				_block_width = 512;
+				_block_height = 512;
+			}
+
+			this->_blocks_x = (_width + _block_width - 1) / _block_width;
+			this->_blocks_y = (_height + _block_height - 1) / _block_height;
+
+			const auto size = static_cast<size_t>(_width) * _height;
+
+			if (size * sizeof(T) <= cache_size)
+			{
+				_resident.resize(size);
+				_read(0, 0, _width, _height, _resident.data());
+				this->_data = _resident.data();
+
+				DBG << "DEM loaded in memory";
+			}
+			else
+				INF << "DEM does not fit in the cache (" << (cache_size >> 20) << " MB), reading blocks of " <<
+					_block_width << "x" << _block_height << " cells on demand";
+		}
+
+		DemSource(const T* data, const int width, const int height) {
+			this->_band = nullptr;
+			this->_width = width;
+			this->_height = height;
+			this->_block_width = width;
+			this->_block_height = height;
+			this->_blocks_x = 1;
+			this->_blocks_y = 1;
+			this->_cache_size = 0;
+			this->_cached = 0;
+			this->_windows = 0;
+			this->_data = data;
+		}
+
+		int width() const { return _width; }
+		int height() const { return _height; }
+		bool resident() const { return _data != nullptr; }
+
+		// Returns the cells of [minx, maxx] x [miny, maxy] (clamped to the DEM)
+		DemWindow<T> window(int minx, int miny, int maxx, int maxy)
+		{
+			minx = MAX(0, minx);
+			miny = MAX(0, miny);
+			maxx = MIN(_width - 1, maxx);
+			maxy = MIN(_height - 1, maxy);
+
+			const auto width = 1 + maxx - minx;
+			const auto height = 1 + maxy - miny;
+
+			if (_data != nullptr)
+				return DemWindow<T>(_data + static_cast<size_t>(miny) * _width + minx, _width, minx, miny, width, height);
+
+			const auto bytes = static_cast<size_t>(width) * height * sizeof(T);
+
+			{
+				std::lock_guard<std::mutex> lock(_cache_mutex);
+
+				_windows += bytes;
+				_evict();
+
+				if (_windows > _cache_size) {
+					DBG << "DEM windows in use (" << (_windows >> 20) << " MB) exceed the cache";
+				}
+			}
+
+			// Taken before the copy, so that it is given back if reading throws
+			std::shared_ptr<void> lease(nullptr, [this, bytes](void*) {
+				std::lock_guard<std::mutex> lock(_cache_mutex);
+				_windows -= bytes;
+			});
+
+			std::vector<T> buffer(static_cast<size_t>(width) * height);
+
+			for (auto by = miny / _block_height; by <= maxy / _block_height; by++)
+			{
+				for (auto bx = minx / _block_width; bx <= maxx / _block_width; bx++)
+				{
+					const auto block = _get_block(bx, by);
+
+					const auto block_x = bx * _block_width;
+					const auto block_y = by * _block_height;
+					const auto block_w = MIN(_block_width, _width - block_x);
+
+					// Intersection of the block with the window
+					const auto x0 = MAX(minx, block_x);
+					const auto x1 = MIN(maxx, block_x + block_w - 1);
+					const auto y0 = MAX(miny, block_y);
+					const auto y1 = MIN(maxy, block_y + _block_height - 1);
+
+					for (auto y = y0; y <= y1; y++)
+					{
+						const auto* src = block->data() + static_cast<size_t>(y - block_y) * block_w + (x0 - block_x);
+						auto* dst = buffer.data() + static_cast<size_t>(y - miny) * width + (x0 - minx);
+
+						memcpy(dst, src, static_cast<size_t>(1 + x1 - x0) * sizeof(T));
+					}
+				}
+			}
+
+			return DemWindow<T>(std::move(buffer), std::move(lease), minx, miny, width, height);
+		}
+	};
+
+}
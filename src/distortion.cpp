@@ -0,0 +1,200 @@
+#include <cmath>
+#include <stdexcept>
+
+#include "distortion.hpp"
+#include "utils.hpp"
+
+namespace orthorectify {
+
+	// Furthest normalized pinhole coordinate considered (about 76 degrees off axis), fisheye
+	// images can see further than any pinhole image plane
+	static constexpr double max_normalized_extent = 4.0;
+
+	void CameraIntrinsics::distort(const double x, const double y, double& u, double& v) const
+	{
+		auto px = x;
+		auto py = y;
+
+		// Fisheye projections are equidistant: the distance from the center is the angle
+		const auto fisheye = [&](double& fx, double& fy) {
+
+			const auto r = std::sqrt(x * x + y * y);
+			const auto scale = r < 1e-12 ? 1.0 : std::atan(r) / r;
+
+			fx = x * scale;
+			fy = y * scale;
+		};
+
+		switch (type)
+		{
+		case FisheyeProjection:
+		case FisheyeOpenCVProjection:
+		case Fisheye62Projection:
+		case Fisheye624Projection:
+			fisheye(px, py);
+			break;
+		case DualProjection:
+		{
+			double fx, fy;
+			fisheye(fx, fy);
+
+			px = transition * x + (1 - transition) * fx;
+			py = transition * y + (1 - transition) * fy;
+			break;
+		}
+		default:
+			break;
+		}
+
+		const auto r2 = px * px + py * py;
+		const auto radial = 1 + r2 * (k[0] + r2 * (k[1] + r2 * (k[2] + r2 * (k[3] + r2 * (k[4] + r2 * k[5])))));
+
+		auto xd = px * radial;
+		auto yd = py * radial;
+
+		// Coefficients are 0 for the models without them
+		xd += 2 * p[0] * px * py + p[1] * (r2 + 2 * px * px);
+		yd += p[0] * (r2 + 2 * py * py) + 2 * p[1] * px * py;
+
+		xd += s[0] * r2 + s[1] * r2 * r2;
+		yd += s[2] * r2 + s[3] * r2 * r2;
+
+		u = focal_x * xd + c_x;
+		v = focal_y * yd + c_y;
+	}
+
+	bool CameraIntrinsics::undistort(const double u, const double v, double& x, double& y) const
+	{
+		// Newton iterations, with a numerical jacobian, from the undistorted guess
+		x = (u - c_x) / focal_x;
+		y = (v - c_y) / focal_y;
+
+		constexpr double h = 1e-7;
+
+		for (auto i = 0; i < 20; i++)
+		{
+			double du, dv;
+			distort(x, y, du, dv);
+
+			const auto ex = du - u;
+			const auto ey = dv - v;
+
+			if (std::abs(ex) < 1e-10 && std::abs(ey) < 1e-10)
+				return true;
+
+			double dux, dvx, duy, dvy;
+			distort(x + h, y, dux, dvx);
+			distort(x, y + h, duy, dvy);
+
+			const auto j00 = (dux - du) / h;
+			const auto j10 = (dvx - dv) / h;
+			const auto j01 = (duy - du) / h;
+			const auto j11 = (dvy - dv) / h;
+
+			const auto det = j00 * j11 - j01 * j10;
+
+			if (std::abs(det) < 1e-12)
+				return false;
+
+			x -= (j11 * ex - j01 * ey) / det;
+			y -= (j00 * ey - j10 * ex) / det;
+
+			if (!std::isfinite(x) || !std::isfinite(y))
+				return false;
+		}
+
+		double du, dv;
+		distort(x, y, du, dv);
+
+		return std::abs(du - u) < 1e-6 && std::abs(dv - v) < 1e-6;
+	}
+
+	ShotDistortion::ShotDistortion(const CameraIntrinsics& camera, const int img_w, const int img_h, const double f)
+	{
+		if (camera.type == SphericalProjection)
+			throw std::runtime_error("Spherical cameras are not supported");
+
+		this->_camera = camera;
+		this->_img_w = img_w;
+		this->_img_h = img_h;
+		this->_half_img_w = (img_w - 1) / 2.0;
+		this->_half_img_h = (img_h - 1) / 2.0;
+		this->_size = MAX(img_w, img_h);
+		this->_f = f;
+
+		// The field of view is bounded by the image border, undistorted
+		constexpr int samples = 64;
+
+		auto extent_x = 0.0;
+		auto extent_y = 0.0;
+
+		for (auto i = 0; i <= samples; i++)
+		{
+			const auto t = static_cast<double>(i) / samples;
+
+			const double border[4][2] = {
+				{ t * (img_w - 1), 0 },
+				{ t * (img_w - 1), img_h - 1.0 },
+				{ 0, t * (img_h - 1) },
+				{ img_w - 1.0, t * (img_h - 1) }
+			};
+
+			for (const auto& point : border)
+			{
+				double x, y;
+
+				if (!_camera.undistort((point[0] - _half_img_w) / _size, (point[1] - _half_img_h) / _size, x, y))
+				{
+					extent_x = extent_y = max_normalized_extent;
+					continue;
+				}
+
+				extent_x = MAX(extent_x, std::abs(x));
+				extent_y = MAX(extent_y, std::abs(y));
+			}
+		}
+
+		// With a pixel of margin
+		this->_extent_w = MIN(extent_x, max_normalized_extent) * f + 1;
+		this->_extent_h = MIN(extent_y, max_normalized_extent) * f + 1;
+	}
+
+	void ShotDistortion::apply_row(float* x, float* y, uint8_t* valid, const int count) const
+	{
+		const auto max_x = static_cast<double>(_img_w - 1);
+		const auto max_y = static_cast<double>(_img_h - 1);
+
+		for (auto k = 0; k < count; k++)
+		{
+			if (!valid[k])
+				continue;
+
+			// Projections are mirrored around the principal point
+			const auto dx = _half_img_w - x[k];
+			const auto dy = _half_img_h - y[k];
+
+			// Past the field of view the distortion models can fold back into the image
+			if (std::abs(dx) > _extent_w || std::abs(dy) > _extent_h)
+			{
+				valid[k] = 0;
+				continue;
+			}
+
+			double u, v;
+			_camera.distort(dx / _f, dy / _f, u, v);
+
+			const auto px = u * _size + _half_img_w;
+			const auto py = v * _size + _half_img_h;
+
+			if (!(px >= 0 && py >= 0 && px <= max_x && py <= max_y))
+			{
+				valid[k] = 0;
+				continue;
+			}
+
+			x[k] = static_cast<float>(max_x - px);
+			y[k] = static_cast<float>(max_y - py);
+		}
+	}
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+
+namespace orthorectify {
+
+	enum ProjectionType
+	{
+		PerspectiveProjection = 0,
+		BrownProjection,
+		FisheyeProjection,
+		FisheyeOpenCVProjection,
+		Fisheye62Projection,
+		Fisheye624Projection,
+		RadialProjection,
+		SimpleRadialProjection,
+		DualProjection,
+		SphericalProjection
+	};
+
+	// Intrinsics of an OpenSfM camera model. Image coordinates are normalized as OpenSfM
+	// does: relative to the image center, in units of the largest image dimension
+	struct CameraIntrinsics
+	{
+		ProjectionType type;
+
+		double focal_x;
+		double focal_y;
+		double c_x;
+		double c_y;
+
+		// Radial (k1 to k6), tangential (p1, p2) and thin prism (s0 to s3) coefficients,
+		// 0 when the model does not have them
+		double k[6];
+		double p[2];
+		double s[4];
+
+		// Dual cameras only, blends the perspective and fisheye projections
+		double transition;
+
+		// Normalized image coordinates of the camera space point (x, y, 1)
+		void distort(double x, double y, double& u, double& v) const;
+
+		// Inverse of distort, false when it does not converge
+		bool undistort(double u, double v, double& x, double& y) const;
+	};
+
+	// Maps the pinhole projections of a shot, as written by the projection kernels, to the
+	// pixels of its original (distorted) image
+	class ShotDistortion
+	{
+		CameraIntrinsics _camera;
+
+		int _img_w;
+		int _img_h;
+		double _half_img_w;
+		double _half_img_h;
+		double _size;
+		double _f;
+
+		double _extent_w;
+		double _extent_h;
+
+	public:
+
+		// f is the focal length in pixels of the pinhole projection
+		ShotDistortion(const CameraIntrinsics& camera, int img_w, int img_h, double f);
+
+		// Half size of the field of view of the image on the pinhole image plane (in pixels,
+		// from the principal point). The footprint of the shot is worked out from it
+		double extent_w() const { return _extent_w; }
+		double extent_h() const { return _extent_h; }
+
+		// Replaces count projected coordinates with the ones of the same points in the original
+		// image, invalidating the ones that fall outside of it
+		void apply_row(float* x, float* y, uint8_t* valid, int count) const;
+	};
+
+}
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <limits>
+
+#include "footprint.hpp"
+
+namespace orthorectify {
+
+	Footprint::Footprint(const std::vector<GridPoint>& polygon, const int pad, const int clip_minx, const int clip_miny, const int clip_maxx, const int clip_maxy)
+	{
+		auto min_y = std::numeric_limits<double>::max();
+		auto max_y = std::numeric_limits<double>::lowest();
+
+		for (const auto& p : polygon)
+		{
+			min_y = MIN(min_y, p.y);
+			max_y = MAX(max_y, p.y);
+		}
+
+		this->_minx = 0;
+		this->_maxx = -1;
+
+		// Clamped before converting, rays close to the horizon end up very far
+		const auto to_row = [=](const double y) { return static_cast<int>(std::floor(std::clamp(y, clip_miny - 1.0, clip_maxy + 1.0))); };
+		const auto to_column = [=](const double x) { return static_cast<int>(std::floor(std::clamp(x, clip_minx - 1.0, clip_maxx + 1.0))); };
+
+		this->_miny = MAX(clip_miny, to_row(min_y) - pad);
+		this->_maxy = MIN(clip_maxy, to_row(max_y) + pad);
+
+		if (polygon.empty() || _miny > _maxy)
+		{
+			this->_miny = 0;
+			this->_maxy = -1;
+			return;
+		}
+
+		const auto rows = 1 + _maxy - _miny;
+
+		std::vector<double> row_min(rows, std::numeric_limits<double>::max());
+		std::vector<double> row_max(rows, std::numeric_limits<double>::lowest());
+
+		// The extent of the polygon within the band of rows [j - pad, j + 1 + pad] is the
+		// extent of the edges clipped to it, so each edge only updates the rows it crosses
+		for (size_t e = 0; e < polygon.size(); e++)
+		{
+			const auto& a = polygon[e];
+			const auto& b = polygon[(e + 1) % polygon.size()];
+
+			const auto j0 = MAX(_miny, to_row(MIN(a.y, b.y)) - pad);
+			const auto j1 = MIN(_maxy, to_row(MAX(a.y, b.y)) + pad);
+
+			for (auto j = j0; j <= j1; j++)
+			{
+				double x0, x1;
+
+				if (a.y == b.y)
+				{
+					x0 = MIN(a.x, b.x);
+					x1 = MAX(a.x, b.x);
+				}
+				else
+				{
+					auto t0 = (j - pad - a.y) / (b.y - a.y);
+					auto t1 = (j + 1 + pad - a.y) / (b.y - a.y);
+
+					if (t0 > t1) std::swap(t0, t1);
+
+					t0 = MAX(0.0, t0);
+					t1 = MIN(1.0, t1);
+
+					if (t0 > t1)
+						continue;
+
+					x0 = a.x + (b.x - a.x) * t0;
+					x1 = a.x + (b.x - a.x) * t1;
+
+					if (x0 > x1) std::swap(x0, x1);
+				}
+
+				row_min[j - _miny] = MIN(row_min[j - _miny], x0);
+				row_max[j - _miny] = MAX(row_max[j - _miny], x1);
+			}
+		}
+
+		_start.assign(rows, 0);
+		_end.assign(rows, 0);
+
+		this->_minx = clip_maxx + 1;
+
+		for (auto r = 0; r < rows; r++)
+		{
+			if (row_min[r] > row_max[r])
+				continue;
+
+			const auto start = MAX(clip_minx, to_column(row_min[r]) - pad);
+			const auto end = MIN(clip_maxx + 1, to_column(row_max[r]) + 1 + pad);
+
+			if (start >= end)
+				continue;
+
+			_start[r] = start;
+			_end[r] = end;
+
+			_minx = MIN(_minx, start);
+			_maxx = MAX(_maxx, end - 1);
+		}
+
+		if (_minx > _maxx)
+		{
+			this->_miny = 0;
+			this->_maxy = -1;
+		}
+	}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "utils.hpp"
+#include "dem.hpp"
+#include "transform.hpp"
+
+namespace orthorectify {
+
+	// Fractional DEM grid coordinates (cell (i, j) spans [i, i + 1) x [j, j + 1))
+	struct GridPoint
+	{
+		double x;
+		double y;
+	};
+
+	// DEM cells covered by a shot, as a [start, end) span of columns for each row
+	class Footprint
+	{
+		int _minx;
+		int _miny;
+		int _maxx;
+		int _maxy;
+
+		std::vector<int> _start;
+		std::vector<int> _end;
+
+	public:
+
+		// Rasterizes the polygon, growing it by pad cells on every side, clipped to the given box
+		Footprint(const std::vector<GridPoint>& polygon, int pad, int clip_minx, int clip_miny, int clip_maxx, int clip_maxy);
+
+		bool empty() const { return _minx > _maxx || _miny > _maxy; }
+
+		// Bounding box of the spans
+		int minx() const { return _minx; }
+		int miny() const { return _miny; }
+		int maxx() const { return _maxx; }
+		int maxy() const { return _maxy; }
+
+		int start(const int y) const { return _start[y - _miny]; }
+		int end(const int y) const { return _end[y - _miny]; }
+	};
+
+	// Traces the rays through the image border down to where they first hit the DEM,
+	// sampling the border about every spacing cells. Rays start at height z_top and
+	// end on the z_bottom plane when they hit nothing
+	template <typename T>
+	std::vector<GridPoint> trace_footprint(DemInfo& info, const DemWindow<T>& dem, const bool has_nodata, const double nodata_value,
+		const double z_top, const double z_bottom, const double half_img_w, const double half_img_h, const double spacing)
+	{
+		const auto trace_ray = [&](const double cpx, const double cpy) {
+
+			GridPoint top, bottom;
+			info.get_coordinates(cpx, cpy, z_top, top.x, top.y);
+			info.get_coordinates(cpx, cpy, z_bottom, bottom.x, bottom.y);
+
+			// About one sample per cell
+			const auto steps = MAX(1, static_cast<int>(std::ceil(MAX(std::abs(bottom.x - top.x), std::abs(bottom.y - top.y)))));
+
+			for (auto i = 0; i <= steps; i++)
+			{
+				const auto t = static_cast<double>(i) / steps;
+
+				const auto x = top.x + (bottom.x - top.x) * t;
+				const auto y = top.y + (bottom.y - top.y) * t;
+
+				const auto cx = static_cast<int>(std::floor(x));
+				const auto cy = static_cast<int>(std::floor(y));
+
+				if (cx < dem.x0() || cy < dem.y0() || cx > dem.x1() || cy > dem.y1())
+					continue;
+
+				const auto z = static_cast<double>(dem.at(cx, cy));
+
+				if (has_nodata && z == nodata_value)
+					continue;
+
+				if (z >= z_top + (z_bottom - z_top) * t)
+					return GridPoint{ x, y };
+			}
+
+			return bottom;
+		};
+
+		const double corners[4][2] = {
+			{ -half_img_w, -half_img_h },
+			{ half_img_w, -half_img_h },
+			{ half_img_w, half_img_h },
+			{ -half_img_w, half_img_h }
+		};
+
+		std::vector<GridPoint> polygon;
+
+		for (auto e = 0; e < 4; e++)
+		{
+			const auto* a = corners[e];
+			const auto* b = corners[(e + 1) % 4];
+
+			GridPoint pa, pb;
+			info.get_coordinates(a[0], a[1], z_bottom, pa.x, pa.y);
+			info.get_coordinates(b[0], b[1], z_bottom, pb.x, pb.y);
+
+			const auto length = std::hypot(pb.x - pa.x, pb.y - pa.y);
+			const auto samples = MAX(1, MIN(4096, static_cast<int>(std::ceil(length / spacing))));
+
+			for (auto s = 0; s < samples; s++)
+			{
+				const auto t = static_cast<double>(s) / samples;
+				polygon.push_back(trace_ray(a[0] + (b[0] - a[0]) * t, a[1] + (b[1] - a[1]) * t));
+			}
+		}
+
+		return polygon;
+	}
+
+}
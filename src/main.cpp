@@ -3,6 +3,11 @@
 #include "processing.hpp"
 #include "parameters.hpp"
 #include "dataset.hpp"
+#include "sidecar.hpp"
+#include "pipeline.hpp"
+#include "mosaic.hpp"
+#include "stats.hpp"
+#include "manifest.hpp"
 
 #include <plog/Log.h>
 #include <plog/Formatters/TxtFormatter.h>
@@ -11,6 +16,9 @@
 
 #include "customformatter.h"
 
+#include <thread>
+#include <unordered_map>
+
 using namespace orthorectify;
 
 int main(int argc, char** argv)
@@ -20,12 +28,18 @@ int main(int argc, char** argv)
 
 	const Parameters params(argc, argv);
 
-	if (!fs::exists(params.outdir))
-		fs::create_directories(params.outdir);
-
 	plog::ColorConsoleAppender<plog::CleanTextFormatter> console_appender;
 	plog::init(params.verbose ? plog::debug : plog::info, &console_appender);
 
+	if (GetGDALDriverManager()->GetDriverByName(params.output.driver.c_str()) == nullptr)
+	{
+		ERR << "GDAL driver " << params.output.driver << " is not available";
+		exit(1);
+	}
+
+	if (!fs::exists(params.outdir))
+		fs::create_directories(params.outdir);
+
 	if (!params.target_images.empty()) {
 		INF << "Processing " << params.target_images.size() << " images";
 
@@ -36,78 +50,136 @@ int main(int argc, char** argv)
 	else
 		INF << "Processing all images";
 
+	auto threads = 1;
+
 #ifdef _OPENMP
 	if (params.threads == -1) {
 		INF << "Using all available threads (" << omp_get_max_threads() << ")";
-		omp_set_num_threads(omp_get_max_threads());
+		threads = omp_get_max_threads();
 	}
 	else {
 		INF << "Using " << params.threads << " threads";
-		omp_set_num_threads(params.threads);
+		threads = params.threads;
 	}
 #endif
 
+	DBG << "Projection kernel: " << get_project_row_kernel_name();
+
 	INF << "Reading DEM: " << params.dem_path;
 
-	const auto dem = static_cast<GDALDataset*>(GDALOpen(params.dem_path.c_str(), GA_ReadOnly));
-	if (dem == nullptr)
-	{
-		ERR << "Could not open DEM file " << params.dem_path;
-		exit(1);
-	}
+	const auto sidecar_path = params.dem_path + ".raw";
+	std::unique_ptr<DemSidecar> sidecar;
+
+	if (params.dem_sidecar)
+		sidecar = DemSidecar::open(sidecar_path, params.dem_path);
+
+	GDALDataset* dem = nullptr;
+	GDALRasterBand* dem_band = nullptr;
 
-	// Get first raster band
-	GDALRasterBand* dem_band = dem->GetRasterBand(1);
-	if (dem_band == nullptr)
+	GDALDataType dem_band_type;
+	double dem_min_value, dem_max_value;
+	double geotransform[6];
+	int w, h;
+	double no_data;
+	bool has_nodata;
+	bool has_wkt;
+	std::string wkt;
+
+	if (sidecar != nullptr)
 	{
-		ERR << "Could not open DEM band";
-		exit(1);
+		INF << "Using raw DEM " << sidecar_path;
+
+		dem_band_type = sidecar->data_type();
+		dem_min_value = sidecar->min_value();
+		dem_max_value = sidecar->max_value();
+		memcpy(geotransform, sidecar->geotransform(), sizeof(geotransform));
+		w = sidecar->width();
+		h = sidecar->height();
+		no_data = sidecar->nodata();
+		has_nodata = sidecar->has_nodata();
+		has_wkt = sidecar->has_wkt();
+		wkt = sidecar->wkt();
 	}
-
-	// Get DEM band data type
-	const GDALDataType dem_band_type = dem_band->GetRasterDataType();
-	if (dem_band_type != GDT_Float32 && dem_band_type != GDT_Byte && dem_band_type != GDT_UInt16)
+	else
 	{
-		ERR << "DEM band data type " << GDALGetDataTypeName(dem_band_type) << " is not supported";
-		exit(1);
+		dem = static_cast<GDALDataset*>(GDALOpen(params.dem_path.c_str(), GA_ReadOnly));
+		if (dem == nullptr)
+		{
+			ERR << "Could not open DEM file " << params.dem_path;
+			exit(1);
+		}
+
+		// Get first raster band
+		dem_band = dem->GetRasterBand(1);
+		if (dem_band == nullptr)
+		{
+			ERR << "Could not open DEM band";
+			exit(1);
+		}
+
+		// Get DEM band data type
+		dem_band_type = dem_band->GetRasterDataType();
+		if (dem_band_type != GDT_Float32 && dem_band_type != GDT_Byte && dem_band_type != GDT_UInt16)
+		{
+			ERR << "DEM band data type " << GDALGetDataTypeName(dem_band_type) << " is not supported";
+			exit(1);
+		}
+
+		get_band_min_max(dem_band, dem_min_value, dem_max_value, params.approx_dem_stats);
+
+		// Get CRS
+		const char* tmp_wkt = dem->GetProjectionRef();
+
+		has_wkt = tmp_wkt != nullptr;
+		if (has_wkt)
+			wkt = std::string(tmp_wkt);
+
+		if (dem->GetGeoTransform(geotransform) != CE_None) {
+			ERR << "Error getting geotransform";
+			exit(1);
+		}
+
+		h = dem->GetRasterYSize();
+		w = dem->GetRasterXSize();
+
+		int success;
+		no_data = dem_band->GetNoDataValue(&success);
+
+		has_nodata = success != 0;
+
+		if (params.dem_sidecar)
+		{
+			INF << "Writing raw DEM " << sidecar_path;
+
+			try
+			{
+				DemSidecar::create(sidecar_path, params.dem_path, dem, dem_min_value, dem_max_value);
+				sidecar = DemSidecar::open(sidecar_path, params.dem_path);
+			}
+			catch (const std::exception& e) {
+				ERR << "Could not write raw DEM " << sidecar_path << ": " << e.what();
+			}
+		}
 	}
 
 	DBG << "DEM band type " << GDALGetDataTypeName(dem_band_type);
 
-	double dem_min_value, dem_max_value;
-	get_band_min_max(dem_band, dem_min_value, dem_max_value);
-
 	INF << "DEM Minimum: " << dem_min_value;
 	INF << "DEM Maximum : " << dem_max_value;
 
 	int dem_offset_x = 0;
 	int dem_offset_y = 0;
 
-	// Get CRS
-	const char* tmp_wkt = dem->GetProjectionRef();
-
-	std::string wkt;
-
-	if (tmp_wkt != nullptr)
+	if (has_wkt)
 	{
-		pretty_print_crs(tmp_wkt);
+		pretty_print_crs(wkt.c_str());
 		get_dem_offsets(params.dataset_path, dem_offset_x, dem_offset_y);
 
 		INF << "DEM offset (" << dem_offset_x << ", " << dem_offset_y << ")";
-
-		wkt = std::string(tmp_wkt);
 	}
 
-	const int h = dem->GetRasterYSize();
-	const int w = dem->GetRasterXSize();
-
 	INF << "DEM dimensions: " << w << "x" << h << " pixels";
 
-	int success;
-	const double no_data = dem_band->GetNoDataValue(&success);
-
-	const bool has_nodata = success != 0;
-
 	if (has_nodata)
 		DBG << "DEM NoData value: " << no_data;
 	else {
@@ -129,52 +201,200 @@ int main(int argc, char** argv)
 	for (const auto& shot : ds.shots)
 		DBG << shot.id;
 
-	double geotransform[6];
+	Transform transform(geotransform);
+	OutputGrid grid(geotransform, w, h, params.resolution);
 
-	if (dem->GetGeoTransform(geotransform) != CE_None) {
-		ERR << "Error getting geotransform";
-		exit(1);
+	if (!grid.native()) {
+		INF << "Output grid: " << grid.width << "x" << grid.height << " pixels (" << grid.scale_x << "x" << grid.scale_y << " pixels per DEM cell)";
 	}
 
-	Transform transform(geotransform);
+	void* dem_source;
 
-	void* dem_data;
-
-	auto size = static_cast<size_t>(w) * h;
-	
-	switch (dem_band_type) {
-	case GDT_Float32:
-		dem_data = new float[size];
-		break;
-	case GDT_Byte:
-		dem_data = new uint8_t[size];
-		break;
-	case GDT_UInt16:
-		dem_data = new uint16_t[size];
-		break;
-	default:
-		ERR << "Unexpected DEM band data type";
-		exit(1);
+	try
+	{
+		switch (dem_band_type) {
+		case GDT_Float32:
+			dem_source = sidecar != nullptr ?
+				new DemSource<float>(static_cast<const float*>(sidecar->data()), w, h) :
+				new DemSource<float>(dem_band, params.dem_cache);
+			break;
+		case GDT_Byte:
+			dem_source = sidecar != nullptr ?
+				new DemSource<uint8_t>(static_cast<const uint8_t*>(sidecar->data()), w, h) :
+				new DemSource<uint8_t>(dem_band, params.dem_cache);
+			break;
+		case GDT_UInt16:
+			dem_source = sidecar != nullptr ?
+				new DemSource<uint16_t>(static_cast<const uint16_t*>(sidecar->data()), w, h) :
+				new DemSource<uint16_t>(dem_band, params.dem_cache);
+			break;
+		default:
+			ERR << "Unexpected DEM band data type";
+			exit(1);
 
+		}
 	}
-
-	if (dem_band->RasterIO(GF_Read, 0, 0, w, h, dem_data, w, h, dem_band_type, 0, 0) != CE_None) {
-		ERR << "Error reading DEM";
+	catch (const std::exception& e) {
+		ERR << "Error reading DEM: " << e.what();
 		exit(1);
 	}
 
-	GDALClose(dem);
+	// Shared read-only by all the shots
+	std::unique_ptr<HeightPyramid> height_pyramid;
+
+	if (!params.skip_visibility_test && params.visibility == RayCast)
+	{
+		const auto pyramid_start = std::chrono::high_resolution_clock::now();
+
+		try
+		{
+			switch (dem_band_type) {
+			case GDT_Float32:
+				height_pyramid = std::make_unique<HeightPyramid>(*static_cast<DemSource<float>*>(dem_source));
+				break;
+			case GDT_Byte:
+				height_pyramid = std::make_unique<HeightPyramid>(*static_cast<DemSource<uint8_t>*>(dem_source));
+				break;
+			case GDT_UInt16:
+				height_pyramid = std::make_unique<HeightPyramid>(*static_cast<DemSource<uint16_t>*>(dem_source));
+				break;
+			default:
+				break;
+			}
+		}
+		catch (const std::exception& e) {
+			ERR << "Error reading DEM: " << e.what();
+			exit(1);
+		}
+
+		DBG << "Built DEM height pyramid (" << height_pyramid->levels() << " levels) in " <<
+			human_duration(std::chrono::high_resolution_clock::now() - pyramid_start);
+	}
 
 	DBG << "DEM data loaded";
 
+	const auto target_shots = std::count_if(ds.shots.begin(), ds.shots.end(), [&params](const Shot& shot) {
+		return std::find(params.target_images.begin(), params.target_images.end(), shot.id) != params.target_images.end();
+	});
+
+	auto threads_per_shot = 1;
+
+#ifdef _OPENMP
+	// Limit the number of images in flight: when only a few images are
+	// processed, the spare threads steal tiles from the images being worked on
+	if (params.threads_per_shot > 0)
+		threads_per_shot = MIN(params.threads_per_shot, threads);
+	else
+		threads_per_shot = MAX(1, threads / MAX(1, static_cast<int>(target_shots)));
+#endif
+
+	const auto max_active_shots = MAX(1, threads / threads_per_shot);
+
+	DBG << "Processing up to " << max_active_shots << " images at a time";
+
+	Scheduler scheduler(threads, max_active_shots);
+
+	// Stage timings and counters, only gathered when they are written out
+	std::unique_ptr<Stats> stats;
+
+	if (!params.stats_json.empty() || !params.trace.empty())
+		stats = std::make_unique<Stats>(!params.trace.empty());
+
 	start = std::chrono::high_resolution_clock::now();
 
-	auto cnt = 0;
+	const auto get_shot_file_name = [](const Shot& shot) {
 
-#pragma omp parallel for
-	for (auto s = 0; s < ds.shots.size(); s++)
+		const auto shot_ext = fs::path(shot.id).extension();
+
+		// Add .tif if shot.id does not end with it
+		return shot_ext == ".tif" ? shot.id : shot.id + ".tif";
+	};
+
+	const auto get_image_path = [&params, &get_shot_file_name](const Shot& shot) {
+		return (params.distorted ?
+			params.dataset_path / "images" / shot.id :
+			params.dataset_path / "opensfm" / "undistorted" / "images" / get_shot_file_name(shot)).generic_string();
+	};
+
+	// Inputs of every output: the DEM and the parameters that change the results
+	Fingerprint run_fingerprint;
+
+	run_fingerprint.add(VERSION_MAJOR);
+	run_fingerprint.add(VERSION_MINOR);
+	run_fingerprint.add_file(params.dem_path);
+	run_fingerprint.add(dem_offset_x);
+	run_fingerprint.add(dem_offset_y);
+
+	// Approximate or stored statistics give other values, which change the footprints and the ray tests
+	run_fingerprint.add(dem_min_value);
+	run_fingerprint.add(dem_max_value);
+
+	run_fingerprint.add(params.skip_visibility_test);
+	run_fingerprint.add(static_cast<int>(params.visibility));
+	run_fingerprint.add(static_cast<int>(params.interpolation));
+	run_fingerprint.add(params.resolution);
+	run_fingerprint.add(params.reduced_sources);
+	run_fingerprint.add(params.distorted);
+	run_fingerprint.add(params.with_alpha);
+	run_fingerprint.add(params.output.driver);
+	run_fingerprint.add(params.output.compress);
+	run_fingerprint.add(params.output.predictor);
+	run_fingerprint.add(params.output.tiled);
+	run_fingerprint.add(params.output.block_size);
+	run_fingerprint.add(params.output.jpeg_quality);
+	run_fingerprint.add(params.output.bigtiff);
+	run_fingerprint.add(params.output.sparse);
+
+	// Plus the source image and the pose and camera of the shot
+	const auto get_fingerprint = [&run_fingerprint, &get_image_path](const Shot& shot) {
+
+		auto fingerprint = run_fingerprint;
+
+		fingerprint.add(shot.id);
+		fingerprint.add_file(get_image_path(shot));
+
+		for (auto r = 0; r < 3; r++)
+			for (auto c = 0; c < 3; c++)
+				fingerprint.add(shot.rotation_matrix(r, c));
+
+		for (auto k = 0; k < 3; k++)
+			fingerprint.add(shot.origin(k));
+
+		fingerprint.add(shot.camera_focal);
+		fingerprint.add(shot.camera_width);
+		fingerprint.add(shot.camera_height);
+
+		const auto& camera = shot.camera;
+
+		fingerprint.add(static_cast<int>(camera.type));
+		fingerprint.add(camera.focal_x);
+		fingerprint.add(camera.focal_y);
+		fingerprint.add(camera.c_x);
+		fingerprint.add(camera.c_y);
+
+		for (const auto k : camera.k)
+			fingerprint.add(k);
+
+		for (const auto p : camera.p)
+			fingerprint.add(p);
+
+		for (const auto s : camera.s)
+			fingerprint.add(s);
+
+		fingerprint.add(camera.transition);
+
+		return fingerprint;
+	};
+
+	// Shots to process, in dataset order. Shots whose output was made from the same
+	// inputs are skipped, so that a run that was stopped picks up where it was
+	std::vector<size_t> shot_indices;
+	std::unordered_map<std::string, Fingerprint> fingerprints;
+	auto up_to_date = 0;
+
+	for (size_t s = 0; s < ds.shots.size(); s++)
 	{
-		const auto shot = ds.shots[s];
+		const auto& shot = ds.shots[s];
 
 		if (std::find_if(params.target_images.begin(), params.target_images.end(),
 			[&shot](const std::string& id) { return !id.compare(shot.id); }) == params.target_images.end())
@@ -183,77 +403,324 @@ int main(int argc, char** argv)
 			continue;
 		}
 
-		INF << "Processing shot " << shot.id;
-		cnt++;
+		const auto fingerprint = get_fingerprint(shot);
 
-		const auto shot_ext = fs::path(shot.id).extension();
+		if (params.mosaic.empty() && !params.overwrite &&
+			is_up_to_date((params.outdir / get_shot_file_name(shot)).generic_string(), fingerprint))
+		{
+			DBG << "Skipping image " << shot.id << " (up to date)";
+			up_to_date++;
+			continue;
+		}
 
-		// Add .tif if shot.id does not end with it
-		const auto shot_file_name = shot_ext == ".tif" ? shot.id : shot.id + ".tif";
+		fingerprints.emplace(shot.id, fingerprint);
+		shot_indices.push_back(s);
+	}
+
+	if (up_to_date > 0) {
+		INF << "Skipping " << up_to_date << " images that are up to date (use --overwrite to process them again)";
+	}
+
+	// The mosaic is made from all the shots
+	Fingerprint mosaic_fingerprint = run_fingerprint;
+
+	if (!params.mosaic.empty())
+	{
+		mosaic_fingerprint.add(params.mosaic_feather);
+
+		for (const auto s : shot_indices)
+			mosaic_fingerprint.add(fingerprints.at(ds.shots[s].id).value());
+
+		if (!params.overwrite && is_up_to_date(params.mosaic, mosaic_fingerprint))
+		{
+			INF << "Mosaic " << params.mosaic << " is up to date (use --overwrite to make it again)";
+			shot_indices.clear();
+		}
+	}
+
+	// In mosaic mode the results are blended into a single output. Its tiles are written
+	// once every shot that can cover them is done, so the box each shot can write to
+	// is registered upfront
+	std::unique_ptr<Mosaic> mosaic;
+
+	if (!params.mosaic.empty() && !shot_indices.empty())
+	{
+		// It is written in place, it does not match any manifest until it is finished
+		remove_manifest(params.mosaic);
+
+		mosaic = std::make_unique<Mosaic>(params.mosaic, grid.width, grid.height, grid.geotransform, wkt, params.output, params.with_alpha,
+			params.mosaic_cache, params.mosaic_feather);
+
+		for (const auto s : shot_indices)
+		{
+			const auto& shot = ds.shots[s];
+
+			auto half_img_w = (shot.camera_width - 1) / 2.0;
+			auto half_img_h = (shot.camera_height - 1) / 2.0;
+			const auto f = shot.camera_focal * MAX(shot.camera_width, shot.camera_height);
+
+			// The field of view of a distorted image is not its rectangle
+			if (params.distorted)
+			{
+				try
+				{
+					const ShotDistortion distortion(shot.camera, shot.camera_width, shot.camera_height, f);
+
+					half_img_w = distortion.extent_w();
+					half_img_h = distortion.extent_h();
+				}
+				catch (const std::exception&) {
+					// Fails again when processing the shot, which writes nothing
+					continue;
+				}
+			}
 
-		const auto image_path = (params.dataset_path / "opensfm" / "undistorted" / "images" / shot_file_name).generic_string();
+			auto info = get_dem_info(shot, f, dem_min_value, dem_offset_x, dem_offset_y, transform);
 
-		DBG << "Image file path: " << image_path;
-		const auto out_path = (params.outdir / shot_file_name).generic_string();
+			const auto z_top = MIN(dem_max_value, shot.origin(2));
+			const bool trace = !params.skip_visibility_test && shot.origin(2) > dem_min_value;
+
+			int minx, miny, maxx, maxy;
+			get_footprint_window(info, half_img_w, half_img_h, trace, z_top, w, h, minx, miny, maxx, maxy);
+
+			// The samples lie within the footprint, grown by its padding (plus a pixel, as it is rounded on the output grid)
+			mosaic->expect(shot.id, grid.first_pixel_x(minx - footprint_pad) - 1, grid.first_pixel_y(miny - footprint_pad) - 1,
+				grid.last_pixel_x(maxx + footprint_pad) + 1, grid.last_pixel_y(maxy + footprint_pad) + 1);
+		}
+	}
+
+	// Every shot is released once, processed or not
+	const auto release_shot = [&mosaic](const std::string& shot_id) {
+
+		if (mosaic == nullptr)
+			return;
+
+		try
+		{
+			mosaic->release(shot_id);
+		}
+		catch (const std::exception& e) {
+			ERR << "Error while writing mosaic: " << e.what();
+		}
+	};
+
+	// Images go through a pipeline: readers decode the next source images while the
+	// scheduler works on the current ones and writers encode the results. The queues
+	// between the stages are bounded, so a stage that lags holds back the others
+	// instead of letting images pile up in memory
+	struct SourceImage
+	{
+		size_t shot;
+		std::unique_ptr<RawImage> image;
+	};
+
+	BoundedQueue<SourceImage> sources(params.prefetch);
+	BoundedQueue<std::unique_ptr<OrthoImage>> results(params.writers);
+
+	// Workers waiting on the queues (wait_until) sleep until they change
+	sources.on_change([&scheduler]() { scheduler.notify(); });
+	results.on_change([&scheduler]() { scheduler.notify(); });
+
+	std::atomic<size_t> next_read(0);
+	std::atomic<int> active_readers(params.readers);
+
+	std::vector<std::thread> readers;
+
+	for (auto r = 0; r < params.readers; r++)
+	{
+		readers.emplace_back([&]() {
+
+			for (auto i = next_read.fetch_add(1); i < shot_indices.size(); i = next_read.fetch_add(1))
+			{
+				const auto& shot = ds.shots[shot_indices[i]];
+				const auto image_path = get_image_path(shot);
+
+				DBG << "Image file path: " << image_path;
+
+				SourceImage source{ shot_indices[i], nullptr };
+
+				try
+				{
+					const auto min_size = params.reduced_sources ?
+						get_source_size(shot, dem_max_value, MIN(std::abs(grid.geotransform[1]), std::abs(grid.geotransform[5]))) : 0;
+
+					const StageTimer timer(stats.get(), shot.id, LoadStage);
+
+					source.image = std::make_unique<RawImage>(image_path, min_size);
+
+					if (stats != nullptr)
+					{
+						ShotCounters counters;
+						counters.bytes_read = static_cast<uint64_t>(source.image->width()) * source.image->height() *
+							source.image->bands() * GDALGetDataTypeSizeBytes(source.image->type());
+
+						stats->add_counters(shot.id, counters);
+					}
+				}
+				catch (const std::exception& e) {
+					ERR << "Error while reading image \"" << shot.id << "\": " << e.what();
+				}
+
+				// Failed reads are queued too, every processing job takes one item
+				sources.push(std::move(source));
+			}
+
+			if (active_readers.fetch_sub(1) == 1)
+				sources.close();
+		});
+	}
+
+	std::atomic<int> cnt(0);
+
+	// Shots that cover nothing, done as well
+	std::atomic<int> empty_shots(0);
+
+	std::vector<std::thread> writers;
+
+	for (auto wr = 0; wr < params.writers; wr++)
+	{
+		writers.emplace_back([&]() {
+
+			std::unique_ptr<OrthoImage> ortho;
+
+			while (results.pop(ortho))
+			{
+				try
+				{
+					{
+						const StageTimer timer(stats.get(), ortho->shot_id, WriteStage);
+
+						if (mosaic != nullptr)
+							mosaic->add(*ortho);
+						else
+						{
+							write_ortho_image(*ortho, wkt, params.output);
+							write_manifest(ortho->out_path, fingerprints.at(ortho->shot_id));
+						}
+					}
+
+					if (stats != nullptr)
+					{
+						ShotCounters counters;
+						counters.bytes_written = static_cast<uint64_t>(ortho->width) * ortho->height *
+							ortho->image->bands() * GDALGetDataTypeSizeBytes(ortho->image->type());
+
+						stats->add_counters(ortho->shot_id, counters);
+					}
+
+					cnt++;
+				}
+				catch (const std::exception& e) {
+					ERR << "Error while writing image \"" << ortho->shot_id << "\": " << e.what();
+				}
+
+				release_shot(ortho->shot_id);
+				ortho.reset();
+			}
+		});
+	}
+
+	scheduler.run(shot_indices.size(), [&](const size_t)
+	{
+		SourceImage source{ 0, nullptr };
+
+		// While the next image is being read, the worker runs tiles of the images in progress
+		bool popped = false;
+		scheduler.wait_until([&]() { return (popped = sources.try_pop(source)) || sources.drained(); });
+
+		if (!popped)
+			return;
+
+		const auto& shot = ds.shots[source.shot];
+
+		if (source.image == nullptr)
+		{
+			release_shot(shot.id);
+			return;
+		}
+
+		INF << "Processing shot " << shot.id;
+
+		const auto out_path = (params.outdir / get_shot_file_name(shot)).generic_string();
+
+		std::unique_ptr<OrthoImage> ortho;
 
 		switch (dem_band_type) {
 		case GDT_Float32:
-			process_image<float>(image_path, out_path, ProcessingParameters<float> {
+			ortho = process_image<float>(*source.image, out_path, ProcessingParameters<float> {
 				params.skip_visibility_test,
+					params.visibility,
 					shot,
+					params.distorted,
 					has_nodata,
 					no_data,
 					transform,
+					grid,
 					static_cast<double>(dem_offset_x),
 					static_cast<double>(dem_offset_y),
 					w,
 					h,
 					dem_min_value,
 					dem_max_value,
-					static_cast<float*>(dem_data),
+					*static_cast<DemSource<float>*>(dem_source),
+					height_pyramid.get(),
 					params.interpolation,
 					params.with_alpha,
-					wkt
+					wkt,
+					scheduler,
+					stats.get()
 			}
 			);
 			break;
 		case GDT_Byte:
-			process_image<uint8_t>(image_path, out_path, ProcessingParameters<uint8_t> {
+			ortho = process_image<uint8_t>(*source.image, out_path, ProcessingParameters<uint8_t> {
 				params.skip_visibility_test,
+					params.visibility,
 					shot,
+					params.distorted,
 					has_nodata,
 					no_data,
 					transform,
+					grid,
 					static_cast<double>(dem_offset_x),
 					static_cast<double>(dem_offset_y),
 					w,
 					h,
 					dem_min_value,
 					dem_max_value,
-					static_cast<uint8_t*>(dem_data),
+					*static_cast<DemSource<uint8_t>*>(dem_source),
+					height_pyramid.get(),
 					params.interpolation,
 					params.with_alpha,
-					wkt
+					wkt,
+					scheduler,
+					stats.get()
 			}
 			);
 			break;
 		case GDT_UInt16:
-			process_image<uint16_t>(image_path, out_path, ProcessingParameters<uint16_t> {
+			ortho = process_image<uint16_t>(*source.image, out_path, ProcessingParameters<uint16_t> {
 				params.skip_visibility_test,
+					params.visibility,
 					shot,
+					params.distorted,
 					has_nodata,
 					no_data,
 					transform,
+					grid,
 					static_cast<double>(dem_offset_x),
 					static_cast<double>(dem_offset_y),
 					w,
 					h,
 					dem_min_value,
 					dem_max_value,
-					static_cast<uint16_t*>(dem_data),
+					*static_cast<DemSource<uint16_t>*>(dem_source),
+					height_pyramid.get(),
 					params.interpolation,
 					params.with_alpha,
-					wkt
+					wkt,
+					scheduler,
+					stats.get()
 			}
 			);
 			break;
@@ -262,25 +729,110 @@ int main(int argc, char** argv)
 			ERR << "Unexpected DEM band type";
 			exit(1);
 		}
+
+		// Not needed anymore, free it before waiting on the writers
+		source.image.reset();
+
+		if (ortho == nullptr)
+		{
+			release_shot(shot.id);
+			return;
+		}
+
+		if (ortho->empty())
+		{
+			// Recorded so that the next runs skip it too. An output left by an earlier run
+			// was made from other inputs
+			if (mosaic == nullptr)
+			{
+				try
+				{
+					std::error_code error;
+					fs::remove(ortho->out_path, error);
+
+					write_manifest(ortho->out_path, fingerprints.at(shot.id), true);
+				}
+				catch (const std::exception& e) {
+					ERR << "Error while writing the manifest of \"" << shot.id << "\": " << e.what();
+				}
+			}
+
+			empty_shots++;
+			release_shot(shot.id);
+			return;
+		}
+
+		scheduler.wait_until([&]() { return results.try_push(ortho); });
+	});
+
+	for (auto& reader : readers)
+		reader.join();
+
+	results.close();
+
+	for (auto& writer : writers)
+		writer.join();
+
+	if (mosaic != nullptr)
+	{
+		try
+		{
+			mosaic->finish();
+
+			// A mosaic missing shots (that failed) is made again by the next run
+			if (cnt.load() + empty_shots.load() == static_cast<int>(shot_indices.size()))
+				write_manifest(params.mosaic, mosaic_fingerprint);
+		}
+		catch (const std::exception& e) {
+			ERR << "Error while writing mosaic: " << e.what();
+		}
 	}
 
 	switch (dem_band_type) {
 	case GDT_Float32:
-		delete[]static_cast<float*>(dem_data);
+		delete static_cast<DemSource<float>*>(dem_source);
 		break;
 	case GDT_Byte:
-		delete[]static_cast<uint8_t*>(dem_data);
+		delete static_cast<DemSource<uint8_t>*>(dem_source);
 		break;
 	case GDT_UInt16:
-		delete[]static_cast<uint16_t*>(dem_data);
+		delete static_cast<DemSource<uint16_t>*>(dem_source);
 		break;
 	default:
 		break;
 	}
 
+	if (dem != nullptr)
+		GDALClose(dem);
+
 	elapsed = std::chrono::high_resolution_clock::now() - start;
 
-	INF << "Processed " << cnt << " images in " << human_duration(elapsed);
+	INF << "Processed " << cnt.load() << " images in " << human_duration(elapsed);
+
+	if (empty_shots.load() > 0) {
+		INF << empty_shots.load() << " images cover nothing of the DEM";
+	}
+
+	if (stats != nullptr)
+	{
+		try
+		{
+			if (!params.stats_json.empty())
+			{
+				stats->write_json(params.stats_json);
+				INF << "Stats written to " << params.stats_json;
+			}
+
+			if (!params.trace.empty())
+			{
+				stats->write_trace(params.trace);
+				INF << "Trace written to " << params.trace;
+			}
+		}
+		catch (const std::exception& e) {
+			ERR << "Error while writing stats: " << e.what();
+		}
+	}
 
 	return 0;
 }
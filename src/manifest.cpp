@@ -0,0 +1,81 @@
+#include <fstream>
+#include <stdexcept>
+
+#include "../vendor/json.hpp"
+
+#include "manifest.hpp"
+
+using json = nlohmann::json;
+
+namespace orthorectify {
+
+	static constexpr int manifest_version = 1;
+
+	void Fingerprint::add_file(const std::string& path)
+	{
+		add(path);
+
+		std::error_code error;
+		const auto size = fs::file_size(path, error);
+
+		add(static_cast<uint64_t>(error ? 0 : size));
+		add(fs::exists(path, error) ? get_mtime(path) : static_cast<int64_t>(0));
+	}
+
+	std::string Fingerprint::hex() const
+	{
+		char buffer[17];
+		snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(_hash));
+
+		return buffer;
+	}
+
+	std::string get_manifest_path(const std::string& output_path)
+	{
+		return output_path + ".manifest";
+	}
+
+	bool is_up_to_date(const std::string& output_path, const Fingerprint& fingerprint)
+	{
+		const auto manifest_path = get_manifest_path(output_path);
+
+		if (!fs::exists(manifest_path))
+			return false;
+
+		try
+		{
+			std::ifstream in(manifest_path);
+			const auto manifest = json::parse(in);
+
+			return manifest.value("version", 0) == manifest_version &&
+				manifest.value("fingerprint", std::string()) == fingerprint.hex() &&
+				(manifest.value("empty", false) || fs::exists(output_path));
+		}
+		catch (const std::exception& e) {
+			DBG << "Ignoring manifest " << manifest_path << ": " << e.what();
+			return false;
+		}
+	}
+
+	void write_manifest(const std::string& output_path, const Fingerprint& fingerprint, const bool empty)
+	{
+		const json manifest = {
+			{ "version", manifest_version },
+			{ "fingerprint", fingerprint.hex() },
+			{ "output", fs::path(output_path).filename().string() },
+			{ "empty", empty },
+			{ "created", get_formatted_date_time() }
+		};
+
+		write_stream_atomically(get_manifest_path(output_path), [&manifest](std::ostream& out) {
+			out << manifest.dump(1, '\t') << std::endl;
+		});
+	}
+
+	void remove_manifest(const std::string& output_path)
+	{
+		std::error_code error;
+		fs::remove(get_manifest_path(output_path), error);
+	}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "utils.hpp"
+
+namespace orthorectify {
+
+	// FNV-1a hash of the inputs of an output
+	class Fingerprint
+	{
+		uint64_t _hash;
+
+	public:
+
+		Fingerprint() {
+			this->_hash = 14695981039346656037ULL;
+		}
+
+		void add(const void* data, const size_t size)
+		{
+			const auto* bytes = static_cast<const uint8_t*>(data);
+
+			for (size_t i = 0; i < size; i++)
+			{
+				_hash ^= bytes[i];
+				_hash *= 1099511628211ULL;
+			}
+		}
+
+		// Strings are length prefixed, so that consecutive ones cannot be confused
+		void add(const std::string& value)
+		{
+			add(static_cast<uint64_t>(value.size()));
+			add(value.data(), value.size());
+		}
+
+		void add(const char* value) { add(std::string(value)); }
+
+		void add(const bool value) { add(static_cast<uint64_t>(value)); }
+		void add(const int value) { add(static_cast<int64_t>(value)); }
+		void add(const int64_t value) { add(&value, sizeof(value)); }
+		void add(const uint64_t value) { add(&value, sizeof(value)); }
+		void add(const double value) { add(&value, sizeof(value)); }
+
+		// A file is identified by its path, size and modification time (0 when it does not exist)
+		void add_file(const std::string& path);
+
+		uint64_t value() const { return _hash; }
+
+		std::string hex() const;
+	};
+
+	// Manifest of an output (output path + ".manifest"), holds the fingerprint of the inputs
+	// it was made from. It is written once the output is complete
+	std::string get_manifest_path(const std::string& output_path);
+
+	// Whether the manifest holds the fingerprint and the output exists (unless it was recorded empty)
+	bool is_up_to_date(const std::string& output_path, const Fingerprint& fingerprint);
+
+	// Written once the output is complete. Inputs that give no output (i.e. a shot outside of
+	// the DEM) are recorded as empty, so that the next runs skip them too
+	void write_manifest(const std::string& output_path, const Fingerprint& fingerprint, bool empty = false);
+
+	// Removes the manifest of an output about to be replaced
+	void remove_manifest(const std::string& output_path);
+
+}
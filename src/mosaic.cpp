@@ -0,0 +1,579 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "mosaic.hpp"
+
+#include "cpl_string.h"
+
+namespace orthorectify {
+
+	Mosaic::Mosaic(const std::string& path, const int width, const int height, const double* geotransform, const std::string& wkt,
+		const OutputOptions& options, const bool with_alpha, const size_t cache_size, const float feather)
+	{
+		this->_path = path;
+
+		// A COG cannot be written block by block, the tiles go to a GeoTIFF which is converted at the end
+		this->_tiff_path = options.driver == "COG" ? get_temp_path(path) : path;
+		this->_scratch_path = path + ".scratch";
+		this->_wkt = wkt;
+		memcpy(this->_geotransform, geotransform, sizeof(this->_geotransform));
+		this->_options = options;
+		this->_with_alpha = with_alpha;
+		this->_feather = feather;
+
+		this->_width = width;
+		this->_height = height;
+		this->_tile_size = options.block_size;
+		this->_tiles_x = (width + _tile_size - 1) / _tile_size;
+		this->_tiles_y = (height + _tile_size - 1) / _tile_size;
+
+		this->_cache_size = cache_size;
+		this->_cached = 0;
+
+		this->_bands = 0;
+		this->_type = GDT_Byte;
+		this->_ds = nullptr;
+
+		this->_tiles.resize(static_cast<size_t>(_tiles_x) * _tiles_y);
+	}
+
+	Mosaic::~Mosaic()
+	{
+		if (_ds != nullptr)
+			GDALClose(_ds);
+
+		// Left over when the mosaic was not finished
+		if (_tiff_path != _path)
+		{
+			std::error_code error;
+			fs::remove(_tiff_path, error);
+		}
+
+		if (_scratch.is_open())
+		{
+			_scratch.close();
+			fs::remove(_scratch_path);
+		}
+	}
+
+	void Mosaic::expect(const std::string& shot_id, const int minx, const int miny, const int maxx, const int maxy)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		const auto x0 = MAX(0, minx);
+		const auto y0 = MAX(0, miny);
+		const auto x1 = MIN(_width - 1, maxx);
+		const auto y1 = MIN(_height - 1, maxy);
+
+		if (x0 > x1 || y0 > y1)
+			return;
+
+		const Box box{ x0 / _tile_size, y0 / _tile_size, x1 / _tile_size, y1 / _tile_size };
+
+		if (!_boxes.emplace(shot_id, box).second)
+			return;
+
+		for (auto ty = box.miny; ty <= box.maxy; ty++)
+			for (auto tx = box.minx; tx <= box.maxx; tx++)
+				_tiles[static_cast<size_t>(ty) * _tiles_x + tx].pending++;
+	}
+
+	void Mosaic::_create(const RawImage& image)
+	{
+		this->_bands = image.color_bands();
+		this->_type = image.type();
+
+		const auto out_bands = _bands + (_with_alpha ? 1 : 0);
+
+		// Blocks match the tiles, each one is written (and compressed) once
+		auto tiff_options = _options;
+		tiff_options.driver = "GTiff";
+		tiff_options.tiled = true;
+		tiff_options.sparse = true;
+
+		CPLStringList creation_options;
+
+		for (const auto& option : get_creation_options(tiff_options, out_bands, _type))
+			creation_options.AddString(option.c_str());
+
+		if (fs::exists(_tiff_path))
+			fs::remove(_tiff_path);
+
+		auto* driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+
+		_ds = driver->Create(_tiff_path.c_str(), _width, _height, out_bands, _type, creation_options.List());
+
+		if (_ds == nullptr) {
+			ERR << "Could not create mosaic at " << _tiff_path;
+			throw std::runtime_error(CPLGetLastErrorMsg());
+		}
+
+		if (!_wkt.empty())
+			_ds->SetProjection(_wkt.c_str());
+
+		_ds->SetGeoTransform(_geotransform);
+
+		_ds->SetMetadataItem("AREA_OR_POINT", "Area");
+		_ds->SetMetadataItem("TIFFTAG_SOFTWARE", "OpenDroneMap Orthorectify");
+		_ds->SetMetadataItem("TIFFTAG_DATETIME", get_formatted_date_time().c_str());
+
+		for (auto b = 0; b < out_bands; b++)
+			_ds->GetRasterBand(b + 1)->SetColorInterpretation(get_color_interpretation(b, out_bands, _with_alpha));
+
+		INF << "Mosaic " << _width << "x" << _height << " pixels (" << out_bands << " bands, " <<
+			GDALGetDataTypeName(_type) << "), " << _tiles_x << "x" << _tiles_y << " tiles";
+	}
+
+	void Mosaic::_load(const size_t index)
+	{
+		auto& tile = _tiles[index];
+
+		tile.sums.assign(_tile_cells() * _bands, 0.0f);
+		tile.weights.assign(_tile_cells(), 0.0f);
+
+		if (tile.spilled)
+		{
+			_scratch.seekg(static_cast<std::streamoff>(index * _tile_bytes()));
+			_scratch.read(reinterpret_cast<char*>(tile.sums.data()), static_cast<std::streamsize>(tile.sums.size() * sizeof(float)));
+			_scratch.read(reinterpret_cast<char*>(tile.weights.data()), static_cast<std::streamsize>(tile.weights.size() * sizeof(float)));
+
+			if (!_scratch)
+				throw std::runtime_error("Could not read mosaic tile from " + _scratch_path);
+		}
+
+		_lru.push_front(index);
+		tile.lru = _lru.begin();
+
+		_cached += _tile_bytes();
+	}
+
+	void Mosaic::_evict()
+	{
+		// The most recently used tile always stays, it is the one being worked on
+		while (_cached > _cache_size && _lru.size() > 1)
+		{
+			const auto index = _lru.back();
+			auto& tile = _tiles[index];
+
+			if (!_scratch.is_open())
+			{
+				_scratch.open(_scratch_path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+
+				if (!_scratch.is_open())
+					throw std::runtime_error("Could not create " + _scratch_path);
+
+				DBG << "Mosaic tiles over the cache size go to " << _scratch_path;
+			}
+
+			// Every tile has its own slot, the file stays sparse where nothing was spilled
+			_scratch.seekp(static_cast<std::streamoff>(index * _tile_bytes()));
+			_scratch.write(reinterpret_cast<const char*>(tile.sums.data()), static_cast<std::streamsize>(tile.sums.size() * sizeof(float)));
+			_scratch.write(reinterpret_cast<const char*>(tile.weights.data()), static_cast<std::streamsize>(tile.weights.size() * sizeof(float)));
+
+			if (!_scratch)
+				throw std::runtime_error("Could not write mosaic tile to " + _scratch_path);
+
+			tile.spilled = true;
+			std::vector<float>().swap(tile.sums);
+			std::vector<float>().swap(tile.weights);
+
+			_lru.pop_back();
+			_cached -= _tile_bytes();
+		}
+	}
+
+	template <typename S>
+	void Mosaic::_mark_samples(const OrthoImage& ortho, std::vector<float>& weights) const
+	{
+		const auto& image = *ortho.image;
+		const auto color_bands = image.color_bands();
+
+		for (auto y = 0; y < ortho.height; y++)
+		{
+			for (auto x = 0; x < ortho.width; x++)
+			{
+				const auto* px = image.pixel<S>(ortho.x + x, ortho.y + y);
+				bool valid = false;
+
+				if (image.has_alpha())
+					valid = px[color_bands] != 0;
+				else
+				{
+					for (auto b = 0; b < color_bands && !valid; b++)
+						valid = px[b] != 0;
+				}
+
+				weights[static_cast<size_t>(y) * ortho.width + x] = valid ? std::numeric_limits<float>::max() : 0.0f;
+			}
+		}
+	}
+
+	template <typename S>
+	void Mosaic::_accumulate(const OrthoImage& ortho, const std::vector<float>& weights)
+	{
+		const auto& image = *ortho.image;
+
+		const auto minx = MAX(0, ortho.grid_x);
+		const auto miny = MAX(0, ortho.grid_y);
+		const auto maxx = MIN(_width - 1, ortho.grid_x + ortho.width - 1);
+		const auto maxy = MIN(_height - 1, ortho.grid_y + ortho.height - 1);
+
+		for (auto ty = miny / _tile_size; ty <= maxy / _tile_size; ty++)
+		{
+			for (auto tx = minx / _tile_size; tx <= maxx / _tile_size; tx++)
+			{
+				const auto index = static_cast<size_t>(ty) * _tiles_x + tx;
+				auto& tile = _tiles[index];
+
+				if (tile.done)
+				{
+					ERR << "Mosaic tile (" << tx << ", " << ty << ") was already written, image \"" << ortho.shot_id << "\" is outside of its expected bounds";
+					continue;
+				}
+
+				if (tile.sums.empty())
+					_load(index);
+				else
+					_lru.splice(_lru.begin(), _lru, tile.lru);
+
+				const auto x0 = MAX(minx, tx * _tile_size);
+				const auto y0 = MAX(miny, ty * _tile_size);
+				const auto x1 = MIN(maxx, (tx + 1) * _tile_size - 1);
+				const auto y1 = MIN(maxy, (ty + 1) * _tile_size - 1);
+
+				for (auto y = y0; y <= y1; y++)
+				{
+					const auto ly = y - ortho.grid_y;
+
+					for (auto x = x0; x <= x1; x++)
+					{
+						const auto lx = x - ortho.grid_x;
+						const auto weight = weights[static_cast<size_t>(ly) * ortho.width + lx];
+
+						if (weight <= 0)
+							continue;
+
+						const auto* px = image.pixel<S>(ortho.x + lx, ortho.y + ly);
+						const auto cell = static_cast<size_t>(y - ty * _tile_size) * _tile_size + (x - tx * _tile_size);
+
+						auto* sums = tile.sums.data() + cell * _bands;
+
+						for (auto b = 0; b < _bands; b++)
+							sums[b] += weight * static_cast<float>(px[b]);
+
+						tile.weights[cell] += weight;
+					}
+				}
+
+				_evict();
+			}
+		}
+	}
+
+	void Mosaic::add(const OrthoImage& ortho)
+	{
+		const auto start = std::chrono::high_resolution_clock::now();
+
+		const auto& image = *ortho.image;
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			if (_ds == nullptr)
+				_create(image);
+		}
+
+		if (image.color_bands() != _bands || image.type() != _type)
+		{
+			ERR << "Image \"" << ortho.shot_id << "\" (" << image.color_bands() << " bands, " << GDALGetDataTypeName(image.type()) <<
+				") does not match the mosaic (" << _bands << " bands, " << GDALGetDataTypeName(_type) << "), skipping it";
+			return;
+		}
+
+		const auto width = ortho.width;
+		const auto height = ortho.height;
+
+		// Blending weights: chamfer (3-4) distance of each sample to the closest empty pixel
+		// or to the border of the window, ramping up to 1 over the feather width
+		std::vector<float> weights(static_cast<size_t>(width) * height);
+
+		switch (_type) {
+		case GDT_Byte:
+			_mark_samples<uint8_t>(ortho, weights);
+			break;
+		case GDT_UInt16:
+			_mark_samples<uint16_t>(ortho, weights);
+			break;
+		case GDT_Float32:
+			_mark_samples<float>(ortho, weights);
+			break;
+		default:
+			ERR << "Unexpected image type " << GDALGetDataTypeName(_type);
+			return;
+		}
+
+		if (_feather > 0)
+		{
+			const auto at = [&weights, width, height](const int x, const int y) {
+				return x < 0 || y < 0 || x >= width || y >= height ? 0.0f : weights[static_cast<size_t>(y) * width + x];
+			};
+
+			for (auto y = 0; y < height; y++)
+			{
+				for (auto x = 0; x < width; x++)
+				{
+					auto& d = weights[static_cast<size_t>(y) * width + x];
+
+					if (d == 0)
+						continue;
+
+					d = MIN(d, MIN(at(x - 1, y), at(x, y - 1)) + 3);
+					d = MIN(d, MIN(at(x - 1, y - 1), at(x + 1, y - 1)) + 4);
+				}
+			}
+
+			for (auto y = height - 1; y >= 0; y--)
+			{
+				for (auto x = width - 1; x >= 0; x--)
+				{
+					auto& d = weights[static_cast<size_t>(y) * width + x];
+
+					if (d == 0)
+						continue;
+
+					d = MIN(d, MIN(at(x + 1, y), at(x, y + 1)) + 3);
+					d = MIN(d, MIN(at(x + 1, y + 1), at(x - 1, y + 1)) + 4);
+				}
+			}
+
+			for (auto& d : weights)
+				d = MIN(1.0f, d / (3.0f * _feather));
+		}
+		else
+		{
+			for (auto& d : weights)
+				d = d > 0 ? 1.0f : 0.0f;
+		}
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		switch (_type) {
+		case GDT_Byte:
+			_accumulate<uint8_t>(ortho, weights);
+			break;
+		case GDT_UInt16:
+			_accumulate<uint16_t>(ortho, weights);
+			break;
+		case GDT_Float32:
+			_accumulate<float>(ortho, weights);
+			break;
+		default:
+			ERR << "Unexpected image type " << GDALGetDataTypeName(_type);
+			return;
+		}
+
+		DBG << "Image \"" << ortho.shot_id << "\" added to the mosaic in " << human_duration(std::chrono::high_resolution_clock::now() - start);
+	}
+
+	template <typename S>
+	void Mosaic::_resolve(const Tile& tile, std::vector<uint8_t>& out) const
+	{
+		const auto out_bands = _bands + (_with_alpha ? 1 : 0);
+
+		// Same as the single images
+		constexpr auto opaque = static_cast<S>(255);
+
+		auto* data = reinterpret_cast<S*>(out.data());
+
+		for (size_t cell = 0; cell < _tile_cells(); cell++)
+		{
+			const auto weight = tile.weights[cell];
+
+			if (weight <= 0)
+				continue;
+
+			const auto* sums = tile.sums.data() + cell * _bands;
+			auto* px = data + cell * out_bands;
+
+			for (auto b = 0; b < _bands; b++)
+			{
+				const auto value = sums[b] / weight;
+
+				if constexpr (std::is_integral_v<S>)
+					px[b] = static_cast<S>(std::clamp(std::round(value), 0.0f, static_cast<float>(std::numeric_limits<S>::max())));
+				else
+					px[b] = value;
+			}
+
+			if (_with_alpha)
+				px[_bands] = opaque;
+		}
+	}
+
+	void Mosaic::_finish(const size_t index, std::vector<TileData>& ready)
+	{
+		auto& tile = _tiles[index];
+
+		tile.done = true;
+
+		// Nothing was ever added, the block stays empty
+		if (tile.sums.empty() && !tile.spilled)
+			return;
+
+		if (tile.sums.empty())
+			_load(index);
+
+		const auto out_bands = _bands + (_with_alpha ? 1 : 0);
+
+		TileData data{ index, std::vector<uint8_t>(_tile_cells() * out_bands * GDALGetDataTypeSizeBytes(_type), 0) };
+
+		switch (_type) {
+		case GDT_Byte:
+			_resolve<uint8_t>(tile, data.data);
+			break;
+		case GDT_UInt16:
+			_resolve<uint16_t>(tile, data.data);
+			break;
+		case GDT_Float32:
+			_resolve<float>(tile, data.data);
+			break;
+		default:
+			break;
+		}
+
+		const auto empty = std::all_of(tile.weights.begin(), tile.weights.end(), [](const float weight) { return weight <= 0; });
+
+		_lru.erase(tile.lru);
+		_cached -= _tile_bytes();
+
+		std::vector<float>().swap(tile.sums);
+		std::vector<float>().swap(tile.weights);
+
+		if (!empty)
+			ready.push_back(std::move(data));
+	}
+
+	void Mosaic::_write(const std::vector<TileData>& ready)
+	{
+		if (ready.empty())
+			return;
+
+		std::lock_guard<std::mutex> lock(_io_mutex);
+
+		const auto out_bands = _bands + (_with_alpha ? 1 : 0);
+		const auto sample_size = GDALGetDataTypeSizeBytes(_type);
+
+		for (const auto& tile : ready)
+		{
+			const auto x0 = static_cast<int>(tile.index % _tiles_x) * _tile_size;
+			const auto y0 = static_cast<int>(tile.index / _tiles_x) * _tile_size;
+			const auto width = MIN(_tile_size, _width - x0);
+			const auto height = MIN(_tile_size, _height - y0);
+
+			const auto err = _ds->RasterIO(GF_Write, x0, y0, width, height, const_cast<uint8_t*>(tile.data.data()), width, height,
+				_type, out_bands, nullptr, static_cast<GSpacing>(out_bands) * sample_size,
+				static_cast<GSpacing>(_tile_size) * out_bands * sample_size, sample_size);
+
+			if (err != CE_None)
+				throw std::runtime_error(std::string("Could not write mosaic tile: ") + CPLGetLastErrorMsg());
+		}
+
+		DBG << "Written " << ready.size() << " mosaic tiles";
+	}
+
+	void Mosaic::release(const std::string& shot_id)
+	{
+		std::vector<TileData> ready;
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			const auto it = _boxes.find(shot_id);
+
+			if (it == _boxes.end())
+				return;
+
+			const auto box = it->second;
+			_boxes.erase(it);
+
+			for (auto ty = box.miny; ty <= box.maxy; ty++)
+			{
+				for (auto tx = box.minx; tx <= box.maxx; tx++)
+				{
+					const auto index = static_cast<size_t>(ty) * _tiles_x + tx;
+
+					if (--_tiles[index].pending == 0 && !_tiles[index].done)
+						_finish(index, ready);
+				}
+			}
+		}
+
+		// Encoding happens outside of the lock, images keep being added meanwhile
+		_write(ready);
+	}
+
+	void Mosaic::finish()
+	{
+		if (_ds == nullptr)
+		{
+			ERR << "No image was added to the mosaic, nothing to write";
+			return;
+		}
+
+		std::vector<TileData> ready;
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			for (size_t index = 0; index < _tiles.size(); index++)
+				if (!_tiles[index].done)
+					_finish(index, ready);
+		}
+
+		_write(ready);
+
+		GDALClose(_ds);
+		_ds = nullptr;
+
+		if (_scratch.is_open())
+		{
+			_scratch.close();
+			fs::remove(_scratch_path);
+		}
+
+		if (_tiff_path != _path)
+		{
+			INF << "Converting mosaic to " << _options.driver;
+
+			auto* src = static_cast<GDALDataset*>(GDALOpen(_tiff_path.c_str(), GA_ReadOnly));
+
+			if (src == nullptr)
+				throw std::runtime_error("Could not open " + _tiff_path);
+
+			CPLStringList creation_options;
+
+			for (const auto& option : get_creation_options(_options, src->GetRasterCount(), _type))
+				creation_options.AddString(option.c_str());
+
+			if (fs::exists(_path))
+				fs::remove(_path);
+
+			auto* driver = GetGDALDriverManager()->GetDriverByName(_options.driver.c_str());
+			auto* ds = driver->CreateCopy(_path.c_str(), src, 0, creation_options.List(), nullptr, nullptr);
+
+			GDALClose(src);
+
+			if (ds == nullptr)
+				throw std::runtime_error(std::string("Could not create ") + _path + ": " + CPLGetLastErrorMsg());
+
+			GDALClose(ds);
+			fs::remove(_tiff_path);
+		}
+
+		INF << "Mosaic written to " << _path;
+	}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.hpp"
+#include "output.hpp"
+
+#include "gdal_priv.h"
+
+namespace orthorectify {
+
+	// Single output on the output grid holding the samples of all the shots. Overlapping samples
+	// are blended, weighted by their distance to the edge of their shot (feathering the
+	// seams). Samples are accumulated in tiles that are written as soon as no shot left
+	// to process covers them, tiles over the cache budget are spilled to a scratch file
+	class Mosaic
+	{
+		struct Tile
+		{
+			// Weighted sums of the color bands and sum of the weights of each cell,
+			// empty when the tile is not in memory
+			std::vector<float> sums;
+			std::vector<float> weights;
+
+			// Shots still to be added that might cover the tile
+			int pending = 0;
+
+			bool spilled = false;
+			bool done = false;
+
+			std::list<size_t>::iterator lru;
+		};
+
+		struct Box
+		{
+			int minx;
+			int miny;
+			int maxx;
+			int maxy;
+		};
+
+		// Finished tile waiting to be written
+		struct TileData
+		{
+			size_t index;
+			std::vector<uint8_t> data;
+		};
+
+		std::string _path;
+		std::string _tiff_path;
+		std::string _scratch_path;
+		std::string _wkt;
+		double _geotransform[6];
+		OutputOptions _options;
+		bool _with_alpha;
+		float _feather;
+
+		int _width;
+		int _height;
+		int _tile_size;
+		int _tiles_x;
+		int _tiles_y;
+
+		size_t _cache_size;
+		size_t _cached;
+
+		// Taken from the first shot added, all the shots must match
+		int _bands;
+		GDALDataType _type;
+		GDALDataset* _ds;
+
+		std::mutex _mutex;
+		std::mutex _io_mutex;
+
+		std::vector<Tile> _tiles;
+		std::list<size_t> _lru;
+		std::unordered_map<std::string, Box> _boxes;
+		std::fstream _scratch;
+
+		size_t _tile_cells() const { return static_cast<size_t>(_tile_size) * _tile_size; }
+		size_t _tile_bytes() const { return _tile_cells() * (_bands + 1) * sizeof(float); }
+
+		void _create(const RawImage& image);
+		void _load(size_t index);
+		void _evict();
+		void _finish(size_t index, std::vector<TileData>& ready);
+		void _write(const std::vector<TileData>& ready);
+
+		// Sets the weights of the pixels holding a sample to the maximum, the others to 0
+		template <typename S>
+		void _mark_samples(const OrthoImage& ortho, std::vector<float>& weights) const;
+
+		template <typename S>
+		void _accumulate(const OrthoImage& ortho, const std::vector<float>& weights);
+
+		template <typename S>
+		void _resolve(const Tile& tile, std::vector<uint8_t>& out) const;
+
+	public:
+
+		// width x height pixels of the output grid. Tiles are block_size pixels wide,
+		// cache_size is the memory budget of the tiles in bytes and feather the width in
+		// cells of the blending ramp at the edge of the shots
+		Mosaic(const std::string& path, int width, int height, const double* geotransform, const std::string& wkt,
+			const OutputOptions& options, bool with_alpha, size_t cache_size, float feather);
+		~Mosaic();
+
+		Mosaic(const Mosaic&) = delete;
+		Mosaic& operator=(const Mosaic&) = delete;
+
+		// Registers the box of DEM cells a shot can write to. All the shots have to be
+		// registered before the first one is released
+		void expect(const std::string& shot_id, int minx, int miny, int maxx, int maxy);
+
+		void add(const OrthoImage& ortho);
+
+		// The shot is done (added or failed), writes the tiles nobody else covers
+		void release(const std::string& shot_id);
+
+		// Writes what is left and closes the output
+		void finish();
+	};
+
+}
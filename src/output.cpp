@@ -0,0 +1,88 @@
+#include <chrono>
+
+#include "output.hpp"
+
+namespace orthorectify {
+
+	std::vector<std::string> get_creation_options(const OutputOptions& options, const int bands, const GDALDataType type)
+	{
+		std::vector<std::string> result;
+
+		const auto cog = options.driver == "COG";
+		auto compress = options.compress;
+
+		if (compress == "JPEG" && type != GDT_Byte)
+		{
+			DBG << "JPEG compression needs 8-bit images, using DEFLATE";
+			compress = "DEFLATE";
+		}
+
+		const auto compressed = compress != "NONE";
+		const auto jpeg = compress == "JPEG";
+
+		if (cog)
+			result.push_back("BLOCKSIZE=" + std::to_string(options.block_size));
+		else if (options.tiled)
+		{
+			result.push_back("TILED=YES");
+			result.push_back("BLOCKXSIZE=" + std::to_string(options.block_size));
+			result.push_back("BLOCKYSIZE=" + std::to_string(options.block_size));
+		}
+
+		if (compressed)
+		{
+			result.push_back("COMPRESS=" + compress);
+			result.push_back("NUM_THREADS=" + (options.compress_threads > 0 ? std::to_string(options.compress_threads) : std::string("ALL_CPUS")));
+		}
+
+		if (jpeg)
+		{
+			// COG picks YCbCr by itself. It needs 3 bands, the alpha band goes to an internal mask instead
+			result.push_back((cog ? "QUALITY=" : "JPEG_QUALITY=") + std::to_string(options.jpeg_quality));
+
+			if (!cog && bands == 3)
+				result.push_back("PHOTOMETRIC=YCBCR");
+		}
+		else if (compressed && options.predictor == 2)
+		{
+			if (cog)
+				result.push_back("PREDICTOR=YES");
+			else
+				result.push_back(type == GDT_Float32 ? "PREDICTOR=3" : "PREDICTOR=2");
+		}
+
+		result.push_back("BIGTIFF=" + options.bigtiff);
+
+		if (options.sparse)
+			result.push_back("SPARSE_OK=TRUE");
+
+		return result;
+	}
+
+	void write_ortho_image(OrthoImage& ortho, const std::string& wkt, const OutputOptions& options)
+	{
+		const auto start = std::chrono::high_resolution_clock::now();
+
+		write_file_atomically(ortho.out_path, [&ortho, &wkt, &options](const std::string& tmp_path) {
+
+			ortho.image->write_window(tmp_path, options.driver, ortho.x, ortho.y, ortho.width, ortho.height, [&ortho, &wkt](GDALDataset* ds) {
+
+				// Set projection (if any)
+				if (!wkt.empty())
+					ds->SetProjection(wkt.c_str());
+
+				ds->SetGeoTransform(ortho.geotransform);
+
+				ds->SetMetadataItem("AREA_OR_POINT", "Area");
+				ds->SetMetadataItem("TIFFTAG_SOFTWARE", "OpenDroneMap Orthorectify");
+				ds->SetMetadataItem("TIFFTAG_DATETIME", get_formatted_date_time().c_str());
+
+				}, get_creation_options(options, ortho.image->bands(), ortho.image->type()));
+		});
+
+		const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		INF << "Orthorectified image \"" << ortho.shot_id << "\" written in " << human_duration(elapsed);
+	}
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+#include "rawimage.hpp"
+
+namespace orthorectify {
+
+	// Orthorectified shot, waiting to be written
+	struct OrthoImage
+	{
+		std::string shot_id;
+		std::string out_path;
+
+		// nullptr when the shot covers nothing (no footprint on the DEM or no sample)
+		std::unique_ptr<RawImage> image;
+
+		// Window of the image holding the samples, the rest is not written
+		int x;
+		int y;
+		int width;
+		int height;
+
+		// Output grid pixel of the top left pixel of the window
+		int grid_x;
+		int grid_y;
+
+		// Georeferencing of the top left pixel of the window
+		double geotransform[6];
+
+		bool empty() const { return image == nullptr; }
+	};
+
+	// Format and creation options of the output images
+	struct OutputOptions
+	{
+		// GDAL driver, GTiff or COG (which is always tiled and has internal overviews)
+		std::string driver;
+
+		// NONE, DEFLATE, ZSTD, LZW or JPEG
+		std::string compress;
+
+		// TIFF predictor used with lossless compression (1 = none, 2 = horizontal differencing,
+		// which becomes floating point prediction on float images)
+		int predictor;
+
+		bool tiled;
+		int block_size;
+		int jpeg_quality;
+
+		// Threads used by GDAL to compress each image (0 = all CPUs)
+		int compress_threads;
+
+		// YES, NO, IF_NEEDED or IF_SAFER
+		std::string bigtiff;
+
+		// Don't write the tiles that are entirely empty
+		bool sparse;
+	};
+
+	// GDAL creation options for an image with the given bands and sample type
+	std::vector<std::string> get_creation_options(const OutputOptions& options, int bands, GDALDataType type);
+
+	// Writes the image with its georeferencing and projection (when wkt is not empty)
+	void write_ortho_image(OrthoImage& ortho, const std::string& wkt, const OutputOptions& options);
+
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
@@ -7,6 +9,7 @@
 #include "../vendor/cxxopts.hpp"
 
 #include "utils.hpp"
+#include "output.hpp"
 
 namespace fs = std::filesystem;
 
@@ -36,14 +39,34 @@ namespace orthorectify {
 
 		fs::path dataset_path;
 		std::string dem_path;
+		size_t dem_cache;
+		bool dem_sidecar;
+		bool approx_dem_stats;
 		InterpolationType interpolation;
+		double resolution;
+		bool reduced_sources;
+		bool distorted;
+		bool overwrite;
 		bool with_alpha;
+		OutputOptions output;
+		std::string mosaic;
+		size_t mosaic_cache;
+		float mosaic_feather;
 		bool skip_visibility_test;
+		VisibilityTest visibility;
 
 #ifdef _OPENMP
 		int threads;
+		int threads_per_shot;
 #endif
 
+		int readers;
+		int prefetch;
+		int writers;
+
+		std::string stats_json;
+		std::string trace;
+
 		bool verbose;
 		fs::path outdir;
 		std::vector<std::string> target_images;
@@ -55,15 +78,41 @@ namespace orthorectify {
 			options.add_options()
 				("dataset", "Path to ODM dataset", cxxopts::value<std::string>())
 				("e,dem", "Absolute path to DEM to use to orthorectify images", cxxopts::value<std::string>()->default_value(default_dem_path))
+				("dem-cache", "Memory budget for the DEM in MB. Larger DEMs are read in blocks on demand and kept in a cache of this size", cxxopts::value<int>()->default_value("2048"))
+				("dem-sidecar", "Convert the DEM to an uncompressed raw file next to it (DEM path + .raw) on first use and memory map it on later runs", cxxopts::value<bool>()->default_value("false"))
+				("approx-dem-stats", "Use approximate DEM min/max (from overviews or a subset of the cells) widened by a safety margin, faster startup on large DEMs without stored statistics", cxxopts::value<bool>()->default_value("false"))
+				("format", "Output format (gtiff, cog). Cloud Optimized GeoTIFFs are tiled and have internal overviews", cxxopts::value<std::string>()->default_value("gtiff"))
+				("compress", "Output compression (none, deflate, zstd, lzw, jpeg). JPEG uses YCbCr for images without alpha", cxxopts::value<std::string>()->default_value("none"))
+				("predictor", "Predictor used with lossless compression (1 = none, 2 = horizontal differencing)", cxxopts::value<int>()->default_value("2"))
+				("tiled", "Write tiled GeoTIFFs", cxxopts::value<bool>()->default_value("false"))
+				("block-size", "Tile size in pixels of tiled outputs (multiple of 16)", cxxopts::value<int>()->default_value("256"))
+				("jpeg-quality", "JPEG compression quality (1-100)", cxxopts::value<int>()->default_value("90"))
+				("compress-threads", "Number of threads compressing each output image (0 = all CPUs)", cxxopts::value<int>()->default_value("1"))
+				("bigtiff", "Write BigTIFF files (yes, no, if_needed, if_safer)", cxxopts::value<std::string>()->default_value("if_safer"))
+				("sparse", "Don't write the empty tiles of the outputs (readers see them as zero)", cxxopts::value<bool>()->default_value("false"))
+				("mosaic", "Blend all the images into a single DEM-aligned output at this path instead of writing one image per shot", cxxopts::value<std::string>()->default_value(""))
+				("mosaic-cache", "Memory budget for the mosaic tiles being blended in MB, the tiles over it are moved to a scratch file next to the output", cxxopts::value<int>()->default_value("1024"))
+				("mosaic-feather", "Width in pixels of the blending ramp at the edges of the images in the mosaic (0 = plain average)", cxxopts::value<float>()->default_value("32"))
 				("no-alpha", "Don't output an alpha channel", cxxopts::value<bool>()->default_value("false"))
+				("resolution", "Output pixel size in georeferenced units (i.e. meters), the DEM heights are interpolated at each output pixel (0 = DEM cell size)", cxxopts::value<double>()->default_value("0"))
+				("reduced-sources", "Read the source images at a reduced resolution (from overviews, or decimated while decoding) that still matches the output resolution, faster on coarse outputs", cxxopts::value<bool>()->default_value("false"))
+				("distorted", "Sample the original images (in the images folder) instead of the undistorted ones, applying the distortion of their camera model while projecting", cxxopts::value<bool>()->default_value("false"))
+				("overwrite", "Process every image, also the ones whose output is up to date (made from the same inputs and parameters, as recorded in the .manifest file next to it)", cxxopts::value<bool>()->default_value("false"))
 				("i,interpolation", "Type of interpolation to use to sample pixel values (nearest, bilinear)", cxxopts::value<std::string>()->default_value("bilinear"))
 				("o,outdir", "Output directory where to store results", cxxopts::value<std::string>()->default_value(default_outdir))
 				("l,image-list", "Path to file that contains the list of image filenames to orthorectify. By default all images in a dataset are processed", cxxopts::value<std::string>()->default_value(default_image_list))
 				("images", "Comma-separated list of filenames to rectify. Use as an alternative to --image-list", cxxopts::value<std::string>())
 				("s,skip-visibility-test", "Skip visibility testing (faster but leaves artifacts due to relief displacement)", cxxopts::value<bool>()->default_value("false"))
+				("visibility", "Visibility test to use (ray, sweep, zbuffer). Sweep computes a per-shot viewshed in a single pass, zbuffer tests depths against an image-space depth buffer", cxxopts::value<std::string>()->default_value("ray"))
 #ifdef _OPENMP
 				("t,threads", "Number of threads to use (-1 = all)", cxxopts::value<int>()->default_value("-1"))
+				("threads-per-shot", "Number of threads working on each image, limits the images processed at once to threads / threads-per-shot (0 = spread all threads over the images to process)", cxxopts::value<int>()->default_value("0"))
 #endif
+				("readers", "Number of threads reading source images ahead of processing", cxxopts::value<int>()->default_value("2"))
+				("prefetch", "Number of source images read ahead and waiting to be processed (bounds the memory used by read-ahead)", cxxopts::value<int>()->default_value("4"))
+				("writers", "Number of threads writing the results, images waiting to be written hold back processing past this number", cxxopts::value<int>()->default_value("2"))
+				("stats-json", "Write the time spent in each stage (load, setup, projection, visibility, sampling, write) and processing counters, per image and per thread, to this JSON file", cxxopts::value<std::string>()->default_value(""))
+				("trace", "Write a trace of the stages of every image, per thread, to this file (Chrome trace format, open with chrome://tracing or Perfetto)", cxxopts::value<std::string>()->default_value(""))
 				("v,verbose", "Verbose logging", cxxopts::value<bool>()->default_value("false"))
 				("h,help", "Print usage")
 				;
@@ -98,6 +147,17 @@ namespace orthorectify {
 				exit(1);
 			}
 
+			const auto dem_cache_mb = result["dem-cache"].as<int>();
+
+			if (dem_cache_mb <= 0) {
+				std::cerr << "Error: Invalid DEM cache size: " << dem_cache_mb << std::endl;
+				exit(1);
+			}
+
+			this->dem_cache = static_cast<size_t>(dem_cache_mb) << 20;
+			this->dem_sidecar = result["dem-sidecar"].as<bool>();
+			this->approx_dem_stats = result["approx-dem-stats"].as<bool>();
+
 			const auto tmpInterpolation = result["interpolation"].as<std::string>();
 
 			if (tmpInterpolation == "bilinear")
@@ -106,23 +166,160 @@ namespace orthorectify {
 				this->interpolation = Nearest;
 			else
 			{
-				ERR << "Interpolation method " << this->interpolation << " is not supported";
+				std::cerr << "Error: Interpolation method " << tmpInterpolation << " is not supported" << std::endl;
 				exit(1);
 			}
 
+			this->resolution = result["resolution"].as<double>();
+
+			if (this->resolution < 0) {
+				std::cerr << "Error: Invalid resolution: " << this->resolution << std::endl;
+				exit(1);
+			}
 
+			this->reduced_sources = result["reduced-sources"].as<bool>();
+			this->distorted = result["distorted"].as<bool>();
+			this->overwrite = result["overwrite"].as<bool>();
 			this->with_alpha = !result["no-alpha"].as<bool>();
+
+			const auto to_upper = [](std::string str) {
+				std::transform(str.begin(), str.end(), str.begin(), [](const unsigned char c) { return static_cast<char>(std::toupper(c)); });
+				return str;
+			};
+
+			const auto tmpFormat = to_upper(result["format"].as<std::string>());
+
+			if (tmpFormat == "GTIFF")
+				this->output.driver = "GTiff";
+			else if (tmpFormat == "COG")
+				this->output.driver = "COG";
+			else
+			{
+				std::cerr << "Error: Output format " << tmpFormat << " is not supported" << std::endl;
+				exit(1);
+			}
+
+			this->output.compress = to_upper(result["compress"].as<std::string>());
+
+			if (output.compress != "NONE" && output.compress != "DEFLATE" && output.compress != "ZSTD" &&
+				output.compress != "LZW" && output.compress != "JPEG")
+			{
+				std::cerr << "Error: Compression " << output.compress << " is not supported" << std::endl;
+				exit(1);
+			}
+
+			this->output.predictor = result["predictor"].as<int>();
+
+			if (output.predictor != 1 && output.predictor != 2) {
+				std::cerr << "Error: Invalid predictor: " << output.predictor << std::endl;
+				exit(1);
+			}
+
+			this->output.tiled = result["tiled"].as<bool>();
+			this->output.block_size = result["block-size"].as<int>();
+
+			if (output.block_size < 16 || output.block_size % 16 != 0) {
+				std::cerr << "Error: Invalid block size: " << output.block_size << std::endl;
+				exit(1);
+			}
+
+			this->output.jpeg_quality = result["jpeg-quality"].as<int>();
+
+			if (output.jpeg_quality < 1 || output.jpeg_quality > 100) {
+				std::cerr << "Error: Invalid JPEG quality: " << output.jpeg_quality << std::endl;
+				exit(1);
+			}
+
+			this->output.compress_threads = result["compress-threads"].as<int>();
+
+			if (output.compress_threads < 0) {
+				std::cerr << "Error: Invalid number of compression threads: " << output.compress_threads << std::endl;
+				exit(1);
+			}
+
+			this->output.bigtiff = to_upper(result["bigtiff"].as<std::string>());
+
+			if (output.bigtiff != "YES" && output.bigtiff != "NO" && output.bigtiff != "IF_NEEDED" && output.bigtiff != "IF_SAFER")
+			{
+				std::cerr << "Error: Invalid BigTIFF mode: " << output.bigtiff << std::endl;
+				exit(1);
+			}
+
+			this->output.sparse = result["sparse"].as<bool>();
+
+			this->mosaic = result["mosaic"].as<std::string>();
+
+			const auto mosaic_cache_mb = result["mosaic-cache"].as<int>();
+
+			if (mosaic_cache_mb <= 0) {
+				std::cerr << "Error: Invalid mosaic cache size: " << mosaic_cache_mb << std::endl;
+				exit(1);
+			}
+
+			this->mosaic_cache = static_cast<size_t>(mosaic_cache_mb) << 20;
+			this->mosaic_feather = result["mosaic-feather"].as<float>();
+
+			if (this->mosaic_feather < 0) {
+				std::cerr << "Error: Invalid mosaic feather width: " << this->mosaic_feather << std::endl;
+				exit(1);
+			}
+
 			this->skip_visibility_test = result["skip-visibility-test"].as<bool>();
 
+			const auto tmpVisibility = result["visibility"].as<std::string>();
+
+			if (tmpVisibility == "ray")
+				this->visibility = RayCast;
+			else if (tmpVisibility == "sweep")
+				this->visibility = RadialSweep;
+			else if (tmpVisibility == "zbuffer")
+				this->visibility = DepthTest;
+			else
+			{
+				std::cerr << "Error: Visibility test " << tmpVisibility << " is not supported" << std::endl;
+				exit(1);
+			}
+
 #ifdef _OPENMP
 			this->threads = result["threads"].as<int>();
 
 			if (this->threads < -1) {
-				ERR << "Invalid number of threads: " << this->threads;
+				std::cerr << "Error: Invalid number of threads: " << this->threads << std::endl;
+				exit(1);
+			}
+
+			this->threads_per_shot = result["threads-per-shot"].as<int>();
+
+			if (this->threads_per_shot < 0) {
+				std::cerr << "Error: Invalid number of threads per shot: " << this->threads_per_shot << std::endl;
 				exit(1);
 			}
 #endif
 
+			this->readers = result["readers"].as<int>();
+
+			if (this->readers < 1) {
+				std::cerr << "Error: Invalid number of readers: " << this->readers << std::endl;
+				exit(1);
+			}
+
+			this->prefetch = result["prefetch"].as<int>();
+
+			if (this->prefetch < 1) {
+				std::cerr << "Error: Invalid number of images to prefetch: " << this->prefetch << std::endl;
+				exit(1);
+			}
+
+			this->writers = result["writers"].as<int>();
+
+			if (this->writers < 1) {
+				std::cerr << "Error: Invalid number of writers: " << this->writers << std::endl;
+				exit(1);
+			}
+
+			this->stats_json = result["stats-json"].as<std::string>();
+			this->trace = result["trace"].as<std::string>();
+
 			const auto& outdir = result["outdir"].as<std::string>();
 
 			if (result["images"].count()) {
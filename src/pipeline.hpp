@@ -0,0 +1,142 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace orthorectify {
+
+	// FIFO queue holding at most capacity items, used to join the stages of the
+	// pipeline. Producers block while it is full, so a slow stage holds back the
+	// ones feeding it instead of letting items pile up in memory
+	template <typename T>
+	class BoundedQueue
+	{
+		std::mutex _mutex;
+		std::condition_variable _not_empty;
+		std::condition_variable _not_full;
+
+		std::deque<T> _items;
+		size_t _capacity;
+		bool _closed;
+
+		std::function<void()> _listener;
+
+		void _changed()
+		{
+			if (_listener)
+				_listener();
+		}
+
+	public:
+
+		explicit BoundedQueue(const size_t capacity) {
+			this->_capacity = capacity > 0 ? capacity : 1;
+			this->_closed = false;
+		}
+
+		BoundedQueue(const BoundedQueue&) = delete;
+		BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+		// Called after every push, pop and close, outside of the lock. Lets the threads
+		// polling with try_push / try_pop sleep until the queue changes. Set it before
+		// the queue is shared
+		void on_change(std::function<void()> listener)
+		{
+			this->_listener = std::move(listener);
+		}
+
+		// Waits for room, returns false if the queue was closed
+		bool push(T&& item)
+		{
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_not_full.wait(lock, [this] { return _closed || _items.size() < _capacity; });
+
+				if (_closed)
+					return false;
+
+				_items.push_back(std::move(item));
+				_not_empty.notify_one();
+			}
+
+			_changed();
+			return true;
+		}
+
+		// Moves from item only when there is room
+		bool try_push(T& item)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				if (_closed || _items.size() >= _capacity)
+					return false;
+
+				_items.push_back(std::move(item));
+				_not_empty.notify_one();
+			}
+
+			_changed();
+			return true;
+		}
+
+		// Waits for an item, returns false once the queue is closed and empty
+		bool pop(T& item)
+		{
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_not_empty.wait(lock, [this] { return _closed || !_items.empty(); });
+
+				if (_items.empty())
+					return false;
+
+				item = std::move(_items.front());
+				_items.pop_front();
+				_not_full.notify_one();
+			}
+
+			_changed();
+			return true;
+		}
+
+		bool try_pop(T& item)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				if (_items.empty())
+					return false;
+
+				item = std::move(_items.front());
+				_items.pop_front();
+				_not_full.notify_one();
+			}
+
+			_changed();
+			return true;
+		}
+
+		// No more items will be pushed, consumers drain what is left
+		void close()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_closed = true;
+				_not_empty.notify_all();
+				_not_full.notify_all();
+			}
+
+			_changed();
+		}
+
+		bool drained()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _closed && _items.empty();
+		}
+	};
+
+}
@@ -2,6 +2,10 @@
 
 #include <iostream>
 #include <filesystem>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 
 #include "../vendor/json.hpp"
 
@@ -10,22 +14,106 @@
 #include "transform.hpp"
 #include "dataset.hpp"
 #include "rawimage.hpp"
+#include "dem.hpp"
+#include "visibility.hpp"
+#include "footprint.hpp"
+#include "scheduler.hpp"
+#include "projection.hpp"
+#include "distortion.hpp"
+#include "stats.hpp"
+#include "output.hpp"
 
 namespace fs = std::filesystem;
 
 namespace orthorectify {
 
+	// Number of DEM cells processed by each scheduler tile
+	constexpr int tile_cells = 1 << 16;
+
+	// Spacing (in DEM cells) of the rays traced through the image border, and how much
+	// the resulting footprint is grown to cover what falls between them
+	constexpr double footprint_spacing = 4.0;
+	constexpr int footprint_pad = 3;
+
+	// Returns the heights of cells [x0, x0 + count) of DEM row y as floats,
+	// converting them into buffer unless the DEM is already Float32
+	template <typename T>
+	const float* get_row_heights(const DemWindow<T>& dem, const int x0, const int y, const int count, float* buffer)
+	{
+		const auto* row = dem.row(x0, y);
+
+		if constexpr (std::is_same_v<T, float>)
+			return row;
+		else
+		{
+			for (auto i = 0; i < count; i++)
+				buffer[i] = static_cast<float>(row[i]);
+
+			return buffer;
+		}
+	}
+
+	// Returns the heights of pixels [x0, x0 + count) of output row y, interpolated bilinearly
+	// between the DEM cells around their centers. Next to nodata cells the nearest cell is used
+	template <typename T>
+	const float* interpolate_row_heights(const DemWindow<T>& dem, const OutputGrid& grid, const int x0, const int y, const int count,
+		const float nodata, float* buffer)
+	{
+		const auto gy = std::clamp(grid.grid_y(y), static_cast<double>(dem.y0()), static_cast<double>(dem.y1()));
+		const auto j0 = static_cast<int>(gy);
+		const auto j1 = MIN(j0 + 1, dem.y1());
+		const auto ty = static_cast<float>(gy - j0);
+		const auto nearest_row = ty < 0.5f ? j0 : j1;
+
+		const auto* row0 = dem.row(dem.x0(), j0);
+		const auto* row1 = dem.row(dem.x0(), j1);
+		const auto* row_nearest = dem.row(dem.x0(), nearest_row);
+
+		for (auto k = 0; k < count; k++)
+		{
+			const auto gx = std::clamp(grid.grid_x(x0 + k), static_cast<double>(dem.x0()), static_cast<double>(dem.x1()));
+			const auto i0 = static_cast<int>(gx) - dem.x0();
+			const auto i1 = MIN(i0 + 1, dem.x1() - dem.x0());
+			const auto tx = static_cast<float>(gx - dem.x0() - i0);
+
+			const auto a = static_cast<float>(row0[i0]);
+			const auto b = static_cast<float>(row0[i1]);
+			const auto c = static_cast<float>(row1[i0]);
+			const auto d = static_cast<float>(row1[i1]);
+
+			if (a == nodata || b == nodata || c == nodata || d == nodata)
+				buffer[k] = static_cast<float>(row_nearest[tx < 0.5f ? i0 : i1]);
+			else
+			{
+				const auto top = a + (b - a) * tx;
+				const auto bottom = c + (d - c) * tx;
+
+				buffer[k] = top + (bottom - top) * ty;
+			}
+		}
+
+		return buffer;
+	}
+
 	template <typename T>
 	struct ProcessingParameters
 	{
 
 		const bool skip_visibility_test;
+		const VisibilityTest visibility;
 		const Shot& shot;
+
+		// The images are the original ones, undistorted while sampling
+		const bool distorted;
+
 		const bool has_nodata;
 		const double nodata_value;
 
 		Transform& dem_transform;
 
+		// Grid of the output pixels, heights are interpolated when it is not the DEM one
+		OutputGrid& grid;
+
 		const double dem_offset_x;
 		const double dem_offset_y;
 
@@ -35,16 +123,542 @@ namespace orthorectify {
 		const double dem_min_value;
 		const double dem_max_value;
 
-		T* dem_data;
+		DemSource<T>& dem;
+
+		// Only built for the ray visibility test (nullptr otherwise)
+		const HeightPyramid* height_pyramid;
 
 		const InterpolationType interpolation;
 		const bool with_alpha;
 		const std::string& wkt;
 
+		Scheduler& scheduler;
+
+		// Instrumentation, nullptr when disabled
+		Stats* stats;
+
 	};
+	// Camera pose of a shot and the grid (DEM cells or output pixels) of the rows to project
+	struct ShotGeometry
+	{
+		double a1, b1, c1;
+		double a2, b2, c2;
+		double a3, b3, c3;
+		double Xs, Ys, Zs;
+		double f;
+
+		int img_w;
+		int img_h;
+		double half_img_w;
+		double half_img_h;
+
+		// Half size of the field of view from the principal point, half_img_w and half_img_h
+		// unless the image is distorted
+		double extent_w;
+		double extent_h;
+
+		Transform& transform;
+		double dem_offset_x;
+		double dem_offset_y;
+
+		// NaN when the DEM has no nodata value
+		float nodata;
+
+		// Colinearity function http ://web.pdx.edu/~jduh/courses/geog493f14/Week03.pdf
+		// evaluated incrementally along grid row j from column i (depth is the distance along the
+		// camera axis). When clip is set only cells that fall inside the image are valid
+		RowProjection row_projection(const int i, const int j, const bool clip) const
+		{
+			double Xa, Ya;
+			transform.xy_center(i, j, Xa, Ya);
+
+			// Remove offset(our cameras don't have the geographic offset)
+			Xa -= dem_offset_x;
+			Ya -= dem_offset_y;
+
+			const auto dx = Xa - Xs;
+			const auto dy = Ya - Ys;
+			const auto step = transform[1];
+
+			const auto inf = std::numeric_limits<float>::infinity();
+
+			return RowProjection{
+				static_cast<float>(a1 * dx + b1 * dy),
+				static_cast<float>(a2 * dx + b2 * dy),
+				static_cast<float>(a3 * dx + b3 * dy),
+				static_cast<float>(a1 * step),
+				static_cast<float>(a2 * step),
+				static_cast<float>(a3 * step),
+				static_cast<float>(c1),
+				static_cast<float>(c2),
+				static_cast<float>(c3),
+				static_cast<float>(Zs),
+				static_cast<float>(f),
+				static_cast<float>(half_img_w),
+				static_cast<float>(half_img_h),
+				clip ? static_cast<float>(half_img_w - extent_w) : -inf,
+				clip ? static_cast<float>(half_img_h - extent_h) : -inf,
+				clip ? static_cast<float>(half_img_w + extent_w) : inf,
+				clip ? static_cast<float>(half_img_h + extent_h) : inf,
+				nodata
+			};
+		}
+	};
+
+	// Projection of the image of a shot on the DEM, f is the focal length in pixels
+	inline DemInfo get_dem_info(const Shot& shot, const double f, const double dem_min_value, const double dem_offset_x, const double dem_offset_y,
+		Transform& dem_transform)
+	{
+		return DemInfo{
+			shot.rotation_matrix(0, 0), shot.rotation_matrix(0, 1), shot.rotation_matrix(0, 2),
+			shot.rotation_matrix(1, 0), shot.rotation_matrix(1, 1), shot.rotation_matrix(1, 2),
+			shot.rotation_matrix(2, 0), shot.rotation_matrix(2, 1), shot.rotation_matrix(2, 2),
+			shot.origin(0), shot.origin(1), shot.origin(2),
+			f,
+			dem_min_value,
+			dem_offset_x,
+			dem_offset_y,
+			dem_transform
+		};
+	}
 
+	// Box of the DEM cells (grown by footprint_pad, not clamped) the footprint of a shot lies in:
+	// the image corners on the lowest DEM plane, nothing past it can be seen, and when the border
+	// rays are traced, on the top plane z_top. w and h are the DEM size
+	inline void get_footprint_window(DemInfo& info, const double half_img_w, const double half_img_h, const bool trace, const double z_top,
+		const int w, const int h, int& minx, int& miny, int& maxx, int& maxy)
+	{
+		const double corners[4][2] = {
+			{ -half_img_w, -half_img_h }, { half_img_w, -half_img_h }, { half_img_w, half_img_h }, { -half_img_w, half_img_h }
+		};
+
+		auto quad_minx = std::numeric_limits<double>::max();
+		auto quad_miny = std::numeric_limits<double>::max();
+		auto quad_maxx = std::numeric_limits<double>::lowest();
+		auto quad_maxy = std::numeric_limits<double>::lowest();
+
+		for (const auto& corner : corners)
+		{
+			double x, y;
+			info.get_coordinates(corner[0], corner[1], x, y);
+
+			quad_minx = MIN(quad_minx, x);
+			quad_miny = MIN(quad_miny, y);
+			quad_maxx = MAX(quad_maxx, x);
+			quad_maxy = MAX(quad_maxy, y);
+		}
+
+		minx = MIN(w - 1, MAX(0, static_cast<int>(quad_minx))) - footprint_pad;
+		miny = MIN(h - 1, MAX(0, static_cast<int>(quad_miny))) - footprint_pad;
+		maxx = MIN(w - 1, MAX(0, static_cast<int>(quad_maxx))) + footprint_pad;
+		maxy = MIN(h - 1, MAX(0, static_cast<int>(quad_maxy))) + footprint_pad;
+
+		if (!trace)
+			return;
+
+		for (const auto& corner : corners)
+		{
+			double top_x, top_y;
+			info.get_coordinates(corner[0], corner[1], z_top, top_x, top_y);
+
+			const auto cell_x = std::clamp(static_cast<int>(std::clamp(top_x, -1.0, static_cast<double>(w))), 0, w - 1);
+			const auto cell_y = std::clamp(static_cast<int>(std::clamp(top_y, -1.0, static_cast<double>(h))), 0, h - 1);
+
+			minx = MIN(minx, cell_x - footprint_pad);
+			miny = MIN(miny, cell_y - footprint_pad);
+			maxx = MAX(maxx, cell_x + footprint_pad);
+			maxy = MAX(maxy, cell_y + footprint_pad);
+		}
+	}
+
+	// Largest dimension (in pixels) the image of a shot needs for about one image pixel per
+	// output pixel, 0 when it cannot be reduced. Estimated at nadir on the ground_height
+	// plane, use the DEM maximum for the finest ground sampling
+	inline int get_source_size(const Shot& shot, const double ground_height, const double pixel_size)
+	{
+		const auto distance = shot.origin(2) - ground_height;
+
+		if (distance <= 0 || pixel_size <= 0 || shot.camera_focal <= 0)
+			return 0;
+
+		return static_cast<int>(std::ceil(distance / (pixel_size * shot.camera_focal)));
+	}
+
+	// State shared by the tiles of a shot
 	template <typename T>
-	void process_image(const std::string& in_path, const std::string& out_path, const ProcessingParameters<T>& params)
+	struct ShotContext
+	{
+		const ProcessingParameters<T>& params;
+		const ShotGeometry& geometry;
+		const DemWindow<T>& dem;
+		const OutputGrid& grid;
+
+		// On the output grid
+		const Footprint& footprint;
+
+		const RawImage& image;
+		RawImage& imgout;
+
+		// Set when the output has an alpha band (the validity mask) that the image does not
+		// have. Word samples are OR-ed with alpha, which sets the alpha byte
+		bool fill_alpha;
+		uint32_t alpha;
+
+		// Output pixel box of the shot
+		int bbox_minx;
+		int bbox_miny;
+		int bbox_w;
+
+		ProjectRowFunc project_row;
+
+		// Maps the projections to the original image, nullptr when the image is undistorted
+		const ShotDistortion* distortion;
+
+		// Only the one matching the visibility test is used
+		const RayWalker<T>* ray_walker;
+		const HorizonSweep<T>* sweep;
+		const DepthBuffer* depth_buffer;
+
+		// Instrumentation, nullptr when disabled
+		Stats* stats;
+	};
+
+	// Output bounds of the samples written by a tile (relative to the output box)
+	struct TileBounds
+	{
+		int minx;
+		int miny;
+		int maxx;
+		int maxy;
+	};
+
+	// Alpha value of the sampled pixels, whatever the sample type (as GDAL does)
+	constexpr int opaque_alpha = 255;
+
+	// Samplers copy a source pixel to the output and return whether it was written.
+	// We don't consider all zero values (pure black) to be valid sample values.
+	// This will sometimes miss valid sample values
+
+	// 8-bit RGB(A) images, a pixel is a 32-bit word. The alpha byte is 0 without alpha
+	template <int Bands>
+	struct WordSampler
+	{
+		template <typename Context>
+		static bool nearest(const Context& ctx, const int x, const int y, const int im_i, const int im_j)
+		{
+			const auto pixel = ctx.image.get_word(x, y);
+
+			if (pixel == 0)
+				return false;
+
+			ctx.imgout.set_word(im_i, im_j, pixel | ctx.alpha);
+			return true;
+		}
+
+		template <typename Context>
+		static bool bilinear(const Context& ctx, const double x, const double y, const int im_i, const int im_j)
+		{
+			const auto pixel = ctx.image.template bilinear_interpolate<Bands>(x, y);
+
+			if (pixel == 0)
+				return false;
+
+			ctx.imgout.set_word(im_i, im_j, pixel | ctx.alpha);
+			return true;
+		}
+	};
+
+	// Images of any band count, in their own sample type. Bands are copied in order,
+	// the alpha band of the image only goes to the output when it has one too
+	template <typename S>
+	struct BandSampler
+	{
+		template <typename Context>
+		static bool nearest(const Context& ctx, const int x, const int y, const int im_i, const int im_j)
+		{
+			const auto* in = ctx.image.template pixel<S>(x, y);
+			const auto in_bands = ctx.image.bands();
+
+			bool nonzero = false;
+
+			for (auto b = 0; b < in_bands; b++)
+				nonzero = nonzero || in[b] != 0;
+
+			if (!nonzero)
+				return false;
+
+			auto* out = ctx.imgout.template pixel<S>(im_i, im_j);
+			const auto out_bands = ctx.imgout.bands();
+
+			for (auto b = 0; b < MIN(in_bands, out_bands); b++)
+				out[b] = in[b];
+
+			if (ctx.fill_alpha)
+				out[out_bands - 1] = static_cast<S>(opaque_alpha);
+
+			return true;
+		}
+
+		template <typename Context>
+		static bool bilinear(const Context& ctx, const double x, const double y, const int im_i, const int im_j)
+		{
+			const auto taps = ctx.image.bilinear_taps(x, y);
+
+			const auto* a = ctx.image.template pixel<S>(taps.idx[0]);
+			const auto* b = ctx.image.template pixel<S>(taps.idx[1]);
+			const auto* c = ctx.image.template pixel<S>(taps.idx[2]);
+			const auto* d = ctx.image.template pixel<S>(taps.idx[3]);
+
+			auto* out = ctx.imgout.template pixel<S>(im_i, im_j);
+
+			const auto in_bands = ctx.image.bands();
+			const auto out_bands = ctx.imgout.bands();
+
+			bool nonzero = false;
+
+			// Written as we go, all zero samples leave the output pixel as it was (empty)
+			for (auto band = 0; band < in_bands; band++)
+			{
+				const auto value = taps.w[0] * a[band] + taps.w[1] * b[band] + taps.w[2] * c[band] + taps.w[3] * d[band];
+
+				S sample;
+
+				if constexpr (std::is_floating_point_v<S>)
+					sample = static_cast<S>(value);
+				else
+					sample = static_cast<S>(std::round(value));
+
+				nonzero = nonzero || sample != 0;
+
+				if (band < out_bands)
+					out[band] = sample;
+			}
+
+			if (!nonzero)
+				return false;
+
+			if (ctx.fill_alpha)
+				out[out_bands - 1] = static_cast<S>(opaque_alpha);
+
+			return true;
+		}
+	};
+
+	// Samples DEM rows [row_begin, row_end) of a shot. Specialized on interpolation,
+	// visibility test and pixel format so that the per-cell loop has no branches on them
+	template <typename T, InterpolationType Interpolation, VisibilityTest Visibility, typename Sampler>
+	void sample_tile(const ShotContext<T>& ctx, const int row_begin, const int row_end, TileBounds& bounds)
+	{
+		const auto& geometry = ctx.geometry;
+		const auto& grid = ctx.grid;
+		const auto native = grid.native();
+		const auto bbox_w = ctx.bbox_w;
+		const auto bbox_minx = ctx.bbox_minx;
+		const auto img_w = geometry.img_w;
+		const auto img_h = geometry.img_h;
+
+		std::vector<float> heights_buffer(bbox_w);
+		std::vector<float> xs(bbox_w);
+		std::vector<float> ys(bbox_w);
+		std::vector<float> depths(bbox_w);
+		std::vector<uint8_t> valid(bbox_w);
+
+		// Stage times are summed over the rows of the tile
+		auto* stats = ctx.stats;
+		const auto tile_start = stats != nullptr ? stats->now() : 0;
+		int64_t stage_time[StageCount] = {};
+		ShotCounters counters;
+
+		for (auto j = row_begin; j < row_end; ++j) {
+
+			auto im_j = j - ctx.bbox_miny;
+
+			// DEM row of the visibility tests
+			const auto cell_j = grid.cell_y(j);
+
+			// Only the footprint span of the row is walked
+			const auto span_start = ctx.footprint.start(j);
+			const auto span_count = ctx.footprint.end(j) - span_start;
+
+			if (span_count <= 0)
+				continue;
+
+			auto time = stats != nullptr ? stats->now() : 0;
+
+			// Nodata and in-image tests are done by the projection kernel
+			const auto* heights = native ?
+				get_row_heights(ctx.dem, span_start, j, span_count, heights_buffer.data()) :
+				interpolate_row_heights(ctx.dem, grid, span_start, j, span_count, geometry.nodata, heights_buffer.data());
+
+			ctx.project_row(geometry.row_projection(span_start, j, true), heights, span_count, xs.data(), ys.data(), depths.data(), valid.data());
+
+			if (ctx.distortion != nullptr)
+				ctx.distortion->apply_row(xs.data(), ys.data(), valid.data(), span_count);
+
+			if (stats != nullptr)
+			{
+				const auto now = stats->now();
+				stage_time[ProjectionStage] += now - time;
+				time = now;
+
+				counters.cells += span_count;
+
+				for (auto k = 0; k < span_count; ++k)
+					counters.in_image += valid[k];
+			}
+
+			// Hidden cells are dropped before sampling
+			if constexpr (Visibility != NoVisibilityTest)
+			{
+				for (auto k = 0; k < span_count; ++k) {
+
+					if (!valid[k])
+						continue;
+
+					const auto i = span_start + k;
+					bool visible;
+
+					if constexpr (Visibility == RadialSweep)
+						visible = ctx.sweep->visible(grid.cell_x(i), cell_j);
+					else if constexpr (Visibility == DepthTest)
+						visible = ctx.depth_buffer->visible(static_cast<double>(xs[k]), static_cast<double>(ys[k]), static_cast<double>(depths[k]));
+					else
+					{
+						int64_t walked;
+						visible = ctx.ray_walker->visible(grid.cell_x(i), cell_j, static_cast<double>(heights[k]), walked);
+
+						counters.rays++;
+						counters.ray_steps += walked;
+					}
+
+					if (!visible)
+					{
+						valid[k] = 0;
+						counters.occluded++;
+					}
+				}
+
+				if (stats != nullptr)
+				{
+					const auto now = stats->now();
+					stage_time[VisibilityStage] += now - time;
+					time = now;
+				}
+			}
+
+			for (auto k = 0; k < span_count; ++k) {
+
+				if (!valid[k])
+					continue;
+
+				const auto i = span_start + k;
+				const auto im_i = i - bbox_minx;
+
+				const auto x = static_cast<double>(xs[k]);
+				const auto y = static_cast<double>(ys[k]);
+
+				//DBG << "Working on pixel (" << i << ", " << j << ") -> (" << im_i << ", " << im_j << ")" ;
+
+				bool written;
+
+				if constexpr (Interpolation == Bilinear)
+				{
+					const auto xi = img_w - 1 - x;
+					const auto yi = img_h - 1 - y;
+
+					written = Sampler::bilinear(ctx, xi, yi, im_i, im_j);
+				}
+				else
+				{
+					const auto xi = img_w - 1 - static_cast<int>(std::round(x));
+					const auto yi = img_h - 1 - static_cast<int>(std::round(y));
+
+					written = Sampler::nearest(ctx, xi, yi, im_i, im_j);
+				}
+
+				if (written)
+				{
+					bounds.minx = MIN(bounds.minx, im_i);
+					bounds.miny = MIN(bounds.miny, im_j);
+					bounds.maxx = MAX(bounds.maxx, im_i);
+					bounds.maxy = MAX(bounds.maxy, im_j);
+				}
+			}
+
+			if (stats != nullptr)
+				stage_time[SamplingStage] += stats->now() - time;
+		}
+
+		if (stats != nullptr)
+		{
+			const auto& shot_id = ctx.params.shot.id;
+
+			for (const auto stage : { ProjectionStage, VisibilityStage, SamplingStage })
+				stats->add_time(shot_id, stage, stage_time[stage]);
+
+			stats->add_counters(shot_id, counters);
+
+			stats->trace(shot_id, "tile", tile_start, stats->now() - tile_start,
+				"{\"rows\": " + std::to_string(row_end - row_begin) + ", \"cells\": " + std::to_string(counters.cells) +
+				", \"occluded\": " + std::to_string(counters.occluded) + "}");
+		}
+	}
+
+	template <typename T>
+	using SampleTileFunc = void (*)(const ShotContext<T>& ctx, int row_begin, int row_end, TileBounds& bounds);
+
+	// Picks the specialized sampling kernel of a shot
+	template <typename T>
+	SampleTileFunc<T> get_sample_tile_kernel(const InterpolationType interpolation, const VisibilityTest visibility, const RawImage& image)
+	{
+#define SAMPLE_TILE_KERNELS(interp, vis) { \
+			sample_tile<T, interp, vis, WordSampler<3>>, \
+			sample_tile<T, interp, vis, WordSampler<4>>, \
+			sample_tile<T, interp, vis, BandSampler<uint8_t>>, \
+			sample_tile<T, interp, vis, BandSampler<uint16_t>>, \
+			sample_tile<T, interp, vis, BandSampler<float>> }
+
+		// Indexed by [bilinear][visibility test][pixel format]
+		static const SampleTileFunc<T> kernels[2][4][5] = {
+			{
+				SAMPLE_TILE_KERNELS(Nearest, NoVisibilityTest),
+				SAMPLE_TILE_KERNELS(Nearest, RayCast),
+				SAMPLE_TILE_KERNELS(Nearest, RadialSweep),
+				SAMPLE_TILE_KERNELS(Nearest, DepthTest)
+			},
+			{
+				SAMPLE_TILE_KERNELS(Bilinear, NoVisibilityTest),
+				SAMPLE_TILE_KERNELS(Bilinear, RayCast),
+				SAMPLE_TILE_KERNELS(Bilinear, RadialSweep),
+				SAMPLE_TILE_KERNELS(Bilinear, DepthTest)
+			}
+		};
+
+#undef SAMPLE_TILE_KERNELS
+
+		int format;
+
+		if (image.words())
+			format = image.has_alpha() ? 1 : 0;
+		else if (image.type() == GDT_Byte)
+			format = 2;
+		else if (image.type() == GDT_UInt16)
+			format = 3;
+		else
+			format = 4;
+
+		return kernels[interpolation == Bilinear ? 1 : 0][visibility][format];
+	}
+
+
+	// Orthorectifies an image, returns nullptr when it cannot be done and an empty image
+	// when the shot covers nothing. Writing the result is left to the caller, so that it
+	// can overlap with other computations.
+	// sample_tile_kernel replaces the specialized sampling kernel of the shot when set
+	// (the benchmarks compare them with a generic one)
+	template <typename T>
+	std::unique_ptr<OrthoImage> process_image(const RawImage& image, const std::string& out_path, const ProcessingParameters<T>& params,
+		const SampleTileFunc<T> sample_tile_kernel = nullptr)
 	{
 
 		const auto start = std::chrono::high_resolution_clock::now();
@@ -61,38 +675,18 @@ namespace orthorectify {
 		double cam_grid_x, cam_grid_y;
 		params.dem_transform.index(cam_x, cam_y, cam_grid_x, cam_grid_y);
 
-		int cam_grid_x_int = static_cast<int>(cam_grid_x);
-		int cam_grid_y_int = static_cast<int>(cam_grid_y);
-
 		INF << "Rotation matrix: " << str_conv(shot.rotation_matrix);
 		INF << "Origin: (" << shot.origin(0) << ", " << shot.origin(1) << ", " << shot.origin(2) << ")";
 		INF << "DEM index: (" << cam_grid_x << ", " << cam_grid_y << ")";
 		INF << "Camera pose: (" << Xs << ", " << Ys << ", " << Zs << ")";
 
-		double* distance_map_raw = nullptr;
-
 		const auto h = params.dem_height;
 		const auto w = params.dem_width;
 
+		const auto setup_start = params.stats != nullptr ? params.stats->now() : 0;
+
 		try
 		{
-			
-			if (!params.skip_visibility_test)
-			{
-				distance_map_raw = new double[h * w];
-				
-				for (auto j = 0; j < h; j++) {
-					for (auto i = 0; i < w; i++) {
-						const auto val = sqrt((cam_grid_x - i) * (cam_grid_x - i) + (cam_grid_y - j) * (cam_grid_y - j));
-						distance_map_raw[j * w + i] = val == 0 ? 1e-7 : val;
-					}
-				}
-
-				DBG << "Populated distance map";
-			}
-
-			RawImage image(in_path);
-
 			const int img_w = image.width();
 			const int img_h = image.height();
 			const double half_img_w = (img_w - 1) / 2.0;
@@ -105,287 +699,343 @@ namespace orthorectify {
 			DBG << "Camera focal: " << shot.camera_focal << " coefficient " << f;
 			INF << "Image dimensions: " << img_w << "x" << img_h << " pixels (" << bands << " bands)";
 
-			const auto a1 = shot.rotation_matrix(0, 0);
-			const auto b1 = shot.rotation_matrix(0, 1);
-			const auto c1 = shot.rotation_matrix(0, 2);
-			const auto a2 = shot.rotation_matrix(1, 0);
-			const auto b2 = shot.rotation_matrix(1, 1);
-			const auto c2 = shot.rotation_matrix(1, 2);
-			const auto a3 = shot.rotation_matrix(2, 0);
-			const auto b3 = shot.rotation_matrix(2, 1);
-			const auto c3 = shot.rotation_matrix(2, 2);
-
-			DemInfo info{
-				a1, b1, c1,
-				a2, b2, c2,
-				a3, b3, c3,
-				Xs, Ys, Zs,
-				f,
-				params.dem_min_value,
-				params.dem_offset_x,
-				params.dem_offset_y,
-				params.dem_transform
-			};
+			// The footprint is the one of the field of view, which the distortion changes
+			std::unique_ptr<ShotDistortion> distortion;
+
+			if (params.distorted)
+				distortion = std::make_unique<ShotDistortion>(shot.camera, img_w, img_h, f);
+
+			const auto extent_w = distortion != nullptr ? distortion->extent_w() : half_img_w;
+			const auto extent_h = distortion != nullptr ? distortion->extent_h() : half_img_h;
+
+			if (distortion != nullptr) {
+				DBG << "Undistorted field of view: " << 2 * extent_w << "x" << 2 * extent_h << " pixels";
+			}
+
+			auto info = get_dem_info(shot, f, params.dem_min_value, params.dem_offset_x, params.dem_offset_y, params.dem_transform);
 
 			double dem_ul_x, dem_ul_y;
-			info.get_coordinates(-half_img_w, -half_img_h, dem_ul_x, dem_ul_y);
+			info.get_coordinates(-extent_w, -extent_h, dem_ul_x, dem_ul_y);
 
 			double dem_ur_x, dem_ur_y;
-			info.get_coordinates(half_img_w, -half_img_h, dem_ur_x, dem_ur_y);
+			info.get_coordinates(extent_w, -extent_h, dem_ur_x, dem_ur_y);
 
 			double dem_lr_x, dem_lr_y;
-			info.get_coordinates(half_img_w, half_img_h, dem_lr_x, dem_lr_y);
+			info.get_coordinates(extent_w, extent_h, dem_lr_x, dem_lr_y);
 
 			double dem_ll_x, dem_ll_y;
-			info.get_coordinates(-half_img_w, half_img_h, dem_ll_x, dem_ll_y);
-
-			const auto x_list = { dem_ul_x, dem_ur_x, dem_lr_x, dem_ll_x };
-			const auto y_list = { dem_ul_y, dem_ur_y, dem_lr_y, dem_ll_y };
+			info.get_coordinates(-extent_w, extent_h, dem_ll_x, dem_ll_y);
 
 			DBG << "DEM bounding box: (" << dem_ul_x << ", " << dem_ul_y << "), (" << dem_ur_x << ", " <<
 				dem_ur_y << "), (" << dem_lr_x << ", " << dem_lr_y << "), (" << dem_ll_x << ", " <<
 				dem_ll_y << ")";
 
-			const int dem_bbox_minx = MIN(w - 1, MAX(0, static_cast<int>(std::min(x_list))));
-			const int dem_bbox_miny = MIN(h - 1, MAX(0, static_cast<int>(std::min(y_list))));
-			const int dem_bbox_maxx = MIN(w - 1, MAX(0, static_cast<int>(std::max(x_list))));
-			const int dem_bbox_maxy = MIN(h - 1, MAX(0, static_cast<int>(std::max(y_list))));
-
-			const int dem_bbox_w = 1 + dem_bbox_maxx - dem_bbox_minx;
-			const int dem_bbox_h = 1 + dem_bbox_maxy - dem_bbox_miny;
-
-			INF << "Iterating over DEM box: [(" << dem_bbox_minx << ", " << dem_bbox_miny << "), (" << dem_bbox_maxx << ", " << dem_bbox_maxy << ")] (" << dem_bbox_w << "x" << dem_bbox_h << " pixels)";
+			// Rays through the image border hit the DEM between the top plane (the DEM maximum,
+			// or the camera when it is lower) and the lowest one
+			const auto z_top = MIN(params.dem_max_value, Zs);
+			const bool trace = !params.skip_visibility_test && Zs > params.dem_min_value;
 
-			RawImage imgout(dem_bbox_w, dem_bbox_h, image.has_alpha(), "GTiff");
+			int win_minx, win_miny, win_maxx, win_maxy;
+			get_footprint_window(info, extent_w, extent_h, trace, z_top, w, h, win_minx, win_miny, win_maxx, win_maxy);
 
-			auto mask = new bool[dem_bbox_w * dem_bbox_h];
-			memset(mask, 0, dem_bbox_w * dem_bbox_h * sizeof(bool));
+			// The cells between the footprint and the camera are needed when testing visibility along rays
+			if (!params.skip_visibility_test && params.visibility != DepthTest)
+			{
+				const auto cam_cell_x = std::clamp(static_cast<int>(cam_grid_x), 0, w - 1);
+				const auto cam_cell_y = std::clamp(static_cast<int>(cam_grid_y), 0, h - 1);
 
-			auto* values = new uint8_t[bands];
-			memset(values, 0, bands);
+				win_minx = MIN(win_minx, cam_cell_x);
+				win_miny = MIN(win_miny, cam_cell_y);
+				win_maxx = MAX(win_maxx, cam_cell_x);
+				win_maxy = MAX(win_maxy, cam_cell_y);
+			}
 
-			auto minx = dem_bbox_w;
-			auto miny = dem_bbox_h;
-			auto maxx = 0;
-			auto maxy = 0;
+			const auto dem_window = params.dem.window(win_minx, win_miny, win_maxx, win_maxy);
 
-			Point* raw_points;
-			const auto max_count = static_cast<size_t>(std::ceil(std::sqrt(dem_bbox_maxx * dem_bbox_maxx + dem_bbox_maxy * dem_bbox_maxy)));
-			raw_points = new Point[max_count];
-			auto* raw_dem_data = params.dem_data;
+			// Visible cells lie within the polygon where the border rays first hit the DEM.
+			// Without visibility test every cell in the image frustum is sampled (occluded
+			// ones too), so the corners on the lowest plane are used instead
+			std::vector<GridPoint> polygon;
 
-			for (auto j = dem_bbox_miny; j < dem_bbox_maxy + 1; ++j) {
+			if (trace)
+				polygon = trace_footprint(info, dem_window, params.has_nodata, params.nodata_value, z_top, params.dem_min_value,
+					extent_w, extent_h, footprint_spacing);
+			else
+				polygon = { { dem_ul_x, dem_ul_y }, { dem_ur_x, dem_ur_y }, { dem_lr_x, dem_lr_y }, { dem_ll_x, dem_ll_y } };
 
-				auto im_j = j - dem_bbox_miny;
+			// Rasterized on the output grid, the padding is scaled to keep the same ground distance
+			auto& grid = params.grid;
 
-				for (auto i = dem_bbox_minx; i < dem_bbox_maxx + 1; ++i) {
+			if (!grid.native())
+			{
+				for (auto& point : polygon)
+				{
+					point.x *= grid.scale_x;
+					point.y *= grid.scale_y;
+				}
+			}
 
-					auto im_i = i - dem_bbox_minx;
+			const auto pad = static_cast<int>(std::ceil((trace ? footprint_pad : 1) * MAX(grid.scale_x, grid.scale_y)));
 
-					const auto Za = static_cast<double>(raw_dem_data[j * w + i]);
+			// Clipped to the pixels in the window, which holds every DEM cell the visibility tests read
+			const Footprint footprint(polygon, pad, grid.first_pixel_x(dem_window.x0()), grid.first_pixel_y(dem_window.y0()),
+				grid.last_pixel_x(dem_window.x1()), grid.last_pixel_y(dem_window.y1()));
 
-					// Skip nodata
-					if (params.has_nodata && Za == params.nodata_value)
-						continue;
+			// Not an error, the inputs give no output
+			const auto empty_ortho = [&shot, &out_path]() {
 
-					double Xa, Ya;
-					params.dem_transform.xy_center(i, j, Xa, Ya);
+				auto ortho = std::make_unique<OrthoImage>();
 
-					// Remove offset(our cameras don't have the geographic offset)
-					Xa -= params.dem_offset_x;
-					Ya -= params.dem_offset_y;
+				ortho->shot_id = shot.id;
+				ortho->out_path = out_path;
 
-					// Colinearity function http ://web.pdx.edu/~jduh/courses/geog493f14/Week03.pdf
-					const auto dx = Xa - Xs;
-					const auto dy = Ya - Ys;
-					const auto dz = Za - Zs;
+				return ortho;
+			};
 
-					const auto den = a3 * dx + b3 * dy + c3 * dz;
-					const auto x = half_img_w - (f * (a1 * dx + b1 * dy + c1 * dz) / den);
-					const auto y = half_img_h - (f * (a2 * dx + b2 * dy + c2 * dz) / den);
+			if (footprint.empty())
+			{
+				ERR << "Cannot orthorectify image (is the image inside the DEM bounds?)";
+				return empty_ortho();
+			}
 
-					if (x >= 0 && y >= 0 && x <= img_w - 1 && y <= img_h - 1)
-					{
-						//DBG << "Working on pixel (" << i << ", " << j << ") -> (" << im_i << ", " << im_j << ")" ;
-						//DBG << "DEM coordinates: (" << Xa << ", " << Ya << ", " << Za << ")" << " -> (" << Xa << ", " << Ya << ")" ;
+			const int bbox_minx = footprint.minx();
+			const int bbox_miny = footprint.miny();
+			const int bbox_maxx = footprint.maxx();
+			const int bbox_maxy = footprint.maxy();
 
-						if (!params.skip_visibility_test)
-						{
-							auto cnt = 0;
-							line(i, j, cam_grid_x_int, cam_grid_y_int, raw_points, cnt, max_count);
+			const int bbox_w = 1 + bbox_maxx - bbox_minx;
+			const int bbox_h = 1 + bbox_maxy - bbox_miny;
 
-							const auto dist = distance_map_raw[j * w + i];
+			// DEM cells under the output box
+			const int dem_bbox_minx = grid.cell_x(bbox_minx);
+			const int dem_bbox_miny = grid.cell_y(bbox_miny);
+			const int dem_bbox_maxx = grid.cell_x(bbox_maxx);
+			const int dem_bbox_maxy = grid.cell_y(bbox_maxy);
 
-							bool visible = true;
-							for (auto p = 0; p < cnt; p++)
-							{
-								const auto point = raw_points + p;
-								const auto px = point->x;
-								const auto py = point->y;
+			const int dem_bbox_w = 1 + dem_bbox_maxx - dem_bbox_minx;
 
-								if (px < 0 || py < 0 || px >= w || py >= h)
-									continue;
+			INF << "Iterating over output box: [(" << bbox_minx << ", " << bbox_miny << "), (" << bbox_maxx << ", " << bbox_maxy << ")] (" << bbox_w << "x" << bbox_h << " pixels)";
 
-								const auto ray_z = Zs + dz * (distance_map_raw[py * w + px] / dist);
+			// Written as is: the samples carry the alpha band and the output is cropped to the
+			// sampled pixels when writing
+			auto imgout = std::make_unique<RawImage>(bbox_w, bbox_h, image.color_bands() + (params.with_alpha ? 1 : 0),
+				params.with_alpha, image.type(), "GTiff");
 
-								if (ray_z > params.dem_max_value) break;
+			const auto fill_alpha = params.with_alpha && !image.has_alpha();
+			uint32_t alpha = 0;
 
-								if (raw_dem_data[py * w + px] > ray_z) {
-									visible = false;
+			if (fill_alpha && image.words())
+			{
+				const uint8_t opaque[4] = { 0, 0, 0, opaque_alpha };
+				memcpy(&alpha, opaque, sizeof(alpha));
+			}
 
-									//DBG << "Point (" << p.x << ", " << p.y << ") is not visible" ;
+			auto minx = bbox_w;
+			auto miny = bbox_h;
+			auto maxx = 0;
+			auto maxy = 0;
 
-									break;
-								}
-							}
+			DBG << "DEM window: [(" << dem_window.x0() << ", " << dem_window.y0() << "), (" << dem_window.x1() << ", " << dem_window.y1() << ")]";
 
-							if (!visible)
-								continue;
-						}
+			const RayWalker<T> ray_walker(dem_window, params.height_pyramid, cam_grid_x, cam_grid_y, Zs, params.dem_max_value);
 
-						if (params.interpolation == Bilinear)
-						{
-							const auto xi = img_w - 1 - x;
-							const auto yi = img_h - 1 - y;
+			std::unique_ptr<HorizonSweep<T>> sweep;
 
-							image.bilinear_interpolate(xi, yi, values);
+			if (!params.skip_visibility_test && params.visibility == RadialSweep)
+			{
+				const auto sweep_start = std::chrono::high_resolution_clock::now();
 
-						}
-						else
-						{
-							const auto xi = img_w - 1 - static_cast<int>(std::round(x));
-							const auto yi = img_h - 1 - static_cast<int>(std::round(y));
+				sweep = std::make_unique<HorizonSweep<T>>(dem_window, params.has_nodata, params.nodata_value,
+					cam_grid_x, cam_grid_y, Zs, dem_bbox_minx, dem_bbox_miny, dem_bbox_maxx, dem_bbox_maxy);
 
-							image.get_pixel(xi, yi, values);
-						}
+				DBG << "Computed visibility sweep in " << human_duration(std::chrono::high_resolution_clock::now() - sweep_start);
+			}
 
+			const auto project_row = get_project_row_kernel();
+
+			const auto get_geometry = [&](Transform& transform) {
+				return ShotGeometry{
+					info.a1, info.b1, info.c1,
+					info.a2, info.b2, info.c2,
+					info.a3, info.b3, info.c3,
+					Xs, Ys, Zs,
+					f,
+					img_w, img_h,
+					half_img_w, half_img_h,
+					extent_w, extent_h,
+					transform,
+					params.dem_offset_x,
+					params.dem_offset_y,
+					params.has_nodata ? static_cast<float>(params.nodata_value) : std::numeric_limits<float>::quiet_NaN()
+				};
+			};
 
-						// We don't consider all zero values (pure black)
-						// to be valid sample values. This will sometimes miss
-						// valid sample values.
-						if (values[0] != 0 || values[1] != 0 || values[2] != 0 || (bands == 4 && values[3] != 0))
-						{
-							minx = MIN(minx, im_i);
-							miny = MIN(miny, im_j);
-							maxx = MAX(maxx, im_i);
-							maxy = MAX(maxy, im_j);
+			// Samples are projected on the output grid, the depth buffer is built from the DEM cells
+			const auto geometry = get_geometry(grid.transform);
+			const auto dem_geometry = get_geometry(params.dem_transform);
 
-							imgout.set_pixel(im_i, im_j, values);
-							mask[im_j * dem_bbox_w + im_i] = true;
-							//DBG << "Boundaries updated: (" << minx << ", " << miny << ") -> (" << maxx << ", " << maxy << ")" ;
-						}
+			std::unique_ptr<DepthBuffer> depth_buffer;
 
-						//DBG << "Setting pixel (" << im_i << ", " << im_j << ") to (" << static_cast<int>(values[0]) << ", " << static_cast<int>(values[1]) << ", " << static_cast<int>(values[2]) << ")" ;
+			if (!params.skip_visibility_test && params.visibility == DepthTest)
+			{
+				const auto depth_start = std::chrono::high_resolution_clock::now();
 
-					}
-				}
-			}
+				// Size the buffer so that a DEM cell covers about one buffer pixel
+				const auto footprint_area = 0.5 * std::abs(
+					(dem_ul_x * dem_ur_y - dem_ur_x * dem_ul_y) + (dem_ur_x * dem_lr_y - dem_lr_x * dem_ur_y) +
+					(dem_lr_x * dem_ll_y - dem_ll_x * dem_lr_y) + (dem_ll_x * dem_ul_y - dem_ul_x * dem_ll_y));
+				const auto pixels_per_cell = footprint_area > 0 ? std::sqrt(static_cast<double>(img_w) * img_h / footprint_area) : 1.0;
+				const auto scale = MAX(1, static_cast<int>(pixels_per_cell));
 
-			delete[] raw_points;
-			delete[] distance_map_raw;
+				depth_buffer = std::make_unique<DepthBuffer>(img_w, img_h, scale, std::abs(params.dem_transform[1]));
 
-			/*#ifdef DEBUG
-					DBG << "Writing intermediate output image" ;
-					imgout.write(out_path + ".intermediate.tif", "");
-			#endif*/
+				DBG << "Depth buffer " << depth_buffer->width() << "x" << depth_buffer->height() << " (scale " << scale << ")";
 
-			INF << "Output bounds (" << minx << ", " << miny << "), (" << maxx << ", " << maxy << ") pixels";
+				struct ProjectedRow
+				{
+					std::vector<float> x;
+					std::vector<float> y;
+					std::vector<float> depth;
+					std::vector<uint8_t> valid;
 
-			if (minx > maxx || miny > maxy)
-			{
-				ERR << "Cannot orthorectify image (is the image inside the DEM bounds?)";
-				return;
-			}
+					explicit ProjectedRow(const int size) : x(size), y(size), depth(size), valid(size) {}
+				};
 
-			const auto out_w = maxx - minx + 1;
-			const auto out_h = maxy - miny + 1;
+				std::vector<float> heights_buffer(dem_bbox_w);
+				ProjectedRow prev_row(dem_bbox_w);
+				ProjectedRow curr_row(dem_bbox_w);
 
-			uint8_t black[4] = { 0, 0, 0, 0 };
+				for (auto j = dem_bbox_miny; j < dem_bbox_maxy + 1; ++j) {
 
-			const auto target_bands = params.with_alpha ? bands + 1 : bands;
+					const auto* heights = get_row_heights(dem_window, dem_bbox_minx, j, dem_bbox_w, heights_buffer.data());
+					project_row(dem_geometry.row_projection(dem_bbox_minx, j, false), heights, dem_bbox_w,
+						curr_row.x.data(), curr_row.y.data(), curr_row.depth.data(), curr_row.valid.data());
 
-			RawImage imgdst(out_w, out_h, params.with_alpha, "GTiff");
+					for (auto q = 0; q < dem_bbox_w; ++q)
+						curr_row.valid[q] = curr_row.valid[q] && curr_row.depth[q] > 0;
 
-			delete[] values;
-			values = new uint8_t[target_bands];
-			memset(values, 0, target_bands);
+					// Splatted where the cells are seen in the original image
+					if (distortion != nullptr)
+						distortion->apply_row(curr_row.x.data(), curr_row.y.data(), curr_row.valid.data(), dem_bbox_w);
 
-			if (params.with_alpha) {
+					// Splat each DEM quad with its farthest depth over its image extent,
+					// so a cell is never hidden by the surface it belongs to
+					if (j > dem_bbox_miny) {
 
-				// Copy the data
-				for (auto j = 0; j < out_h; ++j)
-				{
-					for (auto i = 0; i < out_w; ++i)
-					{
-						const auto im_i = minx + i;
-						const auto im_j = miny + j;
+						for (auto q = 0; q < dem_bbox_w - 1; ++q) {
 
-						values[target_bands - 1] = 0;
-						imgout.get_pixel(im_i, im_j, values);
+							if (!prev_row.valid[q] || !prev_row.valid[q + 1] || !curr_row.valid[q] || !curr_row.valid[q + 1])
+								continue;
 
-						if (mask[im_j * dem_bbox_w + im_i]) {
-							values[target_bands - 1] = 255;
-							imgdst.set_pixel(i, j, values);
-						}
-						else {
-							imgdst.set_pixel(i, j, black);
+							depth_buffer->splat(
+								std::min({ prev_row.x[q], prev_row.x[q + 1], curr_row.x[q], curr_row.x[q + 1] }),
+								std::min({ prev_row.y[q], prev_row.y[q + 1], curr_row.y[q], curr_row.y[q + 1] }),
+								std::max({ prev_row.x[q], prev_row.x[q + 1], curr_row.x[q], curr_row.x[q + 1] }),
+								std::max({ prev_row.y[q], prev_row.y[q + 1], curr_row.y[q], curr_row.y[q + 1] }),
+								std::max({ prev_row.depth[q], prev_row.depth[q + 1], curr_row.depth[q], curr_row.depth[q + 1] }));
 						}
-
 					}
+
+					std::swap(prev_row, curr_row);
 				}
 
+				DBG << "Populated depth buffer in " << human_duration(std::chrono::high_resolution_clock::now() - depth_start);
 			}
-			else {
 
-				// Copy the data
-				for (auto j = 0; j < out_h; ++j)
-				{
-					for (auto i = 0; i < out_w; ++i)
-					{
-						const auto im_i = minx + i;
-						const auto im_j = miny + j;
+			const ShotContext<T> ctx{
+				params,
+				geometry,
+				dem_window,
+				grid,
+				footprint,
+				image,
+				*imgout,
+				fill_alpha,
+				alpha,
+				bbox_minx,
+				bbox_miny,
+				bbox_w,
+				project_row,
+				distortion.get(),
+				&ray_walker,
+				sweep.get(),
+				depth_buffer.get(),
+				params.stats
+			};
 
-						imgout.get_pixel(im_i, im_j, values);
-						imgdst.set_pixel(i, j, values);
-					}
-				}
-			}
+			// Chosen once per shot, the per-cell loop is specialized on these
+			const auto visibility = params.skip_visibility_test ? NoVisibilityTest : params.visibility;
+			const auto kernel = sample_tile_kernel != nullptr ? sample_tile_kernel : get_sample_tile_kernel<T>(params.interpolation, visibility, image);
 
-			delete[] values;
-			delete[] mask;
+			if (params.stats != nullptr)
+				params.stats->add_span(shot.id, SetupStage, setup_start, params.stats->now() - setup_start);
 
-			double offset_x, offset_y;
-			params.dem_transform.xy(dem_bbox_minx + minx, dem_bbox_miny + miny, offset_x, offset_y);
+			std::mutex bounds_mutex;
 
-			imgdst.write(out_path, "", [&params, offset_x, offset_y](GDALDataset* ds) {
+			// Rows are split in tiles that the scheduler spreads across threads (stealing
+			// from other shots when idle), each tile keeps its own output bounds, which
+			// are merged at the end
+			const auto rows_per_tile = MAX(1, tile_cells / bbox_w);
 
-				// Set projection (if any)
-				if (!params.wkt.empty())
-					ds->SetProjection(params.wkt.c_str());
+			params.scheduler.parallel_for(bbox_miny, bbox_maxy + 1, rows_per_tile, [&](const int row_begin, const int row_end) {
 
-				double transform[6] = {
-					offset_x,
-					params.dem_transform[1],
-					params.dem_transform[2],
-					offset_y,
-					params.dem_transform[4],
-					params.dem_transform[5]
-				};
+				TileBounds bounds{ bbox_w, bbox_h, 0, 0 };
 
-				ds->SetGeoTransform(transform);
+				kernel(ctx, row_begin, row_end, bounds);
 
-				ds->SetMetadataItem("AREA_OR_POINT", "Area");
-				ds->SetMetadataItem("TIFFTAG_SOFTWARE", "OpenDroneMap Orthorectify");
-				ds->SetMetadataItem("TIFFTAG_DATETIME", get_formatted_date_time().c_str());
+				std::lock_guard<std::mutex> lock(bounds_mutex);
 
-				});
+				minx = MIN(minx, bounds.minx);
+				miny = MIN(miny, bounds.miny);
+				maxx = MAX(maxx, bounds.maxx);
+				maxy = MAX(maxy, bounds.maxy);
+			});
+
+			/*#ifdef DEBUG
+					DBG << "Writing intermediate output image" ;
+					imgout->write(out_path + ".intermediate.tif", "", nullptr);
+			#endif*/
+
+			INF << "Output bounds (" << minx << ", " << miny << "), (" << maxx << ", " << maxy << ") pixels";
+
+			if (minx > maxx || miny > maxy)
+			{
+				ERR << "Cannot orthorectify image (is the image inside the DEM bounds?)";
+				return empty_ortho();
+			}
+
+			double offset_x, offset_y;
+			grid.transform.xy(bbox_minx + minx, bbox_miny + miny, offset_x, offset_y);
+
+			auto ortho = std::make_unique<OrthoImage>();
+
+			ortho->shot_id = shot.id;
+			ortho->out_path = out_path;
+			ortho->image = std::move(imgout);
+
+			ortho->x = minx;
+			ortho->y = miny;
+			ortho->width = maxx - minx + 1;
+			ortho->height = maxy - miny + 1;
+			ortho->grid_x = bbox_minx + minx;
+			ortho->grid_y = bbox_miny + miny;
+
+			ortho->geotransform[0] = offset_x;
+			ortho->geotransform[1] = grid.geotransform[1];
+			ortho->geotransform[2] = grid.geotransform[2];
+			ortho->geotransform[3] = offset_y;
+			ortho->geotransform[4] = grid.geotransform[4];
+			ortho->geotransform[5] = grid.geotransform[5];
 
 			const auto elapsed = std::chrono::high_resolution_clock::now() - start;
 
-			INF << "Orthorectified image \"" << shot.id << "\" written in " << human_duration(elapsed);
+			INF << "Orthorectified image \"" << shot.id << "\" computed in " << human_duration(elapsed);
+
+			return ortho;
 		}
 		catch (const std::exception& e) {
 			ERR << "Error while orthorectifying image \"" << shot.id << "\": " << e.what();
+			return nullptr;
 		}
 	}
 }
\ No newline at end of file
@@ -0,0 +1,304 @@
+#include "projection.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ORTHO_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ORTHO_TARGET(t) __attribute__((target(t)))
+#else
+#define ORTHO_TARGET(t)
+#endif
+
+namespace orthorectify {
+
+	// Handles cells [start, count), also used for the tails of the vector kernels
+	static inline void project_row_range(const RowProjection& p, const float* heights, const int start, const int count, float* x, float* y, float* depth, uint8_t* valid)
+	{
+		for (auto i = start; i < count; i++)
+		{
+			const auto h = heights[i];
+			const auto k = static_cast<float>(i);
+			const auto dz = h - p.cam_z;
+
+			const auto den = p.den + k * p.step_den + dz * p.dz_den;
+			const auto px = p.half_img_w - p.f * (p.num_x + k * p.step_x + dz * p.dz_x) / den;
+			const auto py = p.half_img_h - p.f * (p.num_y + k * p.step_y + dz * p.dz_y) / den;
+
+			x[i] = px;
+			y[i] = py;
+			depth[i] = den;
+			valid[i] = h != p.nodata && px >= p.min_x && py >= p.min_y && px <= p.max_x && py <= p.max_y;
+		}
+	}
+
+	void project_row_scalar(const RowProjection& p, const float* heights, const int count, float* x, float* y, float* depth, uint8_t* valid)
+	{
+		project_row_range(p, heights, 0, count, x, y, depth, valid);
+	}
+
+#ifdef ORTHO_X86
+
+	ORTHO_TARGET("sse4.2")
+	static void project_row_sse42(const RowProjection& p, const float* heights, const int count, float* x, float* y, float* depth, uint8_t* valid)
+	{
+		const auto lanes = _mm_setr_ps(0, 1, 2, 3);
+
+		const auto num_x = _mm_set1_ps(p.num_x);
+		const auto num_y = _mm_set1_ps(p.num_y);
+		const auto den0 = _mm_set1_ps(p.den);
+		const auto step_x = _mm_set1_ps(p.step_x);
+		const auto step_y = _mm_set1_ps(p.step_y);
+		const auto step_den = _mm_set1_ps(p.step_den);
+		const auto dz_x = _mm_set1_ps(p.dz_x);
+		const auto dz_y = _mm_set1_ps(p.dz_y);
+		const auto dz_den = _mm_set1_ps(p.dz_den);
+		const auto cam_z = _mm_set1_ps(p.cam_z);
+		const auto f = _mm_set1_ps(p.f);
+		const auto half_w = _mm_set1_ps(p.half_img_w);
+		const auto half_h = _mm_set1_ps(p.half_img_h);
+		const auto min_x = _mm_set1_ps(p.min_x);
+		const auto min_y = _mm_set1_ps(p.min_y);
+		const auto max_x = _mm_set1_ps(p.max_x);
+		const auto max_y = _mm_set1_ps(p.max_y);
+		const auto nodata = _mm_set1_ps(p.nodata);
+
+		auto i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const auto h = _mm_loadu_ps(heights + i);
+			const auto k = _mm_add_ps(_mm_set1_ps(static_cast<float>(i)), lanes);
+			const auto dz = _mm_sub_ps(h, cam_z);
+
+			const auto den = _mm_add_ps(_mm_add_ps(den0, _mm_mul_ps(k, step_den)), _mm_mul_ps(dz, dz_den));
+			const auto nx = _mm_add_ps(_mm_add_ps(num_x, _mm_mul_ps(k, step_x)), _mm_mul_ps(dz, dz_x));
+			const auto ny = _mm_add_ps(_mm_add_ps(num_y, _mm_mul_ps(k, step_y)), _mm_mul_ps(dz, dz_y));
+
+			const auto px = _mm_sub_ps(half_w, _mm_div_ps(_mm_mul_ps(f, nx), den));
+			const auto py = _mm_sub_ps(half_h, _mm_div_ps(_mm_mul_ps(f, ny), den));
+
+			auto ok = _mm_cmpneq_ps(h, nodata);
+			ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(px, min_x), _mm_cmpge_ps(py, min_y)));
+			ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmple_ps(px, max_x), _mm_cmple_ps(py, max_y)));
+
+			_mm_storeu_ps(x + i, px);
+			_mm_storeu_ps(y + i, py);
+			_mm_storeu_ps(depth + i, den);
+
+			const auto mask = _mm_movemask_ps(ok);
+			for (auto l = 0; l < 4; l++)
+				valid[i + l] = (mask >> l) & 1;
+		}
+
+		project_row_range(p, heights, i, count, x, y, depth, valid);
+	}
+
+	ORTHO_TARGET("avx2")
+	static void project_row_avx2(const RowProjection& p, const float* heights, const int count, float* x, float* y, float* depth, uint8_t* valid)
+	{
+		const auto lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+
+		const auto num_x = _mm256_set1_ps(p.num_x);
+		const auto num_y = _mm256_set1_ps(p.num_y);
+		const auto den0 = _mm256_set1_ps(p.den);
+		const auto step_x = _mm256_set1_ps(p.step_x);
+		const auto step_y = _mm256_set1_ps(p.step_y);
+		const auto step_den = _mm256_set1_ps(p.step_den);
+		const auto dz_x = _mm256_set1_ps(p.dz_x);
+		const auto dz_y = _mm256_set1_ps(p.dz_y);
+		const auto dz_den = _mm256_set1_ps(p.dz_den);
+		const auto cam_z = _mm256_set1_ps(p.cam_z);
+		const auto f = _mm256_set1_ps(p.f);
+		const auto half_w = _mm256_set1_ps(p.half_img_w);
+		const auto half_h = _mm256_set1_ps(p.half_img_h);
+		const auto min_x = _mm256_set1_ps(p.min_x);
+		const auto min_y = _mm256_set1_ps(p.min_y);
+		const auto max_x = _mm256_set1_ps(p.max_x);
+		const auto max_y = _mm256_set1_ps(p.max_y);
+		const auto nodata = _mm256_set1_ps(p.nodata);
+
+		auto i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			const auto h = _mm256_loadu_ps(heights + i);
+			const auto k = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(i)), lanes);
+			const auto dz = _mm256_sub_ps(h, cam_z);
+
+			const auto den = _mm256_add_ps(_mm256_add_ps(den0, _mm256_mul_ps(k, step_den)), _mm256_mul_ps(dz, dz_den));
+			const auto nx = _mm256_add_ps(_mm256_add_ps(num_x, _mm256_mul_ps(k, step_x)), _mm256_mul_ps(dz, dz_x));
+			const auto ny = _mm256_add_ps(_mm256_add_ps(num_y, _mm256_mul_ps(k, step_y)), _mm256_mul_ps(dz, dz_y));
+
+			const auto px = _mm256_sub_ps(half_w, _mm256_div_ps(_mm256_mul_ps(f, nx), den));
+			const auto py = _mm256_sub_ps(half_h, _mm256_div_ps(_mm256_mul_ps(f, ny), den));
+
+			auto ok = _mm256_cmp_ps(h, nodata, _CMP_NEQ_UQ);
+			ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(px, min_x, _CMP_GE_OQ), _mm256_cmp_ps(py, min_y, _CMP_GE_OQ)));
+			ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(px, max_x, _CMP_LE_OQ), _mm256_cmp_ps(py, max_y, _CMP_LE_OQ)));
+
+			_mm256_storeu_ps(x + i, px);
+			_mm256_storeu_ps(y + i, py);
+			_mm256_storeu_ps(depth + i, den);
+
+			const auto mask = _mm256_movemask_ps(ok);
+			for (auto l = 0; l < 8; l++)
+				valid[i + l] = (mask >> l) & 1;
+		}
+
+		project_row_range(p, heights, i, count, x, y, depth, valid);
+	}
+
+	ORTHO_TARGET("avx512f")
+	static void project_row_avx512(const RowProjection& p, const float* heights, const int count, float* x, float* y, float* depth, uint8_t* valid)
+	{
+		const auto lanes = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+		const auto num_x = _mm512_set1_ps(p.num_x);
+		const auto num_y = _mm512_set1_ps(p.num_y);
+		const auto den0 = _mm512_set1_ps(p.den);
+		const auto step_x = _mm512_set1_ps(p.step_x);
+		const auto step_y = _mm512_set1_ps(p.step_y);
+		const auto step_den = _mm512_set1_ps(p.step_den);
+		const auto dz_x = _mm512_set1_ps(p.dz_x);
+		const auto dz_y = _mm512_set1_ps(p.dz_y);
+		const auto dz_den = _mm512_set1_ps(p.dz_den);
+		const auto cam_z = _mm512_set1_ps(p.cam_z);
+		const auto f = _mm512_set1_ps(p.f);
+		const auto half_w = _mm512_set1_ps(p.half_img_w);
+		const auto half_h = _mm512_set1_ps(p.half_img_h);
+		const auto min_x = _mm512_set1_ps(p.min_x);
+		const auto min_y = _mm512_set1_ps(p.min_y);
+		const auto max_x = _mm512_set1_ps(p.max_x);
+		const auto max_y = _mm512_set1_ps(p.max_y);
+		const auto nodata = _mm512_set1_ps(p.nodata);
+
+		auto i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			const auto h = _mm512_loadu_ps(heights + i);
+			const auto k = _mm512_add_ps(_mm512_set1_ps(static_cast<float>(i)), lanes);
+			const auto dz = _mm512_sub_ps(h, cam_z);
+
+			const auto den = _mm512_add_ps(_mm512_add_ps(den0, _mm512_mul_ps(k, step_den)), _mm512_mul_ps(dz, dz_den));
+			const auto nx = _mm512_add_ps(_mm512_add_ps(num_x, _mm512_mul_ps(k, step_x)), _mm512_mul_ps(dz, dz_x));
+			const auto ny = _mm512_add_ps(_mm512_add_ps(num_y, _mm512_mul_ps(k, step_y)), _mm512_mul_ps(dz, dz_y));
+
+			const auto px = _mm512_sub_ps(half_w, _mm512_div_ps(_mm512_mul_ps(f, nx), den));
+			const auto py = _mm512_sub_ps(half_h, _mm512_div_ps(_mm512_mul_ps(f, ny), den));
+
+			auto ok = _mm512_cmp_ps_mask(h, nodata, _CMP_NEQ_UQ);
+			ok &= _mm512_cmp_ps_mask(px, min_x, _CMP_GE_OQ) & _mm512_cmp_ps_mask(py, min_y, _CMP_GE_OQ);
+			ok &= _mm512_cmp_ps_mask(px, max_x, _CMP_LE_OQ) & _mm512_cmp_ps_mask(py, max_y, _CMP_LE_OQ);
+
+			_mm512_storeu_ps(x + i, px);
+			_mm512_storeu_ps(y + i, py);
+			_mm512_storeu_ps(depth + i, den);
+
+			for (auto l = 0; l < 16; l++)
+				valid[i + l] = (ok >> l) & 1;
+		}
+
+		project_row_range(p, heights, i, count, x, y, depth, valid);
+	}
+
+	enum CpuLevel
+	{
+		CpuScalar = 0,
+		CpuSSE42 = 1,
+		CpuAVX2 = 2,
+		CpuAVX512 = 3
+	};
+
+	static CpuLevel detect_cpu_level()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		const auto max_leaf = info[0];
+
+		__cpuid(info, 1);
+		const bool sse42 = (info[2] & (1 << 20)) != 0;
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+
+		// The OS must save the AVX (and AVX-512) registers on context switches
+		const auto xcr0 = osxsave ? _xgetbv(0) : 0;
+		const bool os_avx = (xcr0 & 0x6) == 0x6;
+		const bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+		bool avx2 = false, avx512f = false;
+		if (max_leaf >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+			avx512f = (info[1] & (1 << 16)) != 0;
+		}
+
+		if (avx512f && os_avx512) return CpuAVX512;
+		if (avx && avx2 && os_avx) return CpuAVX2;
+		if (sse42) return CpuSSE42;
+		return CpuScalar;
+#else
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx512f")) return CpuAVX512;
+		if (__builtin_cpu_supports("avx2")) return CpuAVX2;
+		if (__builtin_cpu_supports("sse4.2")) return CpuSSE42;
+		return CpuScalar;
+#endif
+	}
+
+	static CpuLevel get_cpu_level()
+	{
+		static const auto level = detect_cpu_level();
+		return level;
+	}
+
+	ProjectRowFunc get_project_row_kernel()
+	{
+		switch (get_cpu_level())
+		{
+		case CpuAVX512:
+			return project_row_avx512;
+		case CpuAVX2:
+			return project_row_avx2;
+		case CpuSSE42:
+			return project_row_sse42;
+		default:
+			return project_row_scalar;
+		}
+	}
+
+	const char* get_project_row_kernel_name()
+	{
+		switch (get_cpu_level())
+		{
+		case CpuAVX512:
+			return "AVX-512";
+		case CpuAVX2:
+			return "AVX2";
+		case CpuSSE42:
+			return "SSE4.2";
+		default:
+			return "scalar";
+		}
+	}
+
+#else
+
+	ProjectRowFunc get_project_row_kernel()
+	{
+		return project_row_scalar;
+	}
+
+	const char* get_project_row_kernel_name()
+	{
+		return "scalar";
+	}
+
+#endif
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+namespace orthorectify {
+
+	// Collinearity terms for one DEM row. Along a row only Xa changes, by a constant
+	// step, so numerators and denominator are linear in the cell index plus the
+	// height term. Values are relative to the first cell of the row
+	struct RowProjection
+	{
+		float num_x;
+		float num_y;
+		float den;
+
+		float step_x;
+		float step_y;
+		float step_den;
+
+		// Height coefficients (c1, c2, c3) and camera height
+		float dz_x;
+		float dz_y;
+		float dz_den;
+		float cam_z;
+
+		float f;
+		float half_img_w;
+		float half_img_h;
+
+		// Accepted image coordinates range
+		float min_x;
+		float min_y;
+		float max_x;
+		float max_y;
+
+		// NaN when the DEM has no nodata value
+		float nodata;
+	};
+
+	// Projects count cells of a row with the given heights, writing image coordinates,
+	// camera-space depth and whether the cell is not nodata and falls within range
+	typedef void (*ProjectRowFunc)(const RowProjection& p, const float* heights, int count, float* x, float* y, float* depth, uint8_t* valid);
+
+	// Returns the fastest kernel supported by the CPU (picked once at runtime)
+	ProjectRowFunc get_project_row_kernel();
+	const char* get_project_row_kernel_name();
+
+	void project_row_scalar(const RowProjection& p, const float* heights, int count, float* x, float* y, float* depth, uint8_t* valid);
+
+}
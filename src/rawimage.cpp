@@ -1,5 +1,8 @@
 #include "rawimage.hpp"
 
+#include "cpl_conv.h"
+#include "cpl_string.h"
+
 namespace orthorectify {
 
 	void RawImage::_throw_last_error()
@@ -9,37 +12,6 @@ namespace orthorectify {
 		throw std::runtime_error(err);
 	}
 
-	void RawImage::_get_min_max(GDALRasterBand* band, double& min, double& max)
-	{
-		int bGotMin, bGotMax;
-		double adfMinMax[2];
-
-		adfMinMax[0] = band->GetMinimum(&bGotMin);
-		adfMinMax[1] = band->GetMaximum(&bGotMax);
-
-		if (!(bGotMin && bGotMax))
-			GDALComputeRasterMinMax(band, FALSE, adfMinMax);
-
-		min = adfMinMax[0];
-		max = adfMinMax[1];
-	}
-
-	void RawImage::_readBand(GDALDataset* ds, int band, void* data, GDALDataType type)
-	{
-		const auto b = ds->GetRasterBand(band);
-
-		if (b == nullptr) {
-			ERR << "Could not get " << band << " band";
-			_throw_last_error();
-		}
-
-		if (b->RasterIO(GF_Read, 0, 0, this->_width, this->_height, data, this->_width, this->_height, type, 0, 0) != CE_None) {
-			ERR << "Could not read the " << band << " band";
-			_throw_last_error();
-		}
-
-	}
-
 	bool RawImage::_areBandsOmogeneous(GDALDataset* ds, GDALDataType& type)
 	{
 		const auto bands = ds->GetRasterCount();
@@ -54,7 +26,7 @@ namespace orthorectify {
 
 		type = firstband->GetRasterDataType();
 
-		for (auto b = 2; b < bands; b++) {
+		for (auto b = 2; b <= bands; b++) {
 			const auto band = ds->GetRasterBand(b);
 
 			if (band == nullptr)
@@ -72,7 +44,17 @@ namespace orthorectify {
 	}
 
 
-	void RawImage::_load(const std::string& path)
+	void RawImage::_allocate()
+	{
+		this->_sample_size = GDALGetDataTypeSizeBytes(_type);
+		this->_stride = words() ? 4 : _bands;
+
+		const auto size = static_cast<size_t>(_width) * _height * _stride * _sample_size;
+
+		this->_data = new uint8_t[size]();
+	}
+
+	void RawImage::_load(const std::string& path, const int min_size)
 	{
 
 		if (!fs::exists(path)) {
@@ -88,251 +70,98 @@ namespace orthorectify {
 		}
 
 		this->_driver = ds->GetDriverName();
-		this->_width = ds->GetRasterXSize();
-		this->_height = ds->GetRasterYSize();
-		this->_has_alpha = false;
-		this->_bands = 3;
-
-		const size_t size = this->_width * this->_height;
-
-		const auto bands = ds->GetRasterCount();
-
-		GDALDataType type;
 
-		if (!_areBandsOmogeneous(ds, type)) {
-			ERR << "Bands are not homogeneous";
-			throw std::runtime_error("Bands are not homogeneous");
-		}
+		const auto width = ds->GetRasterXSize();
+		const auto height = ds->GetRasterYSize();
 
-		if (bands == 3 || bands == 4) {
+		// Powers of two match the overviews and the JPEG DCT scaling GDAL picks for reduced reads
+		auto decimation = 1;
 
-			if (type == GDT_Byte) {
+		while (min_size > 0 && MAX(width, height) / (decimation * 2) >= min_size)
+			decimation *= 2;
 
-				this->R = new uint8_t[size];
-				this->G = new uint8_t[size];
-				this->B = new uint8_t[size];
+		this->_width = (width + decimation - 1) / decimation;
+		this->_height = (height + decimation - 1) / decimation;
 
-				_readBand(ds, 1, this->R, GDT_Byte);
-				_readBand(ds, 2, this->G, GDT_Byte);
-				_readBand(ds, 3, this->B, GDT_Byte);
+		if (decimation > 1) {
+			DBG << "Reading " << path << " at 1/" << decimation << " resolution (" << _width << "x" << _height << " pixels)";
+		}
 
-				if (bands == 4)
-				{
-					this->A = new uint8_t[size];
-					_readBand(ds, 4, this->A, GDT_Byte);
+		const auto bands = ds->GetRasterCount();
 
-					this->_has_alpha = true;
-					this->_bands = 4;
-				}
-			}
-			else {
-				ERR << "Unsupported image type" << GDALGetDataTypeName(type);
-				GDALClose(ds);
-				throw std::runtime_error("Unsupported image type");
-			}
+		GDALDataType type;
 
-		}
-		else if (bands == 2) {
-			ERR << "Unsupported image with 2 bands and type " << GDALGetDataTypeName(type);
+		if (!_areBandsOmogeneous(ds, type)) {
+			ERR << "Bands are not homogeneous";
 			GDALClose(ds);
-			throw std::runtime_error("Unsupported image with 2 bands");
+			throw std::runtime_error("Bands are not homogeneous");
 		}
-		else if (bands == 1)
-		{
-
-			if (type == GDT_Byte) {
-
-				this->R = new uint8_t[size];
-				this->G = new uint8_t[size];
-				this->B = new uint8_t[size];
-
-				_readBand(ds, 1, this->R, GDT_Byte);
-
-				memcpy(this->G, this->R, size);
-				memcpy(this->B, this->R, size);
-
-			}
-			else if (type == GDT_UInt16) {
-
-				this->R = new uint8_t[size];
-				this->G = new uint8_t[size];
-				this->B = new uint8_t[size];
-
-				auto* r = new uint16_t[this->_width * this->_height];
-
-				_readBand(ds, 1, r, GDT_UInt16);
-
-				const auto b = ds->GetRasterBand(1);
-				double min, max;
-				_get_min_max(b, min, max);
-
-				for (auto i = 0; i < this->_width * this->_height; i++) {
-
-					const auto scaled = static_cast<uint8_t>(std::ceil((r[i] - min) / (max - min) * 255.0));
-
-					this->R[i] = scaled;
-					this->G[i] = scaled;
-					this->B[i] = scaled;
-				}
-
-				delete[] r;
-
-			}
-			else if (type == GDT_UInt32) {
-
-				this->R = new uint8_t[size];
-				this->G = new uint8_t[size];
-				this->B = new uint8_t[size];
-
-				auto* r = new uint32_t[this->_width * this->_height];
-				_readBand(ds, 1, r, GDT_UInt32);
-
-				const auto b = ds->GetRasterBand(1);
-				double min, max;
-				_get_min_max(b, min, max);
-
-
-				for (auto i = 0; i < this->_width * this->_height; i++) {
-
-					const auto scaled = static_cast<uint8_t>(std::ceil((r[i] - min) / (max - min) * 255.0));
 
-					this->R[i] = scaled;
-					this->G[i] = scaled;
-					this->B[i] = scaled;
-				}
-
-				delete[] r;
-
-			}
-			else if (type == GDT_Float32) {
-
-				this->R = new uint8_t[size];
-				this->G = new uint8_t[size];
-				this->B = new uint8_t[size];
-
-				auto* r = new float[this->_width * this->_height];
-				_readBand(ds, 1, r, GDT_Float32);
-
-				const auto b = ds->GetRasterBand(1);
-				double min, max;
-				_get_min_max(b, min, max);
-
-				for (auto i = 0; i < this->_width * this->_height; i++) {
-
-					const auto scaled = static_cast<uint8_t>(std::ceil((r[i] - min) / (max - min) * 255.0));
-
-					this->R[i] = scaled;
-					this->G[i] = scaled;
-					this->B[i] = scaled;
-				}
-
-				delete[] r;
-
-			}
-			else
-			{
-				ERR << "Unsupported image type " << GDALGetDataTypeName(type);
-				GDALClose(ds);
-				throw std::runtime_error("Unsupported image type");
-			}
+		// Samples are kept in their own type, the other types are read as floats
+		if (type == GDT_Byte || type == GDT_UInt16 || type == GDT_Float32)
+			this->_type = type;
+		else if (type == GDT_Int16 || type == GDT_UInt32 || type == GDT_Int32 || type == GDT_Float64) {
+			DBG << "Reading " << GDALGetDataTypeName(type) << " image as " << GDALGetDataTypeName(GDT_Float32);
+			this->_type = GDT_Float32;
 		}
 		else {
-			ERR << "Unsupported image type" << GDALGetDataTypeName(type);
+			ERR << "Unsupported image type " << GDALGetDataTypeName(type);
 			GDALClose(ds);
 			throw std::runtime_error("Unsupported image type");
-
 		}
 
-		GDALClose(ds);
-	}
+		const auto last_band_interpretation = ds->GetRasterBand(bands)->GetColorInterpretation();
 
-	void RawImage::get_pixel(const int x, const int y, uint8_t* out) const
-	{
+		// 8-bit images with 4 bands and no color interpretation are RGBA
+		this->_has_alpha = bands > 1 && (last_band_interpretation == GCI_AlphaBand ||
+			(bands == 4 && type == GDT_Byte && last_band_interpretation == GCI_Undefined));
+		this->_bands = bands;
 
-#if DEBUG
-		if (x >= _width || y >= _height || x < 0 || y < 0) {
-			ERR << "Invalid pixel access: " << x << ", " << y;
-			throw std::runtime_error("Invalid pixel access");
-		}
-#endif
-		const auto idx = IDX(x, y);
+		_allocate();
 
-		out[0] = R[idx];
-		out[1] = G[idx];
-		out[2] = B[idx];
+		// All the bands at once, straight into the interleaved buffer
+		std::vector<int> band_map(bands);
 
-		if (_has_alpha)
-			out[3] = A[idx];
+		for (auto b = 0; b < bands; b++)
+			band_map[b] = b + 1;
 
-	}
+		const auto pixel_size = static_cast<GSpacing>(_stride) * _sample_size;
 
-	void RawImage::set_pixel(const int x, const int y, const uint8_t* in)
-	{
+		// Reduced reads average the source pixels, the default (nearest) aliases on images without overviews
+		GDALRasterIOExtraArg extra_arg;
+		INIT_RASTERIO_EXTRA_ARG(extra_arg);
+		extra_arg.eResampleAlg = GRIORA_Average;
 
-#if DEBUG
-		if (x >= _width || y >= _height || x < 0 || y < 0) {
-			ERR << "Invalid pixel access: " << x << ", " << y;
-			throw std::runtime_error("Invalid pixel access");
+		if (ds->RasterIO(GF_Read, 0, 0, width, height, this->_data, this->_width, this->_height,
+			_type, bands, band_map.data(), pixel_size, pixel_size * this->_width, _sample_size, &extra_arg) != CE_None) {
+			ERR << "Could not read the image bands";
+			GDALClose(ds);
+			_throw_last_error();
 		}
-#endif
-
-		const auto idx = IDX(x, y);
-
-		R[idx] = in[0];
-		G[idx] = in[1];
-		B[idx] = in[2];
-
-		if (_has_alpha)
-			A[idx] = in[3];
 
+		GDALClose(ds);
 	}
 
-	void RawImage::bilinear_interpolate(const double x, const double y, uint8_t* out) const
+	void RawImage::write(const std::string& path, const std::string& driver, const std::function<void(GDALDataset*)>& configure,
+		const std::vector<std::string>& options)
 	{
-		auto x0 = static_cast<int>(std::floor(x));
-		auto x1 = x0 + 1;
-		auto y0 = static_cast<int>(std::floor(y));
-		auto y1 = y0 + 1;
-
-		const auto width = _width;
-		const auto height = _height;
-
-		x0 = std::clamp(x0, 0, width - 1);
-		x1 = std::clamp(x1, 0, width - 1);
-
-		y0 = std::clamp(y0, 0, height - 1);
-		y1 = std::clamp(y1, 0, height - 1);
-
-		const auto wa = (x1 - x) * (y1 - y);
-		const auto wb = (x1 - x) * (y - y0);
-		const auto wc = (x - x0) * (y1 - y);
-		const auto wd = (x - x0) * (y - y0);
-
-		out[0] = static_cast<uint8_t>(std::round(
-			wa * R[y0 * width + x0] + wb * R[y1 * width + x0] + wc * R[y0 * width + x1] + wd * R[y1 * width + x1]));
-
-		out[1] = static_cast<uint8_t>(std::round(
-			wa * G[y0 * width + x0] + wb * G[y1 * width + x0] + wc * G[y0 * width + x1] + wd * G[y1 * width + x1]));
-
-		out[2] = static_cast<uint8_t>(std::round(
-			wa * B[y0 * width + x0] + wb * B[y1 * width + x0] + wc * B[y0 * width + x1] + wd * B[y1 * width + x1]));
-
-		if (_has_alpha)
-		{
-			out[3] = static_cast<uint8_t>(std::round(
-				wa * A[y0 * width + x0] + wb * A[y1 * width + x0] + wc * A[y0 * width + x1] + wd * A[y1 * width + x1]));
-		}
-
+		write_window(path, driver, 0, 0, _width, _height, configure, options);
 	}
 
-	void RawImage::write(const std::string& path, const std::string& driver, const std::function<void(GDALDataset*)>& configure)
+	void RawImage::write_window(const std::string& path, const std::string& driver, const int x, const int y, const int width, const int height,
+		const std::function<void(GDALDataset*)>& configure, const std::vector<std::string>& options)
 	{
 
-		if (R == nullptr || G == nullptr || B == nullptr) {
+		if (_data == nullptr) {
 			ERR << "No data to write";
 			return;
 		}
 
+		if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > _width || y + height > _height) {
+			ERR << "Invalid window (" << x << ", " << y << ") " << width << "x" << height;
+			throw std::runtime_error("Invalid window");
+		}
+
 		if (fs::exists(path))
 			fs::remove(path);
 
@@ -342,55 +171,53 @@ namespace orthorectify {
 		auto* mem_driver = driver_manager->GetDriverByName("MEM");
 		auto* dst_driver = driver_manager->GetDriverByName(driver.empty() ? _driver.c_str() : driver.c_str());
 
-		auto* mem_ds = mem_driver->Create("", _width, _height, _has_alpha ? 4 : 3, GDT_Byte, nullptr);
-
-		if (mem_ds == nullptr) {
-			ERR << "Could not create in-memory dataset";
-			_throw_last_error();
+		if (dst_driver == nullptr) {
+			ERR << "Driver " << (driver.empty() ? _driver : driver) << " is not available";
+			throw std::runtime_error("Driver is not available");
 		}
 
-		if (configure != nullptr) configure(mem_ds);
-
-		const auto first_band = mem_ds->GetRasterBand(1);
-		first_band->SetColorInterpretation(GCI_RedBand);
+		// The in-memory dataset has no storage of its own, its bands point into the
+		// interleaved buffer (with its row stride) so that the pixels are never copied
+		// before encoding
+		auto* mem_ds = mem_driver->Create("", width, height, 0, _type, nullptr);
 
-		if (first_band->RasterIO(GF_Write, 0, 0, _width, _height, this->R, _width, _height, GDT_Byte, 0, 0) != CE_None) {
-			ERR << "Could not write red raster band";
-			GDALClose(mem_ds);
-			_throw_last_error();
-		}
-
-		const auto second_band = mem_ds->GetRasterBand(2);
-		second_band->SetColorInterpretation(GCI_GreenBand);
-
-		if (second_band->RasterIO(GF_Write, 0, 0, _width, _height, this->G, _width, _height, GDT_Byte, 0, 0) != CE_None) {
-			ERR << "Could not write green raster band";
-			GDALClose(mem_ds);
+		if (mem_ds == nullptr) {
+			ERR << "Could not create in-memory dataset";
 			_throw_last_error();
 		}
 
-		const auto third_band = mem_ds->GetRasterBand(3);
-		third_band->SetColorInterpretation(GCI_BlueBand);
+		const auto pixel_size = static_cast<size_t>(_stride) * _sample_size;
 
-		if (third_band->RasterIO(GF_Write, 0, 0, _width, _height, this->B, _width, _height, GDT_Byte, 0, 0) != CE_None) {
-			ERR << "Could not write blue raster band";
-			GDALClose(mem_ds);
-			_throw_last_error();
-		}
+		// In bytes, pixel<uint8_t> would only be right for 8-bit samples
+		auto* origin = _data + IDX(x, y) * pixel_size;
 
-		if (_has_alpha)
+		for (auto b = 0; b < _bands; b++)
 		{
-			const auto fourth_band = mem_ds->GetRasterBand(4);
-			fourth_band->SetColorInterpretation(GCI_AlphaBand);
+			char pointer[64] = { 0 };
+			CPLPrintPointer(pointer, origin + static_cast<size_t>(b) * _sample_size, sizeof(pointer));
+
+			CPLStringList band_options;
+			band_options.SetNameValue("DATAPOINTER", pointer);
+			band_options.SetNameValue("PIXELOFFSET", std::to_string(pixel_size).c_str());
+			band_options.SetNameValue("LINEOFFSET", std::to_string(pixel_size * _width).c_str());
 
-			if (fourth_band->RasterIO(GF_Write, 0, 0, _width, _height, this->A, _width, _height, GDT_Byte, 0, 0) != CE_None) {
-				ERR << "Could not write alpha raster band";
+			if (mem_ds->AddBand(_type, band_options.List()) != CE_None) {
+				ERR << "Could not add band " << (b + 1) << " to the in-memory dataset";
 				GDALClose(mem_ds);
 				_throw_last_error();
 			}
+
+			mem_ds->GetRasterBand(b + 1)->SetColorInterpretation(get_color_interpretation(b, _bands, _has_alpha));
 		}
 
-		auto* ds = dst_driver->CreateCopy(path.c_str(), mem_ds, 0, nullptr, nullptr, nullptr);
+		if (configure != nullptr) configure(mem_ds);
+
+		CPLStringList creation_options;
+
+		for (const auto& option : options)
+			creation_options.AddString(option.c_str());
+
+		auto* ds = dst_driver->CreateCopy(path.c_str(), mem_ds, 0, creation_options.List(), nullptr, nullptr);
 
 		if (ds == nullptr) {
 			ERR << "Could not create image at " << path;
@@ -403,4 +230,4 @@ namespace orthorectify {
 
 	}
 
-}
\ No newline at end of file
+}
@@ -9,12 +9,19 @@
 
 #include "gdal_priv.h"
 
-#define IDX(x, y) ((x) + (y) * _width)
+#define IDX(x, y) ((x) + static_cast<size_t>(y) * _width)
 
 namespace fs = std::filesystem;
 
 namespace orthorectify {
 
+	// Neighbours (pixel indices) and weights of a bilinear sample
+	struct BilinearTaps
+	{
+		size_t idx[4];
+		double w[4];
+	};
+
 	class RawImage
 	{
 		int _width;
@@ -23,15 +30,19 @@ namespace orthorectify {
 		int _bands;
 		std::string _driver;
 
-		uint8_t* R;
-		uint8_t* G;
-		uint8_t* B;
-		uint8_t* A;
+		// Byte, UInt16 or Float32
+		GDALDataType _type;
+		int _sample_size;
+
+		// Pixels are interleaved, with _stride samples per pixel. 8-bit RGB(A) images have a
+		// stride of 4 so that a whole pixel moves as a single 32-bit word (the A byte is 0
+		// when there is no alpha band), other images have one sample per band
+		int _stride;
+		uint8_t* _data;
 
 		void _throw_last_error();
-		void _get_min_max(GDALRasterBand* band, double& min, double& max);
-		void _load(const std::string& path);
-		void _readBand(GDALDataset* ds, int band, void *data, GDALDataType type);
+		void _load(const std::string& path, int min_size);
+		void _allocate();
 		bool _areBandsOmogeneous(GDALDataset* ds, GDALDataType &type);
 
 	public:
@@ -40,62 +51,162 @@ namespace orthorectify {
 		int height() const { return _height; }
 		bool has_alpha() const { return _has_alpha; }
 		int bands() const { return _bands; }
+		int color_bands() const { return _has_alpha ? _bands - 1 : _bands; }
+		GDALDataType type() const { return _type; }
+
+		// Whether pixels are 32-bit words
+		bool words() const { return _type == GDT_Byte && color_bands() == 3; }
 
-		RawImage(const std::string& path) {
+		// With min_size the image is read at a reduced resolution: halved (from the overviews,
+		// or decimated while decoding) as long as its largest dimension stays at least min_size
+		RawImage(const std::string& path, const int min_size = 0) {
 
-			this->R = nullptr;
-			this->G = nullptr;
-			this->B = nullptr;
-			this->A = nullptr;
+			this->_data = nullptr;
 
 			this->_width = 0;
 			this->_height = 0;
 			this->_has_alpha = false;
 			this->_bands = 0;
+			this->_type = GDT_Byte;
+			this->_sample_size = 1;
+			this->_stride = 0;
 
-			_load(path);
+			_load(path, min_size);
 		}
 
-		RawImage(int width, int height, bool has_alpha, const std::string& driver) {
+		// bands counts the alpha band, if any (the last one)
+		RawImage(int width, int height, int bands, bool has_alpha, GDALDataType type, const std::string& driver) {
 
 			this->_width = width;
 			this->_height = height;
 			this->_has_alpha = has_alpha;
-			this->_bands = has_alpha ? 4 : 3;
+			this->_bands = bands;
+			this->_type = type;
 			this->_driver = driver;
 
-			const size_t size = this->_width * this->_height;
+			_allocate();
+		}
+
+		// 8-bit RGB(A)
+		RawImage(int width, int height, bool has_alpha, const std::string& driver) :
+			RawImage(width, height, has_alpha ? 4 : 3, has_alpha, GDT_Byte, driver) {
+		}
+
+		~RawImage()
+		{
+			delete[] _data;
+		}
 
-			this->R = new uint8_t[size];
-			memset(this->R, 0, size);
-			this->G = new uint8_t[size];
-			memset(this->G, 0, size);
-			this->B = new uint8_t[size];
-			memset(this->B, 0, size);
+		RawImage(const RawImage&) = delete;
+		RawImage& operator=(const RawImage&) = delete;
 
-			if (has_alpha)
-			{
-				this->A = new uint8_t[size];
-				memset(this->A, 0, size);
+		// Samples of a pixel, bands in order. S must match the image type
+		template <typename S>
+		const S* pixel(const size_t idx) const
+		{
+			return reinterpret_cast<const S*>(_data) + idx * _stride;
+		}
+
+		template <typename S>
+		S* pixel(const size_t idx)
+		{
+			return reinterpret_cast<S*>(_data) + idx * _stride;
+		}
+
+		template <typename S>
+		const S* pixel(const int x, const int y) const
+		{
+
+#if DEBUG
+			if (x >= _width || y >= _height || x < 0 || y < 0) {
+				ERR << "Invalid pixel access: " << x << ", " << y;
+				throw std::runtime_error("Invalid pixel access");
 			}
-			else
-				this->A = nullptr;
+#endif
+			return pixel<S>(IDX(x, y));
+		}
+
+		template <typename S>
+		S* pixel(const int x, const int y)
+		{
 
+#if DEBUG
+			if (x >= _width || y >= _height || x < 0 || y < 0) {
+				ERR << "Invalid pixel access: " << x << ", " << y;
+				throw std::runtime_error("Invalid pixel access");
+			}
+#endif
+			return pixel<S>(IDX(x, y));
 		}
 
-		~RawImage()
+		// Whole pixel access of 8-bit RGB(A) images, for the hot loops. Bands missing from the image are 0
+
+		uint32_t get_word(const int x, const int y) const
+		{
+			uint32_t word;
+			memcpy(&word, pixel<uint8_t>(x, y), sizeof(word));
+
+			return word;
+		}
+
+		void set_word(const int x, const int y, const uint32_t word)
+		{
+			memcpy(pixel<uint8_t>(x, y), &word, sizeof(word));
+		}
+
+		BilinearTaps bilinear_taps(const double x, const double y) const
+		{
+			auto x0 = static_cast<int>(std::floor(x));
+			auto x1 = x0 + 1;
+			auto y0 = static_cast<int>(std::floor(y));
+			auto y1 = y0 + 1;
+
+			const auto width = _width;
+			const auto height = _height;
+
+			x0 = std::clamp(x0, 0, width - 1);
+			x1 = std::clamp(x1, 0, width - 1);
+
+			y0 = std::clamp(y0, 0, height - 1);
+			y1 = std::clamp(y1, 0, height - 1);
+
+			return BilinearTaps{
+				{ IDX(x0, y0), IDX(x0, y1), IDX(x1, y0), IDX(x1, y1) },
+				{ (x1 - x) * (y1 - y), (x1 - x) * (y - y0), (x - x0) * (y1 - y), (x - x0) * (y - y0) }
+			};
+		}
+
+		// Band count (3 or 4) known at compile time, so that the alpha band is skipped without branches
+		template <int Bands>
+		uint32_t bilinear_interpolate(const double x, const double y) const
 		{
-			delete[] R;
-			delete[] G;
-			delete[] B;
-			delete[] A;
+			const auto taps = bilinear_taps(x, y);
+
+			// Four words in, one word out
+			const auto* a = pixel<uint8_t>(taps.idx[0]);
+			const auto* b = pixel<uint8_t>(taps.idx[1]);
+			const auto* c = pixel<uint8_t>(taps.idx[2]);
+			const auto* d = pixel<uint8_t>(taps.idx[3]);
+
+			uint8_t out[4] = { 0, 0, 0, 0 };
+
+			for (auto band = 0; band < Bands; band++)
+				out[band] = static_cast<uint8_t>(std::round(taps.w[0] * a[band] + taps.w[1] * b[band] + taps.w[2] * c[band] + taps.w[3] * d[band]));
+
+			uint32_t word;
+			memcpy(&word, out, sizeof(word));
+
+			return word;
 		}
 
+		// Writes the image with the given creation options. configure is called on the source
+		// dataset before the copy (i.e. to set the georeferencing)
+		void write(const std::string& path, const std::string& driver, const std::function<void(GDALDataset*)>& configure,
+			const std::vector<std::string>& options = {});
 
-		void get_pixel(int x, int y, uint8_t* out) const;
-		void set_pixel(int x, int y, const uint8_t* in);
-		void bilinear_interpolate(double x, double y, uint8_t* out) const;
-		void write(const std::string& path, const std::string& driver, const std::function<void(GDALDataset*)>& configure);
+		// Writes the [x, x + width) x [y, y + height) window, straight from the buffer
+		void write_window(const std::string& path, const std::string& driver, int x, int y, int width, int height,
+			const std::function<void(GDALDataset*)>& configure, const std::vector<std::string>& options = {});
 	};
 
-}
\ No newline at end of file
+}
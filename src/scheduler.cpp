@@ -0,0 +1,250 @@
+#include <thread>
+
+#include "scheduler.hpp"
+
+namespace orthorectify {
+
+	// Index of the worker running on the current thread (-1 outside of the scheduler)
+	static thread_local int current_worker = -1;
+
+	// Times an idle worker yields before going to sleep
+	static constexpr int idle_spins = 64;
+
+	Scheduler::Scheduler(const int threads, const int max_active_jobs)
+	{
+		this->_threads = MAX(1, threads);
+		this->_max_active_jobs = MAX(1, max_active_jobs);
+		this->_epoch = 0;
+
+		for (auto i = 0; i < this->_threads; i++)
+			_workers.emplace_back(std::make_unique<Worker>());
+	}
+
+	void Scheduler::_notify()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_idle_mutex);
+			_epoch.fetch_add(1);
+		}
+
+		_idle_cv.notify_all();
+	}
+
+	// epoch is the one read before looking for work, so that a notification
+	// arriving in between is not missed
+	void Scheduler::_idle(int& spins, const uint64_t epoch)
+	{
+		if (++spins < idle_spins)
+		{
+			std::this_thread::yield();
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(_idle_mutex);
+		_idle_cv.wait(lock, [&] { return _epoch.load() != epoch; });
+
+		spins = 0;
+	}
+
+	bool Scheduler::_pop(const int worker, Task& task)
+	{
+		auto& w = *_workers[worker];
+		std::lock_guard<std::mutex> lock(w.mutex);
+
+		if (w.tasks.empty())
+			return false;
+
+		// Newest first, it's the one most likely still in cache
+		task = w.tasks.back();
+		w.tasks.pop_back();
+
+		return true;
+	}
+
+	bool Scheduler::_steal(const int worker, Task& task)
+	{
+		for (auto i = 1; i < _threads; i++)
+		{
+			auto& victim = *_workers[(worker + i) % _threads];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+
+			if (victim.tasks.empty())
+				continue;
+
+			// Oldest first, the owner works from the other end
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+
+			return true;
+		}
+
+		return false;
+	}
+
+	bool Scheduler::_try_run_task(const int worker)
+	{
+		Task task{};
+
+		if (!_pop(worker, task) && !_steal(worker, task))
+			return false;
+
+		_execute(task);
+		return true;
+	}
+
+	void Scheduler::_execute(const Task& task)
+	{
+		try
+		{
+			(*task.body)(task.begin, task.end);
+		}
+		catch (const std::exception& e)
+		{
+			ERR << "Error while running tile [" << task.begin << ", " << task.end << "): " << e.what();
+		}
+
+		// The last tile wakes the worker waiting for them
+		if (task.pending->fetch_sub(1) == 1)
+			_notify();
+	}
+
+	void Scheduler::run(const size_t count, const std::function<void(size_t)>& job)
+	{
+		std::atomic<size_t> next_job(0);
+		std::atomic<size_t> completed_jobs(0);
+		std::atomic<int> active_jobs(0);
+
+		const auto worker_loop = [&](const int worker) {
+
+			current_worker = worker;
+			auto spins = 0;
+
+			while (true)
+			{
+				// Read before checking, see _idle
+				const auto epoch = _epoch.load();
+
+				if (completed_jobs.load() >= count)
+					break;
+
+				if (_try_run_task(worker))
+				{
+					spins = 0;
+					continue;
+				}
+
+				// Take a new job only if we have not reached the limit of jobs in flight
+				auto active = active_jobs.load();
+				if (active < _max_active_jobs && active_jobs.compare_exchange_strong(active, active + 1))
+				{
+					const auto index = next_job.fetch_add(1);
+
+					if (index < count)
+					{
+						try
+						{
+							job(index);
+						}
+						catch (const std::exception& e)
+						{
+							ERR << "Error while running job " << index << ": " << e.what();
+						}
+
+						completed_jobs.fetch_add(1);
+						active_jobs.fetch_sub(1);
+
+						// A slot for a new job, or the end of the run
+						_notify();
+
+						spins = 0;
+						continue;
+					}
+
+					active_jobs.fetch_sub(1);
+				}
+
+				_idle(spins, epoch);
+			}
+
+			current_worker = -1;
+		};
+
+		std::vector<std::thread> threads;
+
+		for (auto i = 1; i < _threads; i++)
+			threads.emplace_back(worker_loop, i);
+
+		worker_loop(0);
+
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	void Scheduler::parallel_for(const int begin, const int end, const int grain, const std::function<void(int, int)>& body)
+	{
+		if (begin >= end)
+			return;
+
+		const auto step = MAX(1, grain);
+		const auto worker = current_worker;
+
+		// Not called from a job, nobody to share the work with
+		if (worker < 0 || _threads == 1)
+		{
+			for (auto b = begin; b < end; b += step)
+				body(b, MIN(end, b + step));
+
+			return;
+		}
+
+		const auto tiles = static_cast<int>((static_cast<int64_t>(end) - begin + step - 1) / step);
+		std::atomic<int> pending(tiles);
+
+		{
+			auto& w = *_workers[worker];
+			std::lock_guard<std::mutex> lock(w.mutex);
+
+			// Pushed in reverse so that the owner walks the tiles in order
+			for (auto t = tiles - 1; t >= 0; t--)
+			{
+				const auto b = begin + t * step;
+				w.tasks.push_back(Task{ &body, b, MIN(end, b + step), &pending });
+			}
+		}
+
+		_notify();
+
+		auto spins = 0;
+
+		while (pending.load() > 0)
+		{
+			const auto epoch = _epoch.load();
+
+			if (_try_run_task(worker))
+				spins = 0;
+			else if (pending.load() > 0)
+				_idle(spins, epoch);
+		}
+	}
+
+	void Scheduler::wait_until(const std::function<bool()>& ready)
+	{
+		const auto worker = current_worker;
+		auto spins = 0;
+
+		while (true)
+		{
+			// Read before checking, see _idle
+			const auto epoch = _epoch.load();
+
+			if (ready())
+				return;
+
+			if (worker >= 0 && _try_run_task(worker))
+				spins = 0;
+			else
+				_idle(spins, epoch);
+		}
+	}
+
+}
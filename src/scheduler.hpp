@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace orthorectify {
+
+	// Work-stealing scheduler. Jobs (shots) are handed out to worker threads,
+	// a job splits its work in tiles that are pushed on the deque of the worker
+	// running it; idle workers steal tiles from the other deques. Workers that
+	// find nothing to run spin briefly, then sleep until something changes
+	class Scheduler
+	{
+		struct Task
+		{
+			const std::function<void(int, int)>* body;
+			int begin;
+			int end;
+			std::atomic<int>* pending;
+		};
+
+		struct Worker
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		int _threads;
+		int _max_active_jobs;
+
+		std::vector<std::unique_ptr<Worker>> _workers;
+
+		// Bumped whenever there may be something new to do (tiles pushed, tiles or jobs done)
+		std::mutex _idle_mutex;
+		std::condition_variable _idle_cv;
+		std::atomic<uint64_t> _epoch;
+
+		void _notify();
+		void _idle(int& spins, uint64_t epoch);
+
+		bool _pop(int worker, Task& task);
+		bool _steal(int worker, Task& task);
+		bool _try_run_task(int worker);
+		void _execute(const Task& task);
+
+	public:
+
+		// Runs with the given number of threads and at most max_active_jobs jobs in flight
+		Scheduler(int threads, int max_active_jobs);
+
+		int threads() const { return _threads; }
+
+		// Runs job(index) for every index in [0, count) on the worker threads,
+		// returns once all jobs are done
+		void run(size_t count, const std::function<void(size_t)>& job);
+
+		// Splits [begin, end) in tiles of at most grain items and runs body(tile_begin, tile_end)
+		// on each of them, returns once all tiles are done. The calling worker keeps
+		// running tiles (its own or stolen ones) while waiting
+		void parallel_for(int begin, int end, int grain, const std::function<void(int, int)>& body);
+
+		// Returns once ready() is true. When called from a job, the worker runs tiles
+		// of the other jobs meanwhile instead of sitting idle (i.e. waiting on I/O).
+		// With nothing to run it sleeps, whatever ready() depends on must call notify()
+		// when it changes
+		void wait_until(const std::function<bool()>& ready);
+
+		// Wakes the sleeping workers, so that they check again for work and wait_until conditions
+		void notify() { _notify(); }
+	};
+
+}
@@ -0,0 +1,224 @@
+#include <filesystem>
+#include <ostream>
+#include <vector>
+
+#include "sidecar.hpp"
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace orthorectify {
+
+	static const char sidecar_magic[8] = { 'O', 'R', 'T', 'H', 'O', 'D', 'E', 'M' };
+	static constexpr uint32_t sidecar_version = 1;
+
+	// Covers the page size and the Windows allocation granularity
+	static constexpr uint64_t sidecar_alignment = 1 << 16;
+
+#ifdef _WIN32
+
+	MappedFile::MappedFile(const std::string& path)
+	{
+		this->_data = nullptr;
+		this->_size = 0;
+		this->_mapping = nullptr;
+
+		this->_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		if (_file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Could not open " + path);
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(_file);
+			throw std::runtime_error("Could not get the size of " + path);
+		}
+
+		this->_size = static_cast<size_t>(size.QuadPart);
+		this->_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (_mapping == nullptr)
+		{
+			CloseHandle(_file);
+			throw std::runtime_error("Could not map " + path);
+		}
+
+		this->_data = static_cast<const uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+
+		if (_data == nullptr)
+		{
+			CloseHandle(_mapping);
+			CloseHandle(_file);
+			throw std::runtime_error("Could not map " + path);
+		}
+	}
+
+	MappedFile::~MappedFile()
+	{
+		UnmapViewOfFile(_data);
+		CloseHandle(_mapping);
+		CloseHandle(_file);
+	}
+
+#else
+
+	MappedFile::MappedFile(const std::string& path)
+	{
+		this->_data = nullptr;
+		this->_size = 0;
+
+		const auto fd = ::open(path.c_str(), O_RDONLY);
+
+		if (fd < 0)
+			throw std::runtime_error("Could not open " + path);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Could not get the size of " + path);
+		}
+
+		this->_size = static_cast<size_t>(st.st_size);
+
+		auto* data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+
+		// The mapping keeps its own reference to the file
+		::close(fd);
+
+		if (data == MAP_FAILED)
+			throw std::runtime_error("Could not map " + path);
+
+		this->_data = static_cast<const uint8_t*>(data);
+	}
+
+	MappedFile::~MappedFile()
+	{
+		munmap(const_cast<uint8_t*>(_data), _size);
+	}
+
+#endif
+
+	DemSidecar::DemSidecar(const std::string& path) : _file(path)
+	{
+		this->_header = reinterpret_cast<const DemSidecarHeader*>(_file.data());
+	}
+
+	std::unique_ptr<DemSidecar> DemSidecar::open(const std::string& path, const std::string& dem_path)
+	{
+		if (!fs::exists(path))
+			return nullptr;
+
+		std::unique_ptr<DemSidecar> sidecar;
+
+		try
+		{
+			sidecar = std::unique_ptr<DemSidecar>(new DemSidecar(path));
+		}
+		catch (const std::exception& e)
+		{
+			ERR << "Could not open raw DEM " << path << ": " << e.what();
+			return nullptr;
+		}
+
+		const auto size = sidecar->_file.size();
+		const auto* header = sidecar->_header;
+
+		if (size < sizeof(DemSidecarHeader) || memcmp(header->magic, sidecar_magic, sizeof(sidecar_magic)) != 0 ||
+			header->version != sidecar_version)
+		{
+			INF << "Ignoring raw DEM " << path << " (unknown format)";
+			return nullptr;
+		}
+
+		if (header->source_size != fs::file_size(dem_path) || header->source_mtime != get_mtime(dem_path))
+		{
+			INF << "Raw DEM " << path << " is out of date";
+			return nullptr;
+		}
+
+		const auto cells = static_cast<uint64_t>(header->width) * header->height;
+		const auto type_size = static_cast<uint64_t>(GDALGetDataTypeSizeBytes(static_cast<GDALDataType>(header->data_type)));
+
+		if (sizeof(DemSidecarHeader) + header->wkt_length > header->data_offset || header->data_offset + cells * type_size > size)
+		{
+			INF << "Ignoring raw DEM " << path << " (truncated)";
+			return nullptr;
+		}
+
+		sidecar->_wkt.assign(reinterpret_cast<const char*>(sidecar->_file.data() + sizeof(DemSidecarHeader)), header->wkt_length);
+
+		return sidecar;
+	}
+
+	void DemSidecar::create(const std::string& path, const std::string& dem_path, GDALDataset* dem, const double min_value, const double max_value)
+	{
+		auto* band = dem->GetRasterBand(1);
+		const auto type = band->GetRasterDataType();
+		const auto type_size = GDALGetDataTypeSizeBytes(type);
+
+		DemSidecarHeader header{};
+
+		memcpy(header.magic, sidecar_magic, sizeof(sidecar_magic));
+		header.version = sidecar_version;
+		header.data_type = type;
+		header.width = dem->GetRasterXSize();
+		header.height = dem->GetRasterYSize();
+
+		if (dem->GetGeoTransform(header.geotransform) != CE_None)
+			throw std::runtime_error("Could not get the DEM geotransform");
+
+		int has_nodata;
+		header.nodata = band->GetNoDataValue(&has_nodata);
+		header.has_nodata = has_nodata != 0;
+
+		header.min_value = min_value;
+		header.max_value = max_value;
+
+		header.source_size = fs::file_size(dem_path);
+		header.source_mtime = get_mtime(dem_path);
+
+		const char* wkt = dem->GetProjectionRef();
+		header.has_wkt = wkt != nullptr;
+
+		const std::string wkt_str = wkt != nullptr ? wkt : "";
+		header.wkt_length = wkt_str.size();
+		header.data_offset = (sizeof(DemSidecarHeader) + header.wkt_length + sidecar_alignment - 1) / sidecar_alignment * sidecar_alignment;
+
+		// Concurrent processes each write their own, the last one to finish wins
+		write_stream_atomically(path, [&](std::ostream& out) {
+
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(wkt_str.data(), static_cast<std::streamsize>(wkt_str.size()));
+
+			const std::vector<char> padding(header.data_offset - sizeof(header) - wkt_str.size(), 0);
+			out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+
+			// Copy the band a few rows at a time, the DEM might not fit in memory
+			const auto row_size = static_cast<size_t>(header.width) * type_size;
+			const auto chunk_rows = MAX(1, static_cast<int>((64 << 20) / row_size));
+
+			std::vector<char> buffer(row_size * chunk_rows);
+
+			for (auto y = 0; y < header.height; y += chunk_rows)
+			{
+				const auto rows = MIN(chunk_rows, header.height - y);
+
+				if (band->RasterIO(GF_Read, 0, y, header.width, rows, buffer.data(), header.width, rows, type, 0, 0) != CE_None)
+					throw std::runtime_error(CPLGetLastErrorMsg());
+
+				out.write(buffer.data(), static_cast<std::streamsize>(row_size * rows));
+			}
+		}, true);
+	}
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "utils.hpp"
+
+#include "gdal_priv.h"
+
+namespace orthorectify {
+
+	// Read-only memory mapping of a whole file
+	class MappedFile
+	{
+		const uint8_t* _data;
+		size_t _size;
+
+#ifdef _WIN32
+		void* _file;
+		void* _mapping;
+#endif
+
+	public:
+
+		explicit MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const uint8_t* data() const { return _data; }
+		size_t size() const { return _size; }
+	};
+
+	// Fixed-size header at the start of a raw DEM sidecar. It is followed by the
+	// projection WKT and, at data_offset, by the band cells in native byte order
+	struct DemSidecarHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t data_type;
+
+		int32_t width;
+		int32_t height;
+
+		double geotransform[6];
+
+		int32_t has_nodata;
+		int32_t has_wkt;
+		double nodata;
+
+		double min_value;
+		double max_value;
+
+		// Source DEM the sidecar was made from
+		uint64_t source_size;
+		int64_t source_mtime;
+
+		uint64_t wkt_length;
+		uint64_t data_offset;
+	};
+
+	// Uncompressed copy of a DEM band, memory mapped so that the page cache is shared
+	// by all the processes using it and nothing needs to be decoded at startup
+	class DemSidecar
+	{
+		MappedFile _file;
+		const DemSidecarHeader* _header;
+		std::string _wkt;
+
+		DemSidecar(const std::string& path);
+
+	public:
+
+		// Returns nullptr when the sidecar does not exist, is invalid or older than the DEM
+		static std::unique_ptr<DemSidecar> open(const std::string& path, const std::string& dem_path);
+
+		// Writes the sidecar of the first band of dem (through a temporary file, so concurrent
+		// processes never see a partial one)
+		static void create(const std::string& path, const std::string& dem_path, GDALDataset* dem, double min_value, double max_value);
+
+		GDALDataType data_type() const { return static_cast<GDALDataType>(_header->data_type); }
+		int width() const { return _header->width; }
+		int height() const { return _header->height; }
+		const double* geotransform() const { return _header->geotransform; }
+		bool has_nodata() const { return _header->has_nodata != 0; }
+		double nodata() const { return _header->nodata; }
+		double min_value() const { return _header->min_value; }
+		double max_value() const { return _header->max_value; }
+		bool has_wkt() const { return _header->has_wkt != 0; }
+		const std::string& wkt() const { return _wkt; }
+
+		const void* data() const { return _file.data() + _header->data_offset; }
+	};
+
+}
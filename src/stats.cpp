@@ -0,0 +1,237 @@
+#include <fstream>
+#include <stdexcept>
+
+#include "../vendor/json.hpp"
+
+#include "stats.hpp"
+
+using json = nlohmann::json;
+
+namespace orthorectify {
+
+	const char* get_stage_name(const Stage stage)
+	{
+		switch (stage)
+		{
+		case LoadStage: return "load";
+		case SetupStage: return "setup";
+		case ProjectionStage: return "projection";
+		case VisibilityStage: return "visibility";
+		case SamplingStage: return "sampling";
+		case WriteStage: return "write";
+		default: return "unknown";
+		}
+	}
+
+	void ShotCounters::add(const ShotCounters& other)
+	{
+		cells += other.cells;
+		in_image += other.in_image;
+		occluded += other.occluded;
+		rays += other.rays;
+		ray_steps += other.ray_steps;
+		bytes_read += other.bytes_read;
+		bytes_written += other.bytes_written;
+	}
+
+	static json stages_json(const double* seconds, const uint64_t* spans)
+	{
+		json stages = json::object();
+
+		for (auto s = 0; s < StageCount; s++)
+			stages[get_stage_name(static_cast<Stage>(s))] = { { "seconds", seconds[s] }, { "spans", spans[s] } };
+
+		return stages;
+	}
+
+	static json counters_json(const ShotCounters& counters)
+	{
+		return {
+			{ "cells", counters.cells },
+			{ "in_image", counters.in_image },
+			{ "occluded", counters.occluded },
+			{ "occluded_fraction", counters.in_image > 0 ? static_cast<double>(counters.occluded) / counters.in_image : 0.0 },
+			{ "rays", counters.rays },
+			{ "average_ray_steps", counters.rays > 0 ? static_cast<double>(counters.ray_steps) / counters.rays : 0.0 },
+			{ "bytes_read", counters.bytes_read },
+			{ "bytes_written", counters.bytes_written }
+		};
+	}
+
+	static void write_file(const std::string& path, const json& document)
+	{
+		std::ofstream out(path, std::ios::trunc);
+
+		if (!out.is_open())
+			throw std::runtime_error("Could not create " + path);
+
+		out << document.dump(1, '\t') << std::endl;
+
+		if (!out.good())
+			throw std::runtime_error("Could not write " + path);
+	}
+
+	Stats::Stats(const bool tracing)
+	{
+		this->_tracing = tracing;
+		this->_start = std::chrono::steady_clock::now();
+	}
+
+	// Called with the mutex held
+	int Stats::_thread_index()
+	{
+		const auto id = std::this_thread::get_id();
+		const auto it = _threads.find(id);
+
+		if (it != _threads.end())
+			return it->second;
+
+		const auto index = static_cast<int>(_thread_totals.size());
+
+		_threads[id] = index;
+		_thread_totals.emplace_back();
+
+		return index;
+	}
+
+	// Called with the mutex held
+	Stats::Totals& Stats::_shot(const std::string& shot_id)
+	{
+		const auto it = _shots.find(shot_id);
+
+		if (it != _shots.end())
+			return it->second;
+
+		_shot_order.push_back(shot_id);
+
+		return _shots[shot_id];
+	}
+
+	void Stats::add_span(const std::string& shot_id, const Stage stage, const int64_t start, const int64_t duration)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		const auto thread = _thread_index();
+		const auto seconds = duration * 1e-9;
+
+		auto& shot = _shot(shot_id);
+		shot.seconds[stage] += seconds;
+		shot.spans[stage]++;
+
+		auto& totals = _thread_totals[thread];
+		totals.seconds[stage] += seconds;
+		totals.spans[stage]++;
+
+		if (_tracing)
+			_events.push_back(TraceEvent{ get_stage_name(stage), shot_id, thread, start, duration, "" });
+	}
+
+	void Stats::add_time(const std::string& shot_id, const Stage stage, const int64_t duration)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		const auto thread = _thread_index();
+		const auto seconds = duration * 1e-9;
+
+		_shot(shot_id).seconds[stage] += seconds;
+		_thread_totals[thread].seconds[stage] += seconds;
+	}
+
+	void Stats::trace(const std::string& shot_id, const std::string& name, const int64_t start, const int64_t duration, const std::string& args)
+	{
+		if (!_tracing)
+			return;
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_events.push_back(TraceEvent{ name, shot_id, _thread_index(), start, duration, args });
+	}
+
+	void Stats::add_counters(const std::string& shot_id, const ShotCounters& counters)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_shot(shot_id).counters.add(counters);
+	}
+
+	void Stats::write_json(const std::string& path)
+	{
+		const auto elapsed = now();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		double seconds[StageCount] = {};
+		uint64_t spans[StageCount] = {};
+		ShotCounters counters;
+
+		json shots = json::array();
+
+		for (const auto& shot_id : _shot_order)
+		{
+			const auto& shot = _shots.at(shot_id);
+
+			for (auto s = 0; s < StageCount; s++)
+			{
+				seconds[s] += shot.seconds[s];
+				spans[s] += shot.spans[s];
+			}
+
+			counters.add(shot.counters);
+
+			shots.push_back({
+				{ "id", shot_id },
+				{ "stages", stages_json(shot.seconds, shot.spans) },
+				{ "counters", counters_json(shot.counters) }
+			});
+		}
+
+		json threads = json::array();
+
+		for (size_t t = 0; t < _thread_totals.size(); t++)
+		{
+			threads.push_back({
+				{ "thread", t },
+				{ "stages", stages_json(_thread_totals[t].seconds, _thread_totals[t].spans) }
+			});
+		}
+
+		write_file(path, {
+			{ "seconds", elapsed * 1e-9 },
+			{ "stages", stages_json(seconds, spans) },
+			{ "counters", counters_json(counters) },
+			{ "shots", shots },
+			{ "threads", threads }
+		});
+	}
+
+	void Stats::write_trace(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		json events = json::array();
+
+		for (size_t t = 0; t < _thread_totals.size(); t++)
+			events.push_back({ { "name", "thread_name" }, { "ph", "M" }, { "pid", 1 }, { "tid", t }, { "args", { { "name", "Thread " + std::to_string(t) } } } });
+
+		for (const auto& event : _events)
+		{
+			auto args = event.args.empty() ? json::object() : json::parse(event.args);
+			args["shot"] = event.shot_id;
+
+			// Timestamps are in microseconds
+			events.push_back({
+				{ "name", event.name },
+				{ "cat", event.shot_id },
+				{ "ph", "X" },
+				{ "ts", event.start * 1e-3 },
+				{ "dur", event.duration * 1e-3 },
+				{ "pid", 1 },
+				{ "tid", event.thread },
+				{ "args", args }
+			});
+		}
+
+		write_file(path, { { "traceEvents", events }, { "displayTimeUnit", "ms" } });
+	}
+
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace orthorectify {
+
+	enum Stage
+	{
+		// Source image decoding
+		LoadStage = 0,
+		// Footprint, DEM window and the visibility structures of a shot (sweep, depth buffer)
+		SetupStage,
+		ProjectionStage,
+		VisibilityStage,
+		SamplingStage,
+		// Output encoding (the crop happens while writing), or blending in mosaic mode
+		WriteStage,
+		StageCount
+	};
+
+	const char* get_stage_name(Stage stage);
+
+	struct ShotCounters
+	{
+		// Cells of the footprint projected
+		uint64_t cells = 0;
+
+		// Cells that fall inside the image
+		uint64_t in_image = 0;
+
+		// Visibility tests that found the cell hidden
+		uint64_t occluded = 0;
+
+		// Rays walked by the ray visibility test, and the steps they took (DEM cells tested
+		// and height pyramid blocks skipped, up to the DEM edge or the early exit)
+		uint64_t rays = 0;
+		uint64_t ray_steps = 0;
+
+		// Decoded source pixels and output pixels (uncompressed)
+		uint64_t bytes_read = 0;
+		uint64_t bytes_written = 0;
+
+		void add(const ShotCounters& other);
+	};
+
+	// Time spent in each stage and counters, per shot and per thread, with an optional
+	// trace of the stage spans. All the methods are thread safe
+	class Stats
+	{
+		struct Totals
+		{
+			double seconds[StageCount] = {};
+			uint64_t spans[StageCount] = {};
+			ShotCounters counters;
+		};
+
+		struct TraceEvent
+		{
+			std::string name;
+			std::string shot_id;
+			int thread;
+			int64_t start;
+			int64_t duration;
+
+			// JSON object shown with the span (i.e. the counters of a tile), may be empty
+			std::string args;
+		};
+
+		bool _tracing;
+		std::chrono::steady_clock::time_point _start;
+
+		std::mutex _mutex;
+		std::unordered_map<std::thread::id, int> _threads;
+		std::vector<Totals> _thread_totals;
+		std::unordered_map<std::string, Totals> _shots;
+		std::vector<std::string> _shot_order;
+		std::vector<TraceEvent> _events;
+
+		int _thread_index();
+		Totals& _shot(const std::string& shot_id);
+
+	public:
+
+		// Trace events are kept only when tracing
+		explicit Stats(bool tracing);
+
+		bool tracing() const { return _tracing; }
+
+		// Nanoseconds since the stats were created, times are all in nanoseconds
+		int64_t now() const
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+		}
+
+		// Adds a stage span of the calling thread, [start, start + duration)
+		void add_span(const std::string& shot_id, Stage stage, int64_t start, int64_t duration);
+
+		// Adds time to a stage without a span of its own (i.e. summed over the rows of a tile)
+		void add_time(const std::string& shot_id, Stage stage, int64_t duration);
+
+		// Adds a trace event of the calling thread that is not a stage, when tracing
+		void trace(const std::string& shot_id, const std::string& name, int64_t start, int64_t duration, const std::string& args = "");
+
+		void add_counters(const std::string& shot_id, const ShotCounters& counters);
+
+		// Totals, per stage, per shot and per thread
+		void write_json(const std::string& path);
+
+		// Chrome trace event format (chrome://tracing, Perfetto)
+		void write_trace(const std::string& path);
+	};
+
+	// Times a scope as a stage span, does nothing without stats
+	class StageTimer
+	{
+		Stats* _stats;
+		const std::string& _shot_id;
+		Stage _stage;
+		int64_t _start;
+
+	public:
+
+		StageTimer(Stats* stats, const std::string& shot_id, const Stage stage) : _shot_id(shot_id) {
+			this->_stats = stats;
+			this->_stage = stage;
+			this->_start = stats != nullptr ? stats->now() : 0;
+		}
+
+		~StageTimer()
+		{
+			if (_stats != nullptr)
+				_stats->add_span(_shot_id, _stage, _start, _stats->now() - _start);
+		}
+
+		StageTimer(const StageTimer&) = delete;
+		StageTimer& operator=(const StageTimer&) = delete;
+	};
+
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
+#include "utils.hpp"
+
 namespace orthorectify {
 
     class Transform {
@@ -39,6 +43,60 @@ namespace orthorectify {
 
     };
 
+    // Grid of the output pixels, sharing the origin of the DEM. Its pixels can be smaller or
+    // larger than the DEM cells, scale_x and scale_y are the number of pixels per DEM cell
+    struct OutputGrid
+    {
+        double geotransform[6];
+        Transform transform;
+
+        int width;
+        int height;
+
+        double scale_x;
+        double scale_y;
+
+        // resolution is the pixel size in georeferenced units, 0 to use the DEM one
+        OutputGrid(const double dem_geotransform[6], const int dem_width, const int dem_height, const double resolution) :
+            geotransform{ dem_geotransform[0], dem_geotransform[1], dem_geotransform[2], dem_geotransform[3], dem_geotransform[4], dem_geotransform[5] },
+            transform(geotransform) {
+
+            this->scale_x = 1;
+            this->scale_y = 1;
+
+            if (resolution > 0)
+            {
+                this->scale_x = std::abs(dem_geotransform[1]) / resolution;
+                this->scale_y = std::abs(dem_geotransform[5]) / resolution;
+
+                geotransform[1] = dem_geotransform[1] < 0 ? -resolution : resolution;
+                geotransform[5] = dem_geotransform[5] < 0 ? -resolution : resolution;
+
+                transform = Transform(geotransform);
+            }
+
+            this->width = MAX(1, static_cast<int>(std::ceil(dem_width * scale_x - 0.5)));
+            this->height = MAX(1, static_cast<int>(std::ceil(dem_height * scale_y - 0.5)));
+        }
+
+        // Output pixels are the DEM cells
+        bool native() const { return scale_x == 1 && scale_y == 1; }
+
+        // DEM cell holding the center of pixel x (or y)
+        int cell_x(const int x) const { return static_cast<int>(std::floor((x + 0.5) / scale_x)); }
+        int cell_y(const int y) const { return static_cast<int>(std::floor((y + 0.5) / scale_y)); }
+
+        // Fractional DEM grid coordinates of the center of pixel x (or y), cell centers are integers
+        double grid_x(const int x) const { return (x + 0.5) / scale_x - 0.5; }
+        double grid_y(const int y) const { return (y + 0.5) / scale_y - 0.5; }
+
+        // First and last pixels whose center is in DEM cell x (or y), last < first when there is none
+        int first_pixel_x(const int x) const { return static_cast<int>(std::ceil(x * scale_x - 0.5)); }
+        int first_pixel_y(const int y) const { return static_cast<int>(std::ceil(y * scale_y - 0.5)); }
+        int last_pixel_x(const int x) const { return first_pixel_x(x + 1) - 1; }
+        int last_pixel_y(const int y) const { return first_pixel_y(y + 1) - 1; }
+    };
+
     struct DemInfo
 	{
 		double a1;
@@ -59,14 +117,25 @@ namespace orthorectify {
 		double dem_offset_y;
 		Transform& transform;
 
+		// DEM grid coordinates where the ray through image point (cpx, cpy) is at height dem_min_value
+		void get_coordinates(
+			const double cpx,
+			const double cpy,
+			double& x,
+			double& y)
+		{
+			get_coordinates(cpx, cpy, this->dem_min_value, x, y);
+		}
+
+		// DEM grid coordinates where the ray through image point (cpx, cpy) is at height Za
 		void get_coordinates(
 			const double cpx,
 			const double cpy,
+			const double Za,
 			double& x,
 			double& y)
 		{
 
-			const auto Za = this->dem_min_value;
 			const auto m = (a3 * b1 * cpy - a1 * b3 * cpy - (a3 * b2 - a2 * b3) * cpx - (a2 * b1 - a1 * b2) * f);
 			const auto Xa = static_cast<double>(this->dem_offset_x) + (m * Xs + (b3 * c1 * cpy - b1 * c3 * cpy - (b3 * c2 - b2 * c3) * cpx - (b2 * c1 - b1 * c2) * f) * Za - (b3 * c1 * cpy - b1 * c3 * cpy - (b3 * c2 - b2 * c3) * cpx - (b2 * c1 - b1 * c2) * f) * Zs) / m;
 			const auto Ya = static_cast<double>(this->dem_offset_y) + (m * Ys - (a3 * c1 * cpy - a1 * c3 * cpy - (a3 * c2 - a2 * c3) * cpx - (a2 * c1 - a1 * c2) * f) * Za + (a3 * c1 * cpy - a1 * c3 * cpy - (a3 * c2 - a2 * c3) * cpx - (a2 * c1 - a1 * c2) * f) * Zs) / m;
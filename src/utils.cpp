@@ -2,11 +2,21 @@
 #include <filesystem>
 #include <fstream>
 
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#include "cpl_multiproc.h"
+
 #include "utils.hpp"
 
 
 namespace orthorectify {
 
+	// Fraction of the DEM range approximate min/max are widened by
+	static constexpr double approximate_stats_margin = 0.1;
+
 	std::vector<std::string> split(const std::string& s, const std::string& delimiter) {
 
 		size_t pos_start = 0, pos_end;
@@ -101,18 +111,62 @@ namespace orthorectify {
 
 	void get_band_min_max(GDALRasterBand* demBand, double& dem_min_value, double& dem_max_value, bool approximate)
 	{
+		// Statistics stored in the file or in its .aux.xml (by GDAL or by a previous run)
+		int has_min, has_max;
+		const auto stored_min = demBand->GetMinimum(&has_min);
+		const auto stored_max = demBand->GetMaximum(&has_max);
+
+		const auto* stored_approximate = demBand->GetMetadataItem("STATISTICS_APPROXIMATE");
+		const bool stored_exact = stored_approximate == nullptr || !EQUAL(stored_approximate, "YES");
+
 		double adfMinMax[2];
+		bool exact;
 
-		// I don't know if we have to use no approximation and scan all the pixels (sounds very inefficient to me)
-		if (demBand->ComputeRasterMinMax(approximate ? 1 : 0, adfMinMax) != CE_None || adfMinMax[0] == adfMinMax[1])
+		if (has_min && has_max && stored_min < stored_max && (stored_exact || approximate))
 		{
-			ERR << "Error: could not compute DEM min/max";
-			exit(1);
+			DBG << "Using stored DEM statistics" << (stored_exact ? "" : " (approximate)");
+
+			adfMinMax[0] = stored_min;
+			adfMinMax[1] = stored_max;
+			exact = stored_exact;
+		}
+		else
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			if (demBand->ComputeRasterMinMax(approximate ? 1 : 0, adfMinMax) != CE_None || adfMinMax[0] == adfMinMax[1])
+			{
+				ERR << "Error: could not compute DEM min/max";
+				exit(1);
+			}
+
+			DBG << "Computed DEM statistics in " << human_duration(std::chrono::high_resolution_clock::now() - start);
+
+			// Kept in the .aux.xml next to the DEM (written when it is closed) for the next runs
+			std::ostringstream min_str, max_str;
+			min_str << std::setprecision(17) << adfMinMax[0];
+			max_str << std::setprecision(17) << adfMinMax[1];
+
+			demBand->SetMetadataItem("STATISTICS_MINIMUM", min_str.str().c_str());
+			demBand->SetMetadataItem("STATISTICS_MAXIMUM", max_str.str().c_str());
+			demBand->SetMetadataItem("STATISTICS_APPROXIMATE", approximate ? "YES" : nullptr);
+
+			exact = !approximate;
 		}
 
 		dem_min_value = adfMinMax[0];
 		dem_max_value = adfMinMax[1];
 
+		// Approximate statistics come from overviews or from a subset of the cells,
+		// widen them so that they still bound every cell
+		if (!exact)
+		{
+			const auto margin = (dem_max_value - dem_min_value) * approximate_stats_margin;
+
+			dem_min_value -= margin;
+			dem_max_value += margin;
+		}
+
 	}
 
 	void print_bands_info(GDALDataset* ds)
@@ -132,57 +186,6 @@ namespace orthorectify {
 		}
 	}
 
-    // Generate line pixel coordinates
-	void line(int startx, int starty, int endx, int endy, Point* out, int& cnt, int guard) {
-
-		const auto dx = endx - startx;
-		const auto dy = endy - starty;
-
-		const auto abs_dx = ABS(dx);
-		const auto abs_dy = ABS(dy);
-
-		const auto sx = dx > 0 ? 1 : -1;
-		const auto sy = dy > 0 ? 1 : -1;
-
-		auto err = abs_dx - abs_dy;
-
-		auto idx = 0;
-
-		while (true) {
-
-			if (idx >= guard)
-			{
-				std::cout << std::endl;
-			}
-
-			auto& p = out[idx];
-
-			p.x = startx;
-			p.y = starty;
-
-			if (startx == endx && starty == endy)
-				break;
-
-			const auto e2 = 2 * err;
-
-			if (e2 > -abs_dy) {
-				err -= abs_dy;
-				startx += sx;
-			}
-
-			if (e2 < abs_dx) {
-				err += abs_dx;
-				starty += sy;
-			}
-
-			idx++;
-
-		}
-
-		cnt = idx + 1;
-
-	}
-
 	std::string str_conv(const Mat3d& mtrx)
 	{
 		std::ostringstream stream;
@@ -204,5 +207,66 @@ namespace orthorectify {
 		return ss.str();
 	}
 
+	int64_t get_mtime(const std::string& path)
+	{
+		return static_cast<int64_t>(fs::last_write_time(path).time_since_epoch().count());
+	}
+
+	std::string get_temp_path(const std::string& path)
+	{
+		static std::atomic<uint64_t> counter(0);
+
+		return path + "." + std::to_string(CPLGetPID()) + "." + std::to_string(counter.fetch_add(1)) + ".tmp";
+	}
+
+	void write_file_atomically(const std::string& path, const std::function<void(const std::string& tmp_path)>& write)
+	{
+		const auto tmp_path = get_temp_path(path);
+
+		try
+		{
+			write(tmp_path);
+			fs::rename(tmp_path, path);
+		}
+		catch (...)
+		{
+			std::error_code error;
+			fs::remove(tmp_path, error);
+			throw;
+		}
+	}
+
+	void write_stream_atomically(const std::string& path, const std::function<void(std::ostream& out)>& write, const bool binary)
+	{
+		write_file_atomically(path, [&write, binary](const std::string& tmp_path) {
+
+			std::ofstream out(tmp_path, binary ? std::ios::binary | std::ios::trunc : std::ios::trunc);
+
+			if (!out.is_open())
+				throw std::runtime_error("Could not create " + tmp_path);
+
+			write(out);
+			out.close();
+
+			if (!out.good())
+				throw std::runtime_error("Could not write " + tmp_path);
+		});
+	}
+
+	GDALColorInterp get_color_interpretation(const int band, const int bands, const bool has_alpha)
+	{
+		const auto color_bands = has_alpha ? bands - 1 : bands;
+
+		if (band >= color_bands)
+			return GCI_AlphaBand;
+
+		if (color_bands == 3)
+		{
+			const GDALColorInterp rgb[3] = { GCI_RedBand, GCI_GreenBand, GCI_BlueBand };
+			return rgb[band];
+		}
+
+		return color_bands == 1 ? GCI_GrayIndex : GCI_Undefined;
+	}
 
-}
\ No newline at end of file
+}
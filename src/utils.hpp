@@ -4,6 +4,7 @@
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 
 #include <plog/Log.h>
 #include <plog/Formatters/TxtFormatter.h>
@@ -27,9 +28,12 @@ namespace orthorectify {
 		Bilinear = 2
 	};
 
-	struct Point {
-		int x;
-		int y;
+	enum VisibilityTest
+	{
+		NoVisibilityTest = 0,
+		RayCast = 1,
+		RadialSweep = 2,
+		DepthTest = 3
 	};
 
 	std::vector<std::string> split(const std::string& s, const std::string& delimiter);
@@ -40,11 +44,26 @@ namespace orthorectify {
 	void pretty_print_crs(const char* demWkt);
 	void get_band_min_max(GDALRasterBand* demBand, double& dem_min_value, double& dem_max_value, bool approximate = false);
 	void print_bands_info(GDALDataset* ds);
-	
-	// Generate line pixel coordinates
-	void line(int startx, int starty, int endx, int endy, Point* out, int& cnt, int guard);
 
 	std::string str_conv(const Mat3d& mtrx);
 
 	std::string get_formatted_date_time();
+
+	// Modification time of a file, only meant to be compared with the value from an earlier run
+	int64_t get_mtime(const std::string& path);
+
+	// Path of a temporary file next to path, unique per process and call. It ends with .tmp
+	// instead of the extension of path, so that nothing looking for the outputs picks it up
+	std::string get_temp_path(const std::string& path);
+
+	// Writes a file through a temporary one (see get_temp_path) that is renamed over path once
+	// write returns: a run stopped halfway never leaves a partial file behind and concurrent
+	// processes never see one. The temporary file is removed when write throws
+	void write_file_atomically(const std::string& path, const std::function<void(const std::string& tmp_path)>& write);
+
+	// Same, write fills the stream. Throws when the file cannot be created or written
+	void write_stream_atomically(const std::string& path, const std::function<void(std::ostream& out)>& write, bool binary = false);
+
+	// Color interpretation of band (0 based) of an image with the given bands (alpha included, last)
+	GDALColorInterp get_color_interpretation(int band, int bands, bool has_alpha);
 }
\ No newline at end of file
@@ -0,0 +1,472 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "utils.hpp"
+#include "dem.hpp"
+
+namespace orthorectify {
+
+	// Quadtree of DEM block maxima. Level 0 holds the maximum height of each
+	// base_size x base_size block of cells, every following level the maximum of
+	// 2x2 blocks of the previous one, up to a single block covering the whole DEM
+	class HeightPyramid
+	{
+		struct Level
+		{
+			int width;
+			int height;
+			std::vector<float> max;
+		};
+
+		std::vector<Level> _levels;
+
+	public:
+
+		static constexpr int base_shift = 3;
+		static constexpr int base_size = 1 << base_shift;
+
+		template <typename T>
+		explicit HeightPyramid(DemSource<T>& dem)
+		{
+			Level base;
+			base.width = (dem.width() + base_size - 1) / base_size;
+			base.height = (dem.height() + base_size - 1) / base_size;
+			base.max.assign(static_cast<size_t>(base.width) * base.height, std::numeric_limits<float>::lowest());
+
+			// Scan the DEM in windows, it might not be in memory
+			constexpr int chunk = 1024;
+
+			for (auto y0 = 0; y0 < dem.height(); y0 += chunk)
+			{
+				for (auto x0 = 0; x0 < dem.width(); x0 += chunk)
+				{
+					const auto window = dem.window(x0, y0, x0 + chunk - 1, y0 + chunk - 1);
+
+					for (auto y = window.y0(); y <= window.y1(); y++)
+					{
+						const auto* row = window.row(window.x0(), y);
+						auto* max = base.max.data() + static_cast<size_t>(y >> base_shift) * base.width;
+
+						for (auto x = window.x0(); x <= window.x1(); x++)
+						{
+							const auto value = static_cast<float>(row[x - window.x0()]);
+							auto& block_max = max[x >> base_shift];
+
+							if (value > block_max) block_max = value;
+						}
+					}
+				}
+			}
+
+			_levels.emplace_back(std::move(base));
+
+			while (_levels.back().width > 1 || _levels.back().height > 1)
+			{
+				const auto& prev = _levels.back();
+
+				Level next;
+				next.width = (prev.width + 1) / 2;
+				next.height = (prev.height + 1) / 2;
+				next.max.assign(static_cast<size_t>(next.width) * next.height, std::numeric_limits<float>::lowest());
+
+				for (auto y = 0; y < prev.height; y++)
+					for (auto x = 0; x < prev.width; x++)
+					{
+						auto& block_max = next.max[static_cast<size_t>(y / 2) * next.width + x / 2];
+						block_max = MAX(block_max, prev.max[static_cast<size_t>(y) * prev.width + x]);
+					}
+
+				_levels.emplace_back(std::move(next));
+			}
+		}
+
+		int levels() const { return static_cast<int>(_levels.size()); }
+
+		// Maximum height of the level block containing cell (x, y)
+		float max(const int level, const int x, const int y) const
+		{
+			const auto& l = _levels[level];
+			const auto shift = base_shift + level;
+
+			return l.max[static_cast<size_t>(y >> shift) * l.width + (x >> shift)];
+		}
+	};
+
+	// Walks the ray from a DEM cell back to the camera one cell at a time.
+	// Distance and ray height are worked out incrementally along the way,
+	// so no distance map or point list is needed. Rays are clipped to the
+	// DEM window, which must span the cells and the camera clamped to the DEM.
+	// With a height pyramid, blocks that lie below the ray are skipped whole
+	template <typename T>
+	class RayWalker
+	{
+		const DemWindow<T>& _dem;
+		const HeightPyramid* _pyramid;
+
+		double _cam_x;
+		double _cam_y;
+		int _cam_x_int;
+		int _cam_y_int;
+		double _cam_z;
+
+		double _dem_max_value;
+
+	public:
+
+		RayWalker(const DemWindow<T>& dem, const HeightPyramid* pyramid, double cam_x, double cam_y, double cam_z, double dem_max_value) : _dem(dem) {
+			this->_pyramid = pyramid;
+			this->_cam_x = cam_x;
+			this->_cam_y = cam_y;
+			this->_cam_x_int = static_cast<int>(cam_x);
+			this->_cam_y_int = static_cast<int>(cam_y);
+			this->_cam_z = cam_z;
+			this->_dem_max_value = dem_max_value;
+		}
+
+		// Returns true if the cell (x, y) at height z can be seen from the camera
+		bool visible(const int x, const int y, const double z) const
+		{
+			int64_t steps;
+			return visible(x, y, z, steps);
+		}
+
+		// Same, walked is set to the steps taken along the ray (cells tested and blocks skipped)
+		bool visible(const int x, const int y, const double z, int64_t& walked) const
+		{
+			walked = 0;
+
+			const auto dx = _cam_x_int - x;
+			const auto dy = _cam_y_int - y;
+
+			const auto abs_dx = ABS(dx);
+			const auto abs_dy = ABS(dy);
+
+			// We step one cell at a time along the major axis
+			const bool x_major = abs_dx >= abs_dy;
+
+			const int64_t steps = x_major ? abs_dx : abs_dy;
+			if (steps == 0)
+				return true;
+
+			const int64_t minor_delta = x_major ? abs_dy : abs_dx;
+
+			const int major_step = (x_major ? dx : dy) > 0 ? 1 : -1;
+			const int minor_step = (x_major ? dy : dx) > 0 ? 1 : -1;
+
+			const int major0 = x_major ? x : y;
+			const int minor0 = x_major ? y : x;
+
+			const int major_lo = x_major ? _dem.x0() : _dem.y0();
+			const int major_hi = x_major ? _dem.x1() : _dem.y1();
+			const int minor_lo = x_major ? _dem.y0() : _dem.x0();
+			const int minor_hi = x_major ? _dem.y1() : _dem.x1();
+
+			// Clip the ray to the DEM extent before walking it: once a ray leaves
+			// the DEM it never comes back, so there is nothing left to test
+			int64_t max_steps = major_step > 0 ? major_hi - major0 : major0 - major_lo;
+			max_steps = MIN(max_steps, steps);
+
+			if (minor_delta > 0)
+			{
+				const int64_t limit = minor_step > 0 ? minor_hi - minor0 : minor0 - minor_lo;
+				max_steps = MIN(max_steps, ((2 * limit + 1) * steps - 1) / (2 * minor_delta));
+			}
+
+			// Distance to the camera along the major axis, ray height grows linearly with it
+			auto distance = std::abs((x_major ? _cam_x : _cam_y) - (x_major ? x : y));
+			if (distance == 0) distance = 1e-7;
+
+			const auto z_step = (_cam_z - z) / distance;
+
+			// Minor axis offset after n steps is round(n * minor_delta / steps), worked out with integers
+			const auto two_steps = 2 * steps;
+
+			// Blocks can only be skipped while the ray rises: then no cell of a block that
+			// is below the ray where we are gets above the ray further on
+			const auto levels = _pyramid != nullptr && z_step >= 0 ? _pyramid->levels() : 0;
+
+			int64_t n = 1;
+
+			while (n <= max_steps)
+			{
+				walked++;
+
+				const auto ray_z = z + n * z_step;
+
+				if (ray_z > _dem_max_value)
+					return true;
+
+				const auto minor_offset = (steps + 2 * n * minor_delta) / two_steps;
+
+				const auto major = major0 + static_cast<int>(n) * major_step;
+				const auto minor = minor0 + static_cast<int>(minor_offset) * minor_step;
+
+				const auto px = x_major ? major : minor;
+				const auto py = x_major ? minor : major;
+
+				// Coarsest block containing the cell that is entirely below the ray
+				auto level = -1;
+				while (level + 1 < levels && _pyramid->max(level + 1, px, py) < ray_z)
+					level++;
+
+				if (level < 0)
+				{
+					if (static_cast<double>(_dem.at(px, py)) > ray_z)
+						return false;
+
+					n++;
+					continue;
+				}
+
+				// Jump to the first cell past the block
+				const auto shift = HeightPyramid::base_shift + level;
+
+				const auto block_major_lo = (major >> shift) << shift;
+				const auto block_major_hi = block_major_lo + (1 << shift) - 1;
+
+				auto next = n + 1 + (major_step > 0 ? block_major_hi - major : major - block_major_lo);
+
+				if (minor_delta > 0)
+				{
+					const auto block_minor_lo = (minor >> shift) << shift;
+					const auto block_minor_hi = block_minor_lo + (1 << shift) - 1;
+
+					// First step whose minor offset is past the block
+					const int64_t exit_offset = 1 + (minor_step > 0 ? block_minor_hi - minor0 : minor0 - block_minor_lo);
+					const auto minor_exit = (exit_offset * two_steps - steps + 2 * minor_delta - 1) / (2 * minor_delta);
+
+					next = MIN(next, minor_exit);
+				}
+
+				n = next;
+			}
+
+			return true;
+		}
+	};
+
+	// Computes a visibility mask for a whole shot in one pass, sweeping rings of
+	// increasing distance outward from the camera cell (XDraw-style viewshed).
+	// A cell is visible when its slope towards the camera is not below the horizon
+	// slope of the cells in between, which is interpolated from the previous ring
+	template <typename T>
+	class HorizonSweep
+	{
+		// Swept region (contains the shot bbox and the camera clamped to the DEM)
+		int _x0;
+		int _y0;
+		int _x1;
+		int _y1;
+		int _width;
+
+		std::vector<float> _horizon;
+		std::vector<uint8_t> _visible;
+
+		static constexpr float no_horizon = std::numeric_limits<float>::lowest();
+
+		float horizon_at(const int x, const int y) const
+		{
+			if (x < _x0 || y < _y0 || x > _x1 || y > _y1)
+				return no_horizon;
+
+			return _horizon[static_cast<size_t>(y - _y0) * _width + (x - _x0)];
+		}
+
+		float interpolate_horizon(const int ax, const int ay, const int bx, const int by, const double t) const
+		{
+			const auto a = horizon_at(ax, ay);
+			if (t == 0) return a;
+
+			const auto b = horizon_at(bx, by);
+
+			// Cells outside the swept region (i.e. outside the DEM) never occlude
+			if (a == no_horizon) return b;
+			if (b == no_horizon) return a;
+
+			return static_cast<float>(a + (b - a) * t);
+		}
+
+	public:
+
+		HorizonSweep(const DemWindow<T>& dem, bool has_nodata, double nodata_value,
+			double cam_x, double cam_y, double cam_z, int minx, int miny, int maxx, int maxy)
+		{
+			const auto cx = static_cast<int>(cam_x);
+			const auto cy = static_cast<int>(cam_y);
+
+			const auto clamped_cx = std::clamp(cx, dem.x0(), dem.x1());
+			const auto clamped_cy = std::clamp(cy, dem.y0(), dem.y1());
+
+			// The part of any ray that lies inside the DEM stays within the box
+			// spanned by its cell and the clamped camera position
+			this->_x0 = MIN(minx, clamped_cx);
+			this->_y0 = MIN(miny, clamped_cy);
+			this->_x1 = MAX(maxx, clamped_cx);
+			this->_y1 = MAX(maxy, clamped_cy);
+			this->_width = 1 + _x1 - _x0;
+
+			const auto size = static_cast<size_t>(_width) * (1 + _y1 - _y0);
+
+			_horizon.assign(size, no_horizon);
+			_visible.assign(size, 0);
+
+			const auto process = [&](const int x, const int y) {
+
+				const auto dx = x - cx;
+				const auto dy = y - cy;
+
+				const auto abs_dx = ABS(dx);
+				const auto abs_dy = ABS(dy);
+				const auto k = MAX(abs_dx, abs_dy);
+
+				// Horizon slope of the cells between this one and the camera, taken from
+				// where the line of sight crosses the previous ring
+				auto horizon = no_horizon;
+
+				if (k > 0)
+				{
+					const auto ratio = static_cast<double>(k - 1) / k;
+
+					if (abs_dx >= abs_dy)
+					{
+						const auto px = x - (dx > 0 ? 1 : -1);
+						const auto fy = cy + dy * ratio;
+						const auto py = static_cast<int>(std::floor(fy));
+						horizon = interpolate_horizon(px, py, px, py + 1, fy - py);
+					}
+					else
+					{
+						const auto py = y - (dy > 0 ? 1 : -1);
+						const auto fx = cx + dx * ratio;
+						const auto px = static_cast<int>(std::floor(fx));
+						horizon = interpolate_horizon(px, py, px + 1, py, fx - px);
+					}
+				}
+
+				const auto z = static_cast<double>(dem.at(x, y));
+				const auto idx = static_cast<size_t>(y - _y0) * _width + (x - _x0);
+
+				if (has_nodata && z == nodata_value)
+				{
+					_horizon[idx] = horizon;
+					return;
+				}
+
+				auto dist = std::sqrt((cam_x - x) * (cam_x - x) + (cam_y - y) * (cam_y - y));
+				if (dist == 0) dist = 1e-7;
+
+				const auto slope = static_cast<float>((z - cam_z) / dist);
+
+				_visible[idx] = slope >= horizon;
+				_horizon[idx] = MAX(horizon, slope);
+			};
+
+			// Chebyshev distance range of the region from the camera cell
+			const auto kmin = MAX(0, MAX(MAX(_x0 - cx, cx - _x1), MAX(_y0 - cy, cy - _y1)));
+			const auto kmax = MAX(MAX(ABS(_x0 - cx), ABS(_x1 - cx)), MAX(ABS(_y0 - cy), ABS(_y1 - cy)));
+
+			// Cells of a ring only depend on the previous ring
+			for (auto k = kmin; k <= kmax; k++)
+			{
+				const auto top = cy - k;
+				const auto bottom = cy + k;
+				const auto left = cx - k;
+				const auto right = cx + k;
+
+				const auto xa = MAX(_x0, left);
+				const auto xb = MIN(_x1, right);
+
+				if (top >= _y0 && top <= _y1)
+					for (auto x = xa; x <= xb; x++) process(x, top);
+
+				if (k > 0 && bottom >= _y0 && bottom <= _y1)
+					for (auto x = xa; x <= xb; x++) process(x, bottom);
+
+				const auto ya = MAX(_y0, top + 1);
+				const auto yb = MIN(_y1, bottom - 1);
+
+				if (left >= _x0 && left <= _x1)
+					for (auto y = ya; y <= yb; y++) process(left, y);
+
+				if (k > 0 && right >= _x0 && right <= _x1)
+					for (auto y = ya; y <= yb; y++) process(right, y);
+			}
+
+			// The horizon is only needed while sweeping
+			std::vector<float>().swap(_horizon);
+		}
+
+		bool visible(const int x, const int y) const
+		{
+			return _visible[static_cast<size_t>(y - _y0) * _width + (x - _x0)] != 0;
+		}
+	};
+
+	// Image-space depth buffer, keeps the nearest camera-space depth seen by each
+	// (possibly downscaled) image pixel so that occlusion can be tested without rays
+	class DepthBuffer
+	{
+		int _width;
+		int _height;
+		double _scale;
+		double _tolerance;
+
+		std::vector<float> _depth;
+
+		// Buffer cell of an image coordinate. Quads near the camera plane project arbitrarily
+		// far (or to infinity), the coordinate is clamped to [-1, size] before the cast
+		int _cell(const double v, const int size) const
+		{
+			return static_cast<int>(std::floor(std::clamp(v / _scale, -1.0, static_cast<double>(size))));
+		}
+
+	public:
+
+		DepthBuffer(int img_width, int img_height, int scale, double tolerance) {
+			this->_scale = scale;
+			this->_tolerance = tolerance;
+			this->_width = (img_width + scale - 1) / scale;
+			this->_height = (img_height + scale - 1) / scale;
+
+			_depth.assign(static_cast<size_t>(_width) * _height, std::numeric_limits<float>::max());
+		}
+
+		int width() const { return _width; }
+		int height() const { return _height; }
+
+		// Writes depth over the image-space box [minx, maxx] x [miny, maxy] wherever it is nearer
+		void splat(const double minx, const double miny, const double maxx, const double maxy, const double depth)
+		{
+			if (std::isnan(minx) || std::isnan(miny) || std::isnan(maxx) || std::isnan(maxy))
+				return;
+
+			const auto x0 = MAX(0, _cell(minx, _width));
+			const auto y0 = MAX(0, _cell(miny, _height));
+			const auto x1 = MIN(_width - 1, _cell(maxx, _width));
+			const auto y1 = MIN(_height - 1, _cell(maxy, _height));
+
+			const auto d = static_cast<float>(depth);
+
+			for (auto y = y0; y <= y1; y++) {
+				auto* row = _depth.data() + static_cast<size_t>(y) * _width;
+				for (auto x = x0; x <= x1; x++)
+					if (d < row[x]) row[x] = d;
+			}
+		}
+
+		// Returns true if nothing nearer than depth (within tolerance) covers the image point (x, y)
+		bool visible(const double x, const double y, const double depth) const
+		{
+			const auto bx = MIN(_width - 1, static_cast<int>(x / _scale));
+			const auto by = MIN(_height - 1, static_cast<int>(y / _scale));
+
+			return depth <= _depth[static_cast<size_t>(by) * _width + bx] + _tolerance;
+		}
+	};
+
+}